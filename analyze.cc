@@ -0,0 +1,234 @@
+// This file implements AnalyzeFile.
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "./block.h"
+#include "./chunk.h"
+#include "./header.h"
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+namespace {
+
+using internal::ErrorReporter;
+using internal::Magic;
+
+// Max number of blocks compressed to estimate flate_ratio.
+constexpr int MaxSampleBlocks = 16;
+
+// Recommended blocks occupy about this many chunks. The padding of the last
+// chunk is then a few percent of the block.
+constexpr int TargetBlockChunks = 16;
+
+void AddItemSize(uint64_t size, std::vector<uint64_t>* hist) {
+  size_t b = 0;
+  while (b < 63 && (1ULL << b) <= size) b++;
+  if (hist->size() <= b) hist->resize(b + 1);
+  (*hist)[b]++;
+}
+
+class Analyzer {
+ public:
+  Analyzer(const std::string& path, FileAnalysis* a) : path_(path), a_(a) {}
+
+  Error Run() {
+    struct stat st;
+    if (stat(path_.c_str(), &st) < 0) {
+      return internal::StrError("stat " + path_);
+    }
+    a_->file_bytes = st.st_size;
+    auto r = NewRawBlockReader(path_);
+    bool first = true;
+    while (err_.Ok() && r->Scan()) {
+      const Magic magic = r->GetMagic();
+      if (first) {
+        first = false;
+        if (!Start(magic)) break;
+      }
+      if (magic == internal::MagicHeader) {
+        ReadHeader(r->Get());
+      } else if (magic == internal::MagicPacked ||
+                 magic == internal::MagicUnpacked) {
+        AddBlock(r.get());
+      } else if (magic != internal::MagicTrailer) {
+        std::ostringstream msg;
+        msg << "Bad magic at offset " << r->Offset() << ": "
+            << internal::MagicDebugString(magic);
+        err_.Set(msg.str());
+      }
+    }
+    err_.Set(r->GetError());
+    if (!err_.Ok()) return path_ + ": " + err_.Err();
+    Recommend();
+    return "";
+  }
+
+ private:
+  // Set the format from the magic number of the first block.
+  bool Start(const Magic& magic) {
+    if (magic == internal::MagicHeader) {
+      a_->format = "v2";
+    } else if (magic == internal::MagicPacked) {
+      a_->format = "v1-packed";
+      // V1 files don't record the transformer. Follow DefaultReaderOpts.
+      if (internal::HasSuffix(path_, ".grail-rpk-gz")) {
+        a_->transformers.push_back("flate");
+      }
+    } else if (magic == internal::MagicUnpacked) {
+      a_->format = "v1-unpacked";
+    } else {
+      err_.Set("Unknown file format");
+      return false;
+    }
+    err_.Set(GetUntransformer(a_->transformers, &untransformer_));
+    return err_.Ok();
+  }
+
+  void ReadHeader(ByteSpan data) {
+    if (internal::ParseHeaderBlock(data, &a_->header, &a_->transformers,
+                                   &fixed_item_size_, &err_)) {
+      err_.Set(GetUntransformer(a_->transformers, &untransformer_));
+    }
+  }
+
+  void AddBlock(RawBlockReader* r) {
+    FileAnalysis::Block b{r->Offset(), static_cast<uint64_t>(r->Size()),
+                          0, 0, 0, 0};
+    ByteSpan raw;  // Untransformed data, for the flate sample.
+    if (a_->format == "v2") {
+      Magic magic;
+      size_t size;
+      if (!internal::ParseBlock(r->Get(), &magic, &payloads_, &size, &err_) ||
+          !block_.Parse(IoVec(&payloads_), untransformer_.get(),
+                        fixed_item_size_, &err_)) {
+        return;
+      }
+      b.transformed_bytes = IoVecSize(IoVec(&payloads_));
+      b.padding_bytes = b.file_bytes -
+                        payloads_.size() * internal::ChunkHeaderSize -
+                        b.transformed_bytes;
+      raw = block_.data();
+      b.raw_bytes = raw.size();
+      b.n_items = block_.size();
+      for (int i = 0; i < block_.size(); i++) {
+        AddItemSize(block_.Item(i).size(), &a_->item_sizes);
+      }
+    } else {
+      const ByteSpan data = r->Get();
+      const ByteSpan payload(data.data() + internal::LegacyBlockHeaderSize,
+                             data.size() - internal::LegacyBlockHeaderSize);
+      b.transformed_bytes = payload.size();
+      if (a_->format == "v1-unpacked") {
+        b.n_items = 1;
+        b.raw_bytes = payload.size();
+        raw = payload;
+        AddItemSize(payload.size(), &a_->item_sizes);
+      } else if (!AddV1PackedBlock(payload, &b, &raw)) {
+        return;
+      }
+    }
+    if (sample_.size() < MaxSampleBlocks) {
+      sample_.emplace_back(raw.begin(), raw.end());
+    }
+    a_->blocks.push_back(b);
+    a_->n_items += b.n_items;
+    a_->raw_bytes += b.raw_bytes;
+    a_->transformed_bytes += b.transformed_bytes;
+    a_->padding_bytes += b.padding_bytes;
+  }
+
+  // Parse a V1 packed payload: crc32 of the item table, the item table, and
+  // the transformed items. Sets *raw to the untransformed items.
+  bool AddV1PackedBlock(ByteSpan payload, FileAnalysis::Block* b,
+                        ByteSpan* raw) {
+    internal::BinaryParser p(payload.data(), payload.size(), &err_);
+    p.ReadLEUint32();
+    const uint64_t n = p.ReadUVarint();
+    if (!err_.Ok() || n > payload.size()) {
+      err_.Set("Invalid packed block header");
+      return false;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+      AddItemSize(p.ReadUVarint(), &a_->item_sizes);
+    }
+    if (!err_.Ok()) return false;
+    const size_t table_bytes = p.Data() - payload.data();
+    const ByteSpan items(p.Data(), payload.size() - table_bytes);
+    IoVec out;
+    err_.Set(untransformer_->Transform(IoVec(&items, 1), &out));
+    if (!err_.Ok()) return false;
+    v1_items_ = internal::IoVecFlatten(out);
+    b->n_items = n;
+    b->raw_bytes = table_bytes + v1_items_.size();
+    *raw = ByteSpan(&v1_items_);
+    return true;
+  }
+
+  void Recommend() {
+    const bool flate = a_->transformers.size() == 1 &&
+                       a_->transformers[0] == "flate";
+    if (flate && a_->raw_bytes > 0) {
+      a_->flate_ratio =
+          static_cast<double>(a_->transformed_bytes) / a_->raw_bytes;
+    } else if (!flate) {
+      auto tr = FlateTransformer();
+      uint64_t in = 0, out = 0;
+      for (const auto& data : sample_) {
+        if (data.empty()) continue;
+        ByteSpan span(&data);
+        IoVec compressed;
+        if (!tr->Transform(IoVec(&span, 1), &compressed).empty()) continue;
+        in += data.size();
+        out += IoVecSize(compressed);
+      }
+      if (in > 0) a_->flate_ratio = static_cast<double>(out) / in;
+    }
+    double ratio = 1;
+    if (a_->flate_ratio < 0.9) {
+      a_->recommended_transformers.push_back("flate");
+      ratio = a_->flate_ratio;
+    }
+
+    const double target =
+        TargetBlockChunks * static_cast<double>(internal::MaxChunkPayloadSize);
+    int64_t bytes = static_cast<int64_t>(target / std::max(ratio, 0.01));
+    bytes = std::max<int64_t>(64 << 10, bytes);
+    bytes = std::min<int64_t>(WriterDefaultMaxPackedBytes, bytes);
+    a_->recommended_max_packed_bytes = bytes & ~int64_t(1023);
+
+    // Leave room so that the item limit doesn't seal blocks before the byte
+    // limit does.
+    const double mean_item =
+        a_->n_items > 0 ? static_cast<double>(a_->raw_bytes) / a_->n_items : 1;
+    a_->recommended_max_packed_items = std::max<int64_t>(
+        1, static_cast<int64_t>(
+               std::ceil(2 * a_->recommended_max_packed_bytes /
+                         std::max(mean_item, 1.0))));
+    a_->recommend_chunk_aligned_blocks =
+        a_->format == "v2" && a_->padding_bytes * 20 > a_->file_bytes;
+  }
+
+  const std::string path_;
+  FileAnalysis* const a_;
+  ErrorReporter err_;
+  std::unique_ptr<Transformer> untransformer_;
+  uint64_t fixed_item_size_ = 0;
+  std::vector<ByteSpan> payloads_;
+  internal::Block block_;
+  std::vector<uint8_t> v1_items_;  // Untransformed items of a V1 block.
+  std::vector<std::vector<uint8_t>> sample_;  // For estimating flate_ratio.
+};
+
+}  // namespace
+
+Error AnalyzeFile(const std::string& path, FileAnalysis* analysis) {
+  *analysis = FileAnalysis();
+  return Analyzer(path, analysis).Run();
+}
+
+}  // namespace recordio
+}  // namespace grail
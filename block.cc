@@ -0,0 +1,78 @@
+#include "./block.h"
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+namespace grail {
+namespace recordio {
+
+bool internal::Block::Parse(const IoVec& raw, Transformer* tr,
+                            uint64_t fixed_item_size, ErrorReporter* err) {
+  n_items_ = 0;
+  fixed_item_size_ = fixed_item_size;
+  offsets_.clear();
+  IoVec iov = raw;
+  if (tr != nullptr) {
+    err->Set(tr->Transform(raw, &iov));
+    if (!err->Ok()) return false;
+  }
+  data_.resize(IoVecSize(iov));
+  size_t n = 0;
+  for (size_t i = 0; i < iov.size(); i++) {
+    std::copy(iov[i].begin(), iov[i].end(), data_.data() + n);
+    n += iov[i].size();
+  }
+  if (data_.empty()) return true;
+
+  BinaryParser p(data_.data(), data_.size(), err);
+  const uint64_t n_items = p.ReadUVarint();
+  if (!err->Ok()) return false;
+  // Items are indexed by int (see ItemLocation).
+  if (n_items > static_cast<uint64_t>(std::numeric_limits<int>::max())) {
+    std::ostringstream msg;
+    msg << "Block has " << n_items << " items, more than the max of "
+        << std::numeric_limits<int>::max();
+    err->Set(msg.str());
+    return false;
+  }
+  if (fixed_item_size_ > 0) {
+    items_start_ = p.Data() - data_.data();
+    const size_t remaining = data_.size() - items_start_;
+    if (remaining % fixed_item_size_ != 0 ||
+        remaining / fixed_item_size_ != n_items) {
+      std::ostringstream msg;
+      msg << "Block with " << n_items << " items of " << fixed_item_size_
+          << " bytes has " << remaining << " bytes of payload";
+      err->Set(msg.str());
+      return false;
+    }
+    n_items_ = n_items;
+    return true;
+  }
+  if (n_items > data_.size()) {
+    err->Set("Invalid block header (n_items)");
+    return false;
+  }
+  offsets_.reserve(n_items + 1);
+  uint64_t off = 0;
+  offsets_.push_back(off);
+  for (size_t i = 0; i < n_items; i++) {
+    off += p.ReadUVarint();
+    offsets_.push_back(off);
+  }
+  if (!err->Ok()) return false;
+  items_start_ = p.Data() - data_.data();
+  if (off > data_.size() - items_start_) {
+    std::ostringstream msg;
+    msg << "Block item sizes add up to " << off << " bytes, but only "
+        << data_.size() - items_start_ << " bytes are present";
+    err->Set(msg.str());
+    return false;
+  }
+  n_items_ = n_items;
+  return true;
+}
+
+}  // namespace recordio
+}  // namespace grail
@@ -0,0 +1,74 @@
+#ifndef LIB_RECORDIO_BLOCK_H_
+#define LIB_RECORDIO_BLOCK_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "./internal.h"
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+namespace internal {
+
+// Block holds the untransformed contents of one packed V2 block, along with
+// the location of each item in it.
+//
+// This class is thread compatible.
+class Block {
+ public:
+  // If huge_pages=true, large blocks are held in huge pages.
+  explicit Block(bool huge_pages = false)
+      : data_(HugePageAllocator<uint8_t>(huge_pages)) {}
+
+  // Untransform "raw" using "tr" (if non-null) and parse the item table. If
+  // fixed_item_size > 0, the block has no item-size table, and every item is
+  // fixed_item_size bytes long. On error, sets err and returns false.
+  bool Parse(const IoVec& raw, Transformer* tr, uint64_t fixed_item_size,
+             ErrorReporter* err);
+
+  // Number of items in the block.
+  int size() const { return n_items_; }
+
+  // Get the i'th item. REQUIRES: 0 <= i < size().
+  ByteSpan Item(int i) const {
+    const uint8_t* start = data_.data() + items_start_;
+    if (fixed_item_size_ > 0) {
+      return ByteSpan(start + i * fixed_item_size_, fixed_item_size_);
+    }
+    return ByteSpan(start + offsets_[i], offsets_[i + 1] - offsets_[i]);
+  }
+
+  // Get items [i, size()) as one contiguous array. REQUIRES: the block has
+  // fixed-size items, and 0 <= i < size().
+  ByteSpan FixedItems(int i) const {
+    return ByteSpan(data_.data() + items_start_ + i * fixed_item_size_,
+                    (n_items_ - i) * fixed_item_size_);
+  }
+
+  uint64_t fixed_item_size() const { return fixed_item_size_; }
+
+  // The untransformed block contents. Parse(data(), nullptr, ...) recreates
+  // the block.
+  ByteSpan data() const { return ByteSpan(data_.data(), data_.size()); }
+
+  // Approximate memory used by the block.
+  size_t memory_bytes() const {
+    return data_.capacity() + offsets_.capacity() * sizeof(offsets_[0]);
+  }
+
+ private:
+  HugePageBuffer data_;        // Untransformed block contents.
+  size_t items_start_ = 0;     // Offset of the first item in data_.
+  // offsets_[i] is the offset of the i'th item from items_start_. It has
+  // size()+1 elements, unless the block has fixed-size items.
+  std::vector<uint64_t> offsets_;
+  uint64_t fixed_item_size_ = 0;
+  int n_items_ = 0;
+};
+
+}  // namespace internal
+}  // namespace recordio
+}  // namespace grail
+
+#endif  // LIB_RECORDIO_BLOCK_H_
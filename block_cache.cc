@@ -0,0 +1,221 @@
+#include "./block_cache.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace grail {
+namespace recordio {
+namespace internal {
+
+namespace {
+
+// Read or write all of [data, data+bytes) at "offset" of "fd". Returns an
+// error string on error.
+Error PreadFull(int fd, uint8_t* data, size_t bytes, int64_t offset) {
+  size_t done = 0;
+  while (done < bytes) {
+    const ssize_t n = pread(fd, data + done, bytes - done, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return StrError("pread spill file");
+    if (n == 0) return "pread spill file: unexpected EOF";
+    done += n;
+  }
+  return "";
+}
+
+Error PwriteFull(int fd, const uint8_t* data, size_t bytes, int64_t offset) {
+  size_t done = 0;
+  while (done < bytes) {
+    const ssize_t n = pwrite(fd, data + done, bytes - done, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return StrError("pwrite spill file");
+    done += n;
+  }
+  return "";
+}
+
+}  // namespace
+
+BlockCacheImpl::BlockCacheImpl(int64_t memory_bytes,
+                               const std::string& spill_dir,
+                               int64_t spill_bytes)
+    : memory_budget_(memory_bytes), spill_budget_(spill_bytes) {
+  if (spill_dir.empty() || spill_bytes <= 0) return;
+  std::string path = spill_dir + "/recordio-cache-XXXXXX";
+  spill_fd_ = mkstemp(&path[0]);
+  if (spill_fd_ < 0) {
+    err_.Set(StrError("mkstemp " + path) + "; block cache won't spill");
+    return;
+  }
+  // The file is removed when the descriptor is closed.
+  unlink(path.c_str());
+  spill_ok_ = true;
+}
+
+BlockCacheImpl::~BlockCacheImpl() {
+  if (spill_fd_ >= 0) close(spill_fd_);
+}
+
+std::shared_ptr<const Block> BlockCacheImpl::Lookup(const std::string& key,
+                                                    int64_t offset,
+                                                    int64_t* next_offset) {
+  const Key k(key, offset);
+  std::unique_lock<std::mutex> l(mu_);
+  auto it = entries_.find(k);
+  if (it == entries_.end()) {
+    stats_.misses++;
+    return nullptr;
+  }
+  Entry* e = &it->second;
+  *next_offset = e->next_offset;
+  if (e->block != nullptr) {
+    stats_.hits++;
+    lru_.splice(lru_.begin(), lru_, e->lru);
+    return e->block;
+  }
+  std::vector<Spill> spills;
+  std::shared_ptr<const Block> block = e->spilling;
+  if (block == nullptr) {
+    // Read the block back from the spill file, without holding mu_. It is
+    // stored untransformed, so only the item table needs to be parsed.
+    const int64_t spill_offset = e->spill_offset;
+    const uint64_t fixed_item_size = e->fixed_item_size;
+    std::vector<uint8_t> data(e->spill_size);
+    l.unlock();
+    std::shared_ptr<Block> parsed(new Block);
+    ErrorReporter err;
+    err.Set(PreadFull(spill_fd_, data.data(), data.size(), spill_offset));
+    ByteSpan span(&data);
+    if (err.Ok()) {
+      parsed->Parse(IoVec(&span, 1), nullptr, fixed_item_size, &err);
+    }
+    l.lock();
+    it = entries_.find(k);
+    if (!err.Ok()) {
+      err_.Set(err.Err());
+      if (it != entries_.end() && it->second.block == nullptr &&
+          it->second.spill_offset == spill_offset) {
+        entries_.erase(it);
+      }
+      stats_.misses++;
+      return nullptr;
+    }
+    block = std::move(parsed);
+    if (it == entries_.end()) {
+      stats_.spill_hits++;
+      return block;
+    }
+    e = &it->second;
+    if (e->block != nullptr) {
+      // Read back by another reader meanwhile.
+      stats_.spill_hits++;
+      lru_.splice(lru_.begin(), lru_, e->lru);
+      return e->block;
+    }
+  }
+  stats_.spill_hits++;
+  AddToMemory(e, block);
+  Evict(&spills);
+  WriteSpills(spills, &l);
+  return block;
+}
+
+void BlockCacheImpl::Insert(const std::string& key, int64_t offset,
+                            int64_t next_offset,
+                            std::shared_ptr<const Block> block) {
+  std::unique_lock<std::mutex> l(mu_);
+  const Key k(key, offset);
+  Entry* e = &entries_[k];
+  if (e->block != nullptr) return;  // Inserted by another reader.
+  e->key = k;
+  e->next_offset = next_offset;
+  e->fixed_item_size = block->fixed_item_size();
+  AddToMemory(e, std::move(block));
+  std::vector<Spill> spills;
+  Evict(&spills);
+  WriteSpills(spills, &l);
+}
+
+BlockCache::Stats BlockCacheImpl::GetStats() {
+  std::unique_lock<std::mutex> l(mu_);
+  return stats_;
+}
+
+Error BlockCacheImpl::GetError() {
+  std::unique_lock<std::mutex> l(mu_);
+  return err_.Err();
+}
+
+void BlockCacheImpl::AddToMemory(Entry* e, std::shared_ptr<const Block> block) {
+  e->bytes = block->memory_bytes();
+  e->block = std::move(block);
+  lru_.push_front(e);
+  e->lru = lru_.begin();
+  stats_.memory_bytes += e->bytes;
+}
+
+void BlockCacheImpl::Evict(std::vector<Spill>* spills) {
+  while (stats_.memory_bytes > memory_budget_ && !lru_.empty()) {
+    Entry* e = lru_.back();
+    lru_.pop_back();
+    stats_.memory_bytes -= e->bytes;
+    const int64_t size = e->block->data().size();
+    if (e->spill_offset < 0 && spill_ok_ &&
+        stats_.spill_bytes + size <= spill_budget_) {
+      e->spill_offset = stats_.spill_bytes;
+      e->spill_size = size;
+      e->spilling = e->block;
+      stats_.spill_bytes += size;
+      spills->push_back(Spill{e, e->block, e->spill_offset});
+    }
+    e->block.reset();
+    e->bytes = 0;
+    if (e->spill_offset < 0) {
+      // Neither in memory nor spilled. Forget the block.
+      const Key k = e->key;
+      entries_.erase(k);
+    }
+  }
+}
+
+void BlockCacheImpl::WriteSpills(const std::vector<Spill>& spills,
+                                 std::unique_lock<std::mutex>* l) {
+  if (spills.empty()) return;
+  // The entries stay in entries_ while they are spilling: Evict keeps entries
+  // with a spill_offset, and Lookup serves them from Entry::spilling.
+  l->unlock();
+  std::vector<Error> errs(spills.size());
+  for (size_t i = 0; i < spills.size(); i++) {
+    const ByteSpan data = spills[i].block->data();
+    errs[i] = PwriteFull(spill_fd_, data.data(), data.size(), spills[i].offset);
+  }
+  l->lock();
+  for (size_t i = 0; i < spills.size(); i++) {
+    Entry* e = spills[i].e;
+    e->spilling.reset();
+    if (errs[i].empty()) continue;
+    err_.Set(errs[i]);
+    spill_ok_ = false;
+    e->spill_offset = -1;
+    if (e->block == nullptr) {
+      const Key k = e->key;
+      entries_.erase(k);
+    }
+  }
+}
+
+}  // namespace internal
+
+std::shared_ptr<BlockCache> NewBlockCache(int64_t memory_bytes,
+                                          const std::string& spill_dir,
+                                          int64_t spill_bytes) {
+  return std::make_shared<internal::BlockCacheImpl>(memory_bytes, spill_dir,
+                                                    spill_bytes);
+}
+
+}  // namespace recordio
+}  // namespace grail
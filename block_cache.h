@@ -0,0 +1,98 @@
+#ifndef LIB_RECORDIO_BLOCK_CACHE_H_
+#define LIB_RECORDIO_BLOCK_CACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "./block.h"
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+namespace internal {
+
+// Implementation of BlockCache. Blocks are identified by the cache key of the
+// file and the file offset of the block.
+class BlockCacheImpl : public BlockCache {
+ public:
+  BlockCacheImpl(int64_t memory_bytes, const std::string& spill_dir,
+                 int64_t spill_bytes);
+  ~BlockCacheImpl() override;
+
+  // Find the block at "offset" in file "key". On a hit, sets *next_offset to
+  // the offset of the following block. Returns null on a miss.
+  std::shared_ptr<const Block> Lookup(const std::string& key, int64_t offset,
+                                      int64_t* next_offset);
+
+  // Add the block at "offset" in file "key", followed by a block at
+  // "next_offset".
+  void Insert(const std::string& key, int64_t offset, int64_t next_offset,
+              std::shared_ptr<const Block> block);
+
+  Stats GetStats() override;
+  Error GetError() override;
+
+ private:
+  typedef std::pair<std::string, int64_t> Key;  // File key and block offset.
+
+  struct Entry {
+    Key key;
+    int64_t next_offset = -1;
+    uint64_t fixed_item_size = 0;
+    std::shared_ptr<const Block> block;  // Null if not in memory.
+    int64_t bytes = 0;                   // Memory used by block.
+    int64_t spill_offset = -1;  // Location in the spill file, or -1.
+    int64_t spill_size = 0;
+    // The block while it is being written to the spill file. Lookup serves it
+    // from here until the write is done.
+    std::shared_ptr<const Block> spilling;
+    std::list<Entry*>::iterator lru;  // Valid iff block is non-null.
+  };
+
+  // A block to write to the spill file at "offset".
+  struct Spill {
+    Entry* e;
+    std::shared_ptr<const Block> block;
+    int64_t offset;
+  };
+
+  // Move entries out of memory until the memory budget is met. The blocks to
+  // spill are reserved space in the spill file and added to *spills, to be
+  // written by WriteSpills.
+  //
+  // REQUIRES: mu_ is held.
+  void Evict(std::vector<Spill>* spills);
+  // Write the blocks to the spill file, and publish them.
+  //
+  // REQUIRES: mu_ is held by "l". It is released during the writes.
+  void WriteSpills(const std::vector<Spill>& spills,
+                   std::unique_lock<std::mutex>* l);
+  void AddToMemory(Entry* e, std::shared_ptr<const Block> block);
+
+  const int64_t memory_budget_;
+  const int64_t spill_budget_;
+
+  // The spill file, or -1. The file is only appended to, so a range of it,
+  // once written, stays valid, and is read and written without holding mu_.
+  int spill_fd_ = -1;
+
+  std::mutex mu_;
+  // Guarded by mu_.
+  std::map<Key, Entry> entries_;
+  std::list<Entry*> lru_;  // Entries in memory, most recently used first.
+  bool spill_ok_ = false;  // spill_fd_ >= 0, and no write failed.
+  ErrorReporter err_;
+  Stats stats_;
+};
+
+}  // namespace internal
+}  // namespace recordio
+}  // namespace grail
+
+#endif  // LIB_RECORDIO_BLOCK_CACHE_H_
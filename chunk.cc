@@ -1,24 +1,42 @@
 #include "./chunk.h"
 
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include <sstream>
 
+#include "./portable_endian.h"
+
 namespace grail {
 namespace recordio {
 
-namespace {
-const int ChunkHeaderSize = 28;
-const int MaxChunkPayloadSize = internal::ChunkSize - ChunkHeaderSize;
-}  // namespace
+using internal::ChunkHeaderSize;
+using internal::MaxChunkPayloadSize;
+
+internal::ChunkReader::ChunkReader(ReadSeeker* in, ErrorReporter* err,
+                                   bool huge_pages)
+    : in_(in),
+      err_(err),
+      magic_(MagicInvalid),
+      off_(-1),
+      block_off_(-1),
+      huge_pages_(huge_pages),
+      next_free_chunk_(0) {}
 
-internal::ChunkReader::ChunkReader(ReadSeeker* in, ErrorReporter* err)
-    : in_(in), err_(err), magic_(MagicInvalid), next_free_chunk_(0) {}
+void internal::ChunkReader::Reset(ReadSeeker* in) {
+  in_ = in;
+  magic_ = MagicInvalid;
+  iov_.clear();
+  off_ = -1;
+  block_off_ = -1;
+  next_free_chunk_ = 0;
+}
 
 bool internal::ChunkReader::Scan() {
   magic_ = MagicInvalid;
   iov_.clear();
   next_free_chunk_ = 0;
+  block_off_ = off_;
   uint32_t total_chunks = 0;
   if (!err_->Ok()) {
     return false;
@@ -70,6 +88,7 @@ bool internal::ChunkReader::Scan() {
 
 void internal::ChunkReader::SeekLastBlock() {
   int64_t unused;
+  off_ = -1;
   err_->Set(in_->Seek(-ChunkSize, SEEK_END, &unused));
   if (!err_->Ok()) {
     return;
@@ -88,37 +107,74 @@ void internal::ChunkReader::SeekLastBlock() {
     err_->Set(msg.str());
     return;
   }
-  const off_t off = -ChunkSize * (static_cast<int>(index) + 1);
-  err_->Set(in_->Seek(off, SEEK_END, &unused));
+  const off_t off = -static_cast<off_t>(ChunkSize) * (index + off_t(1));
+  int64_t new_off;
+  err_->Set(in_->Seek(off, SEEK_END, &new_off));
   if (!err_->Ok()) {
     return;
   }
+  off_ = new_off;
 }
 
-void internal::ChunkReader::Seek(int64_t off) { err_->Set(AbsSeek(in_, off)); }
+void internal::ChunkReader::Seek(int64_t off) {
+  if (off == off_) return;
+  off_ = -1;
+  err_->Set(AbsSeek(in_, off));
+  if (err_->Ok()) off_ = off;
+}
 
 bool internal::ChunkReader::ReadChunk(Magic* magic, uint32_t* index,
                                       uint32_t* total, ChunkFlag* flag,
                                       ByteSpan* payload) {
   while (next_free_chunk_ >= static_cast<int>(free_chunks_.size())) {
-    free_chunks_.push_back(std::unique_ptr<ChunkBuf>(new ChunkBuf));
+    // With huge pages, allocate a huge page worth of chunks at a time.
+    const size_t n = huge_pages_ ? HugePageSize / ChunkSize : 1;
+    slabs_.emplace_back(n * ChunkSize, 0,
+                        HugePageAllocator<uint8_t>(huge_pages_));
+    for (size_t i = 0; i < n; i++) {
+      free_chunks_.push_back(slabs_.back().data() + i * ChunkSize);
+    }
   }
-  ChunkBuf* buf = free_chunks_[next_free_chunk_].get();
+  uint8_t* buf = free_chunks_[next_free_chunk_];
   next_free_chunk_++;
-  ssize_t n;
-  Error err = in_->Read(buf->data(), ChunkSize, &n);
-  if (err != "" || n <= 0) {
-    std::cout << "read: " << n << " " << err << "\n";
-    return false;
+  // Pipes may return a chunk in pieces, so read until it is complete.
+  ssize_t done = 0;
+  while (done < ChunkSize) {
+    ssize_t n;
+    const Error err = in_->Read(buf + done, ChunkSize - done, &n);
+    if (err != "") {
+      err_->Set(err);
+      return false;
+    }
+    if (n <= 0) break;
+    done += n;
   }
-  if (n != ChunkSize) {
+  if (off_ >= 0) off_ += done;
+  if (done == 0) return false;  // EOF
+  if (done != ChunkSize) {
     std::ostringstream msg;
-    msg << "Failed to read chunk, got " << n << " byte, expect " << ChunkSize
-        << "bytes: " << std::strerror(errno);
+    msg << "Failed to read chunk, got " << done << " byte, expect "
+        << ChunkSize << "bytes: " << std::strerror(errno);
     err_->Set(msg.str());
     return false;
   }
-  BinaryParser header(buf->data(), ChunkHeaderSize, err_);
+  return ParseChunk(buf, magic, index, total, flag, payload, err_);
+}
+
+bool internal::ChunkReader::ReadAt(int64_t off, uint8_t* buf, size_t bytes) {
+  Seek(off);
+  if (!err_->Ok()) return false;
+  off_ = -1;
+  err_->Set(ReadFull(in_, buf, bytes));
+  if (!err_->Ok()) return false;
+  off_ = off + bytes;
+  return true;
+}
+
+bool internal::ParseChunk(const uint8_t* buf, Magic* magic, uint32_t* index,
+                          uint32_t* total, ChunkFlag* flag, ByteSpan* payload,
+                          ErrorReporter* err) {
+  BinaryParser header(buf, ChunkHeaderSize, err);
 
   *magic = *reinterpret_cast<const Magic*>(header.ReadBytes(sizeof(Magic)));
   const uint32_t expected_csum = header.ReadLEUint32();
@@ -126,23 +182,115 @@ bool internal::ChunkReader::ReadChunk(Magic* magic, uint32_t* index,
   const uint32_t size = header.ReadLEUint32();
   *total = header.ReadLEUint32();
   *index = header.ReadLEUint32();
-  if (!err_->Ok()) {
+  if (!err->Ok()) {
     return false;
   }
   if (size > MaxChunkPayloadSize) {
     std::ostringstream msg;
     msg << "Invalid chunk size " << size;
-    err_->Set(msg.str());
+    err->Set(msg.str());
     return false;
   }
 
-  *payload = ByteSpan(buf->data() + ChunkHeaderSize, size);
-  const uint32_t actual_csum =
-      Crc32(buf->data() + 12, ChunkHeaderSize - 12 + size);
+  *payload = ByteSpan(buf + ChunkHeaderSize, size);
+  const uint32_t actual_csum = Crc32(buf + 12, ChunkHeaderSize - 12 + size);
   if (expected_csum != actual_csum) {
     std::ostringstream msg;
     msg << "Chunk checksum mismatch, expect " << expected_csum << " got "
         << actual_csum;
+    err->Set(msg.str());
+    return false;
+  }
+  return true;
+}
+
+bool internal::ParseBlock(ByteSpan data, Magic* magic,
+                          std::vector<ByteSpan>* payloads, size_t* size,
+                          ErrorReporter* err) {
+  payloads->clear();
+  uint32_t total = 1;
+  for (uint32_t i = 0; i < total; i++) {
+    const size_t off = static_cast<size_t>(i) * ChunkSize;
+    if (off + ChunkSize > data.size()) {
+      std::ostringstream msg;
+      msg << "Block is truncated after " << i << " chunks, expect " << total;
+      err->Set(msg.str());
+      return false;
+    }
+    Magic chunk_magic;
+    uint32_t index, chunk_total;
+    ChunkFlag flag;
+    ByteSpan payload;
+    if (!ParseChunk(data.data() + off, &chunk_magic, &index, &chunk_total,
+                    &flag, &payload, err)) {
+      return false;
+    }
+    if (i == 0) {
+      *magic = chunk_magic;
+      total = chunk_total;
+    }
+    if (chunk_magic != *magic || index != i || chunk_total != total) {
+      std::ostringstream msg;
+      msg << "Inconsistent chunk " << index << "/" << chunk_total
+          << ", expect " << i << "/" << total << " for magic "
+          << MagicDebugString(*magic);
+      err->Set(msg.str());
+      return false;
+    }
+    payloads->push_back(payload);
+  }
+  *size = static_cast<size_t>(total) * ChunkSize;
+  return true;
+}
+
+internal::ChunkWriter::ChunkWriter(std::ostream* out, ErrorReporter* err)
+    : out_(out), err_(err), buf_(new ChunkBuf) {}
+
+bool internal::ChunkWriter::Write(const Magic& magic, IoVec payload) {
+  const size_t bytes = IoVecSize(payload);
+  uint32_t total = (bytes + MaxChunkPayloadSize - 1) / MaxChunkPayloadSize;
+  if (total == 0) total = 1;
+
+  uint32_t index = 0;
+  uint32_t size = 0;
+  for (size_t i = 0; i < payload.size(); i++) {
+    const uint8_t* data = payload[i].data();
+    size_t remaining = payload[i].size();
+    while (remaining > 0) {
+      const size_t n =
+          std::min<size_t>(remaining, MaxChunkPayloadSize - size);
+      memcpy(buf_->data() + ChunkHeaderSize + size, data, n);
+      size += n;
+      data += n;
+      remaining -= n;
+      if (size == MaxChunkPayloadSize && index + 1 < total) {
+        if (!WriteChunk(magic, index, total, size)) return false;
+        index++;
+        size = 0;
+      }
+    }
+  }
+  return WriteChunk(magic, index, total, size);
+}
+
+bool internal::ChunkWriter::WriteChunk(const Magic& magic, uint32_t index,
+                                       uint32_t total, uint32_t size) {
+  uint8_t* buf = buf_->data();
+  auto put_le32 = [buf](int off, uint32_t v) {
+    const uint32_t le = htole32(v);
+    memcpy(buf + off, &le, sizeof le);
+  };
+  memcpy(buf, magic.data(), magic.size());
+  put_le32(12, 0);  // flag
+  put_le32(16, size);
+  put_le32(20, total);
+  put_le32(24, index);
+  memset(buf + ChunkHeaderSize + size, 0, MaxChunkPayloadSize - size);
+  put_le32(8, Crc32(buf + 12, ChunkHeaderSize - 12 + size));
+  out_->write(reinterpret_cast<const char*>(buf), ChunkSize);
+  if (!out_->good()) {
+    std::ostringstream msg;
+    msg << "Failed to write chunk: " << std::strerror(errno);
     err_->Set(msg.str());
     return false;
   }
@@ -4,6 +4,7 @@
 #include <array>
 #include <cstdint>
 #include <memory>
+#include <ostream>
 #include <string>
 #include <vector>
 
@@ -16,6 +17,9 @@ namespace internal {
 
 class ErrorReporter;
 constexpr int ChunkSize = 32 << 10;
+// Size of the chunk header: magic, crc32, flag, size, total, and index.
+constexpr int ChunkHeaderSize = 28;
+constexpr int MaxChunkPayloadSize = ChunkSize - ChunkHeaderSize;
 typedef uint32_t ChunkFlag;
 typedef std::array<uint8_t, ChunkSize> ChunkBuf;
 
@@ -23,7 +27,11 @@ typedef std::array<uint8_t, ChunkSize> ChunkBuf;
 // transformation.
 class ChunkReader {
  public:
-  ChunkReader(ReadSeeker* in, ErrorReporter* err);
+  // If huge_pages=true, the chunk buffers are allocated in huge pages.
+  ChunkReader(ReadSeeker* in, ErrorReporter* err, bool huge_pages = false);
+  // Start reading "in" from its current position. The chunk buffers are
+  // reused.
+  void Reset(ReadSeeker* in);
   // Read the next block.
   bool Scan();
   // Read the chunks that constitute the current block.
@@ -34,11 +42,23 @@ class ChunkReader {
   //
   // REQUIRE: Last call to Scan() returned true.
   Magic GetMagic() const { return magic_; }
+  // Get the file offset of the current block, or -1 if unknown. The offset is
+  // known once Seek() or SeekLastBlock() has been called.
+  //
+  // REQUIRE: Last call to Scan() returned true.
+  int64_t BlockOffset() const { return block_off_; }
+  // Get the file offset of the block that the next Scan() call will read, or -1
+  // if unknown.
+  int64_t Offset() const { return off_; }
   // Seek to the given offset. The next Scan() call will read the block at the
   // offset.
   void Seek(int64_t off);
   // Seek to the last block (i.e., trailer).
   void SeekLastBlock();
+  // Read "bytes" raw bytes at file offset "off" into buf, without parsing
+  // them. The next Scan() call will read the block at off+bytes. Returns false
+  // on error.
+  bool ReadAt(int64_t off, uint8_t* buf, size_t bytes);
 
  private:
   // Read one chunk from in_.
@@ -49,12 +69,49 @@ class ChunkReader {
   ErrorReporter* err_;
   Magic magic_;
   std::vector<ByteSpan> iov_;
+  int64_t off_;        // Current read position of in_. -1 if unknown.
+  int64_t block_off_;  // Offset of the current block. -1 if unknown.
 
+  const bool huge_pages_;
   int next_free_chunk_;
-  std::vector<std::unique_ptr<ChunkBuf>> free_chunks_;
+  std::vector<uint8_t*> free_chunks_;  // ChunkSize bytes each, in slabs_.
+  std::vector<HugePageBuffer> slabs_;
   ChunkReader(const ChunkReader&) = delete;
 };
 
+// Parse and verify the chunk stored in buf[0,ChunkSize). On success, sets the
+// header fields and *payload, which points into buf.
+bool ParseChunk(const uint8_t* buf, Magic* magic, uint32_t* index,
+                uint32_t* total, ChunkFlag* flag, ByteSpan* payload,
+                ErrorReporter* err);
+
+// Parse the chunks of the block stored at the beginning of "data". On success,
+// sets *magic, the chunk payloads (which point into data), and *size, the
+// number of bytes the block occupies. It is an error if data ends before the
+// block does.
+bool ParseBlock(ByteSpan data, Magic* magic, std::vector<ByteSpan>* payloads,
+                size_t* size, ErrorReporter* err);
+
+// Helper class for splitting a block into raw chunks and writing them out,
+// without any transformation.
+class ChunkWriter {
+ public:
+  ChunkWriter(std::ostream* out, ErrorReporter* err);
+  // Write a block whose contents are the concatenation of "payload". The block
+  // occupies one or more whole chunks. Returns false on error.
+  bool Write(const Magic& magic, IoVec payload);
+
+ private:
+  // Write one chunk, whose payload is already in buf_, to out_.
+  bool WriteChunk(const Magic& magic, uint32_t index, uint32_t total,
+                  uint32_t size);
+
+  std::ostream* const out_;
+  ErrorReporter* const err_;
+  std::unique_ptr<ChunkBuf> buf_;
+  ChunkWriter(const ChunkWriter&) = delete;
+};
+
 }  // namespace internal
 }  // namespace recordio
 }  // namespace grail
@@ -0,0 +1,188 @@
+// This file implements NewConcurrentWriter.
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+namespace {
+
+// A staging buffer is handed to the sealer once it holds this many bytes.
+constexpr size_t BatchBytes = 1 << 20;
+
+// Records staged by producers, stored back to back.
+struct Batch {
+  std::vector<uint8_t> data;
+  std::vector<size_t> sizes;
+};
+
+class ConcurrentWriterImpl : public Writer {
+ public:
+  ConcurrentWriterImpl(std::unique_ptr<Writer> w, int shards)
+      : w_(std::move(w)), shards_(shards), max_queued_(2 * shards) {
+    for (auto& shard : shards_) {
+      shard.batch.reset(new Batch);
+    }
+    sealer_ = std::thread([this]() { Seal(); });
+  }
+
+  ~ConcurrentWriterImpl() {
+    if (sealer_.joinable()) Close();
+  }
+
+  bool Write(ByteSpan item) {
+    return Stage(item.size(), [&item](uint8_t* buf) {
+      std::copy(item.begin(), item.end(), buf);
+      return true;
+    });
+  }
+
+  bool WriteWith(size_t size,
+                 const std::function<bool(uint8_t* buf)>& fill) override {
+    return Stage(size, fill);
+  }
+
+  bool Close() {
+    if (!sealer_.joinable()) return GetError().empty();
+    for (auto& shard : shards_) {
+      std::unique_lock<std::mutex> l(shard.mu);
+      std::unique_ptr<Batch> batch = std::move(shard.batch);
+      if (batch != nullptr && !batch->sizes.empty()) Submit(std::move(batch));
+    }
+    {
+      std::unique_lock<std::mutex> l(mu_);
+      stop_ = true;
+      cond_.notify_all();
+    }
+    sealer_.join();
+    if (!w_->Close()) SetError(w_->GetError());
+    std::unique_lock<std::mutex> l(mu_);
+    return err_.Ok();
+  }
+
+  Error GetError() {
+    std::unique_lock<std::mutex> l(mu_);
+    return err_.Err();
+  }
+
+ private:
+  struct Shard {
+    std::mutex mu;
+    std::unique_ptr<Batch> batch;  // Guarded by mu.
+  };
+
+  // Append a record of "size" bytes, filled by "fill", to the staging buffer
+  // of the calling thread.
+  bool Stage(size_t size, const std::function<bool(uint8_t* buf)>& fill) {
+    if (failed_.load(std::memory_order_relaxed)) return false;
+    static thread_local const size_t thread_id =
+        std::hash<std::thread::id>()(std::this_thread::get_id());
+    Shard* shard = &shards_[thread_id % shards_.size()];
+    std::unique_lock<std::mutex> l(shard->mu);
+    Batch* batch = shard->batch.get();
+    const size_t off = batch->data.size();
+    batch->data.resize(off + size);
+    if (!fill(batch->data.data() + off)) {
+      batch->data.resize(off);
+      SetError("Failed to fill item");
+      return false;
+    }
+    batch->sizes.push_back(size);
+    if (batch->data.size() >= BatchBytes) {
+      // Submit while holding shard->mu, so that the batches of a shard are
+      // queued in the order they were filled. Threads that share the shard
+      // may have records in consecutive batches.
+      Submit(std::move(shard->batch));
+      shard->batch = NewBatch();
+    }
+    return !failed_.load(std::memory_order_relaxed);
+  }
+
+  // Get an empty batch, reusing a retired one if possible.
+  std::unique_ptr<Batch> NewBatch() {
+    std::unique_lock<std::mutex> l(mu_);
+    if (free_.empty()) return std::unique_ptr<Batch>(new Batch);
+    std::unique_ptr<Batch> batch = std::move(free_.back());
+    free_.pop_back();
+    return batch;
+  }
+
+  // Hand a batch to the sealer. Blocks while the sealer is behind. Batches
+  // are written in the order they are submitted.
+  void Submit(std::unique_ptr<Batch> batch) {
+    std::unique_lock<std::mutex> l(mu_);
+    cond_.wait(l, [this]() { return queue_.size() < max_queued_; });
+    queue_.push_back(std::move(batch));
+    cond_.notify_all();
+  }
+
+  void SetError(const Error& err) {
+    std::unique_lock<std::mutex> l(mu_);
+    err_.Set(err);
+    failed_.store(true, std::memory_order_relaxed);
+  }
+
+  // Body of the sealer thread. It is the only user of w_ until Close.
+  void Seal() {
+    std::unique_lock<std::mutex> l(mu_);
+    for (;;) {
+      cond_.wait(l, [this]() { return stop_ || !queue_.empty(); });
+      if (queue_.empty()) return;
+      std::unique_ptr<Batch> batch = std::move(queue_.front());
+      queue_.pop_front();
+      cond_.notify_all();
+      l.unlock();
+
+      const uint8_t* data = batch->data.data();
+      bool ok = !failed_.load(std::memory_order_relaxed);
+      for (size_t i = 0; ok && i < batch->sizes.size(); i++) {
+        ok = w_->Write(ByteSpan(data, batch->sizes[i]));
+        data += batch->sizes[i];
+      }
+      if (!ok && !failed_.load(std::memory_order_relaxed)) {
+        SetError(w_->GetError());
+      }
+      batch->data.clear();
+      batch->sizes.clear();
+
+      l.lock();
+      free_.push_back(std::move(batch));
+    }
+  }
+
+  const std::unique_ptr<Writer> w_;
+  std::vector<Shard> shards_;
+  const size_t max_queued_;
+  std::atomic<bool> failed_{false};
+
+  std::mutex mu_;
+  std::condition_variable cond_;
+  // Guarded by mu_.
+  internal::ErrorReporter err_;
+  std::deque<std::unique_ptr<Batch>> queue_;  // Batches waiting for sealer.
+  std::vector<std::unique_ptr<Batch>> free_;  // Retired batches.
+  bool stop_ = false;
+
+  std::thread sealer_;
+};
+
+}  // namespace
+
+std::unique_ptr<Writer> NewConcurrentWriter(std::unique_ptr<Writer> w,
+                                            int shards) {
+  if (shards <= 0) {
+    shards = std::max(1u, std::thread::hardware_concurrency());
+  }
+  return std::unique_ptr<Writer>(
+      new ConcurrentWriterImpl(std::move(w), shards));
+}
+
+}  // namespace recordio
+}  // namespace grail
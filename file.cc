@@ -0,0 +1,175 @@
+#include "./file.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "./internal.h"
+
+namespace grail {
+namespace recordio {
+namespace internal {
+
+namespace {
+// Size of the staging buffer. It is a multiple of DirectIOAlignment.
+constexpr size_t BufferSize = 1 << 20;
+}  // namespace
+
+FileOutputBuf::FileOutputBuf()
+    : fd_(-1),
+      direct_(false),
+      pos_(0),
+      expected_size_(0),
+      reserved_(0),
+      buf_(nullptr) {}
+
+FileOutputBuf::~FileOutputBuf() {
+  Close();
+  free(buf_);
+}
+
+Error FileOutputBuf::Open(const std::string& path, bool direct,
+                          int64_t expected_size) {
+  expected_size_ = expected_size;
+  const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+  if (direct) {
+    fd_ = open(path.c_str(), flags | O_DIRECT, 0666);
+    if (fd_ >= 0) {
+      direct_ = true;
+    } else if (errno != EINVAL) {
+      err_ = StrError("open " + path);
+      return err_;
+    }
+  }
+  if (fd_ < 0) {
+    // Either direct I/O isn't requested, or the filesystem doesn't support it.
+    fd_ = open(path.c_str(), flags, 0666);
+    if (fd_ < 0) {
+      err_ = StrError("open " + path);
+      return err_;
+    }
+  }
+  void* buf;
+  if (posix_memalign(&buf, DirectIOAlignment, BufferSize) != 0) {
+    err_ = "Failed to allocate the write buffer";
+    return err_;
+  }
+  buf_ = static_cast<char*>(buf);
+  setp(buf_, buf_ + BufferSize);
+  // Reserve the first extent now, so that the first write doesn't wait for
+  // it. The file may be opened ahead of time, e.g., by NewRotatingWriter.
+  if (!Preallocate(std::min(expected_size_, PreallocateIncrement))) {
+    return err_;
+  }
+  return "";
+}
+
+FileOutputBuf::int_type FileOutputBuf::overflow(int_type ch) {
+  if (fd_ < 0 || !err_.empty()) return traits_type::eof();
+  // The buffer is full, so its size is a multiple of the alignment.
+  if (!WriteBuffer(pptr() - pbase())) return traits_type::eof();
+  if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+  }
+  return traits_type::not_eof(ch);
+}
+
+int FileOutputBuf::sync() {
+  if (fd_ < 0 || !err_.empty()) return -1;
+  size_t bytes = pptr() - pbase();
+  if (direct_) {
+    // The unaligned tail stays in the buffer until more data arrives or the
+    // file is closed.
+    bytes -= bytes % DirectIOAlignment;
+  }
+  return WriteBuffer(bytes) ? 0 : -1;
+}
+
+FileOutputBuf::pos_type FileOutputBuf::seekoff(off_type off,
+                                               std::ios_base::seekdir dir,
+                                               std::ios_base::openmode which) {
+  // Only tellp() is supported.
+  if (off != 0 || dir != std::ios_base::cur || which != std::ios_base::out) {
+    return pos_type(off_type(-1));
+  }
+  return pos_type(pos_ + (pptr() - pbase()));
+}
+
+bool FileOutputBuf::Preallocate(int64_t end) {
+  if (expected_size_ <= 0 || end <= reserved_) return true;
+  const int64_t target = std::max(
+      {end, expected_size_, reserved_ + PreallocateIncrement});
+  // KEEP_SIZE leaves the file size alone, so readers never see the reserved
+  // space, even if the writer crashes before Close.
+  if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, reserved_, target - reserved_) < 0) {
+    if (errno == EOPNOTSUPP || errno == ENOSYS) {
+      // The filesystem can't preallocate. Just write without it.
+      expected_size_ = 0;
+      return true;
+    }
+    err_ = StrError("fallocate");
+    return false;
+  }
+  reserved_ = target;
+  return true;
+}
+
+bool FileOutputBuf::WriteBuffer(size_t bytes) {
+  if (!Preallocate(pos_ + bytes)) return false;
+  size_t done = 0;
+  while (done < bytes) {
+    const ssize_t n = write(fd_, pbase() + done, bytes - done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      err_ = StrError("write");
+      return false;
+    }
+    done += n;
+  }
+  const size_t rest = pptr() - pbase() - bytes;
+  memmove(buf_, pbase() + bytes, rest);
+  pos_ += bytes;
+  setp(buf_, buf_ + BufferSize);
+  pbump(static_cast<int>(rest));
+  return true;
+}
+
+Error FileOutputBuf::Close() {
+  if (fd_ < 0) return err_;
+  if (err_.empty()) {
+    const size_t bytes = pptr() - pbase();
+    const int64_t size = pos_ + bytes;
+    if (direct_ && bytes % DirectIOAlignment != 0) {
+      // O_DIRECT can't write a partial block. Pad it, and cut the padding off
+      // afterwards. The buffer size is a multiple of the alignment, so the
+      // padding always fits.
+      const size_t pad = DirectIOAlignment - bytes % DirectIOAlignment;
+      memset(pptr(), 0, pad);
+      pbump(static_cast<int>(pad));
+      WriteBuffer(bytes + pad);
+    } else {
+      WriteBuffer(bytes);
+    }
+    // Cut off the padding, and release the reserved space past the end.
+    if (err_.empty() && (pos_ != size || reserved_ > size) &&
+        ftruncate(fd_, size) < 0) {
+      err_ = StrError("ftruncate");
+    }
+    pos_ = size;
+  }
+  if (close(fd_) < 0 && err_.empty()) {
+    err_ = StrError("close");
+  }
+  fd_ = -1;
+  setp(nullptr, nullptr);
+  return err_;
+}
+
+}  // namespace internal
+}  // namespace recordio
+}  // namespace grail
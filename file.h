@@ -0,0 +1,81 @@
+#ifndef LIB_RECORDIO_FILE_H_
+#define LIB_RECORDIO_FILE_H_
+
+#include <cstdint>
+#include <streambuf>
+#include <string>
+
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+namespace internal {
+
+// Alignment of the buffer address, the file offset, and the size of every
+// O_DIRECT write. 4KiB is the logical block size of all the devices we care
+// about, and it divides ChunkSize.
+constexpr size_t DirectIOAlignment = 4 << 10;
+
+// Minimum number of bytes reserved by one fallocate call.
+constexpr int64_t PreallocateIncrement = 64 << 20;
+
+// FileOutputBuf is a std::streambuf that writes to a file descriptor.
+//
+// If direct is set, the file is opened with O_DIRECT, so the data bypasses the
+// page cache. The data is staged in an aligned buffer and written in
+// multiples of DirectIOAlignment. On Close, the final partial block is padded
+// to the alignment, and the file is then truncated to its real size. If the
+// filesystem doesn't support O_DIRECT, the file is written through the page
+// cache as usual.
+//
+// If expected_size is nonzero, disk space is reserved with fallocate(2) ahead
+// of the write position, in increments of at least PreallocateIncrement. This
+// keeps the file in a few large extents even when many files are written
+// concurrently. The space past the end of the data is released on Close.
+//
+// This class is not thread safe.
+class FileOutputBuf : public std::streambuf {
+ public:
+  FileOutputBuf();
+  ~FileOutputBuf() override;
+
+  // Create or truncate "path" and open it for writing. "expected_size" is a
+  // hint for the final file size, or 0 if unknown. If it is nonzero, the first
+  // extent is reserved before Open returns. Returns "" on success.
+  Error Open(const std::string& path, bool direct, int64_t expected_size);
+
+  // Write the buffered data and close the file. Returns "" on success.
+  Error Close();
+
+  // Whether the file is opened with O_DIRECT.
+  bool direct() const { return direct_; }
+
+ protected:
+  int_type overflow(int_type ch) override;
+  int sync() override;
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override;
+
+ private:
+  // Write the first "bytes" bytes of the buffer to the file, and move the rest
+  // to the beginning of the buffer.
+  bool WriteBuffer(size_t bytes);
+
+  // Reserve disk space up to at least offset "end".
+  bool Preallocate(int64_t end);
+
+  int fd_;
+  bool direct_;
+  int64_t pos_;  // File offset of pbase().
+  int64_t expected_size_;
+  int64_t reserved_;  // Disk space is reserved in [0, reserved_).
+  char* buf_;
+  Error err_;
+  FileOutputBuf(const FileOutputBuf&) = delete;
+};
+
+}  // namespace internal
+}  // namespace recordio
+}  // namespace grail
+
+#endif  // LIB_RECORDIO_FILE_H_
@@ -1,4 +1,5 @@
 #include <zlib.h>
+#include <cstring>
 #include <iostream>
 #include <mutex>
 #include <regex>
@@ -11,13 +12,25 @@ namespace grail {
 namespace recordio {
 namespace {
 
-// Flate decompression transformer.
+// Flate decompression transformer. The z_stream is initialized once, and
+// reset for each block.
 class UnflateTransformerImpl : public Transformer {
+ public:
+  UnflateTransformerImpl() { memset(&stream_, 0, sizeof stream_); }
+  ~UnflateTransformerImpl() {
+    if (initialized_) inflateEnd(&stream_);
+  }
+
   internal::Error Transform(IoVec in_iov, IoVec* out) {
     *out = IoVec();
-    z_stream stream;
-    memset(&stream, 0, sizeof stream);
-    int ret = inflateInit2(&stream, -15 /*RFC1951*/);
+    z_stream& stream = stream_;
+    int ret;
+    if (initialized_) {
+      ret = inflateReset(&stream);
+    } else {
+      ret = inflateInit2(&stream, -15 /*RFC1951*/);
+      initialized_ = (ret == Z_OK);
+    }
     if (ret != Z_OK) {
       std::ostringstream msg;
       msg << "inflateInit failed(" << ret << ")";
@@ -41,7 +54,6 @@ class UnflateTransformerImpl : public Transformer {
         if (ret != Z_OK && ret != Z_STREAM_END) {
           std::ostringstream msg;
           msg << "inflate failed(" << ret << ")";
-          inflateEnd(&stream);
           return msg.str();
         }
         if (ret == Z_STREAM_END || stream.avail_in == 0) {
@@ -66,27 +78,41 @@ class UnflateTransformerImpl : public Transformer {
       msg << "found trailing junk during inflate";
       return msg.str();
     }
-    inflateEnd(&stream);
 
     tmp_span_ = ByteSpan(tmp_.data(), tmp_.size() - stream.avail_out);
     *out = IoVec(&tmp_span_, 1);
     return "";
   }
 
+ private:
+  z_stream stream_;
+  bool initialized_ = false;
   ByteSpan tmp_span_;
   std::vector<uint8_t> tmp_;
 };
 
-// Flate compression transformer.
+// Flate compression transformer. Like UnflateTransformerImpl, it reuses one
+// z_stream.
 class FlateTransformerImpl : public Transformer {
+ public:
+  FlateTransformerImpl() { memset(&stream_, 0, sizeof stream_); }
+  ~FlateTransformerImpl() {
+    if (initialized_) deflateEnd(&stream_);
+  }
+
   internal::Error Transform(IoVec in_iov, IoVec* out) {
     internal::Error err;
     *out = IoVec();
 
-    z_stream stream;
-    memset(&stream, 0, sizeof stream);
-    int ret = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
-                           -15 /*RFC1951*/, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    z_stream& stream = stream_;
+    int ret;
+    if (initialized_) {
+      ret = deflateReset(&stream);
+    } else {
+      ret = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         -15 /*RFC1951*/, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+      initialized_ = (ret == Z_OK);
+    }
     if (ret != Z_OK) {
       std::ostringstream msg;
       msg << "deflateInit failed(" << ret << ")";
@@ -108,7 +134,6 @@ class FlateTransformerImpl : public Transformer {
       if (ret != Z_OK && ret != Z_STREAM_END) {
         std::ostringstream msg;
         msg << "deflate failed(" << ret << ")";
-        deflateEnd(&stream);
         return msg.str();
       }
       if (stream.avail_in != 0) {
@@ -120,12 +145,15 @@ class FlateTransformerImpl : public Transformer {
       msg << "found trailing junk during deflate";
       return msg.str();
     }
-    deflateEnd(&stream);
     tmp_.resize(tmp_.size() - stream.avail_out);
     tmp_span_ = ByteSpan(&tmp_);
     *out = IoVec(&tmp_span_, 1);
     return "";
   }
+
+ private:
+  z_stream stream_;
+  bool initialized_ = false;
   ByteSpan tmp_span_;
   std::vector<uint8_t> tmp_;
 };
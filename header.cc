@@ -1,6 +1,8 @@
 #include "./header.h"
 
 #include <sstream>
+#include "./block.h"
+#include "./chunk.h"
 #include "./internal.h"
 #include "./recordio.h"
 
@@ -9,8 +11,29 @@ namespace recordio {
 
 const char* const kKeyTrailer = "trailer";
 const char* const kKeyTransformer = "transformer";
+const char* const kKeyFixedItemSize = "fixeditemsize";
+const char* const kKeyBlockIndex = "blockindex";
+const char* const kKeySorted = "sorted";
 namespace {
 
+// Find the BOOL entry with the given key. Sets *v=false if absent.
+internal::Error GetBool(const std::vector<HeaderEntry>& header,
+                        const std::string& key, bool* v) {
+  *v = false;
+  for (const auto& h : header) {
+    if (h.key == key) {
+      if (h.value.type != HeaderValue::BOOL) {
+        std::ostringstream msg;
+        msg << "Wrong " << key << " value type: " << h.value.type;
+        return msg.str();
+      }
+      *v = h.value.b;
+      break;
+    }
+  }
+  return "";
+}
+
 HeaderValue ReadValue(internal::BinaryParser* parser) {
   HeaderValue v{HeaderValue::INVALID, false, 0, 0, ""};
   const uint8_t* type_ptr = parser->ReadBytes(1);
@@ -50,9 +73,41 @@ HeaderValue ReadValue(internal::BinaryParser* parser) {
   return v;
 }
 
+void WriteValue(const HeaderValue& v, std::vector<uint8_t>* buf) {
+  buf->push_back(static_cast<uint8_t>(v.type));
+  switch (v.type) {
+    case HeaderValue::BOOL:
+      buf->push_back(v.b ? 1 : 0);
+      break;
+    case HeaderValue::INT:
+      internal::AppendVarint(buf, v.i);
+      break;
+    case HeaderValue::UINT:
+      internal::AppendUVarint(buf, v.u);
+      break;
+    case HeaderValue::STRING:
+      buf->push_back(static_cast<uint8_t>(HeaderValue::UINT));
+      internal::AppendUVarint(buf, v.s.size());
+      buf->insert(buf->end(), v.s.begin(), v.s.end());
+      break;
+    default:
+      break;
+  }
+}
+
 }  // namespace
 
-std::vector<HeaderEntry> internal::DecodeHeader(const uint8_t* data, int size,
+void internal::EncodeHeader(const std::vector<HeaderEntry>& header,
+                            std::vector<uint8_t>* buf) {
+  WriteValue(HeaderValue{HeaderValue::UINT, false, 0, header.size(), ""}, buf);
+  for (const auto& e : header) {
+    WriteValue(HeaderValue{HeaderValue::STRING, false, 0, 0, e.key}, buf);
+    WriteValue(e.value, buf);
+  }
+}
+
+std::vector<HeaderEntry> internal::DecodeHeader(const uint8_t* data,
+                                                size_t size,
                                                 ErrorReporter* err) {
   std::vector<HeaderEntry> entries;
   BinaryParser parser(data, size, err);
@@ -61,7 +116,7 @@ std::vector<HeaderEntry> internal::DecodeHeader(const uint8_t* data, int size,
     err->Set("Failed to read # header entries");
     return entries;
   }
-  for (int i = 0; i < static_cast<int>(rn.u); i++) {
+  for (uint64_t i = 0; i < rn.u; i++) {
     auto rkey = ReadValue(&parser);
     if (rkey.type != HeaderValue::STRING) {
       err->Set("Failed to read header key");
@@ -76,20 +131,69 @@ std::vector<HeaderEntry> internal::DecodeHeader(const uint8_t* data, int size,
 
 internal::Error internal::HasTrailer(const std::vector<HeaderEntry>& header,
                                      bool* v) {
-  *v = false;
+  return GetBool(header, kKeyTrailer, v);
+}
+
+internal::Error internal::HasBlockIndex(const std::vector<HeaderEntry>& header,
+                                        bool* v) {
+  return GetBool(header, kKeyBlockIndex, v);
+}
+
+internal::Error internal::IsSorted(const std::vector<HeaderEntry>& header,
+                                   bool* v) {
+  return GetBool(header, kKeySorted, v);
+}
+
+internal::Error internal::GetFixedItemSize(
+    const std::vector<HeaderEntry>& header, uint64_t* v) {
+  *v = 0;
   for (const auto& h : header) {
-    if (h.key == kKeyTrailer) {
-      if (h.value.type != HeaderValue::BOOL) {
+    if (h.key == kKeyFixedItemSize) {
+      if (h.value.type != HeaderValue::UINT) {
         std::ostringstream msg;
-        msg << "Wrong trailer value type: " << h.value.type;
+        msg << "Wrong fixeditemsize value type: " << h.value.type;
         return msg.str();
       }
-      *v = h.value.b;
+      *v = h.value.u;
       break;
     }
   }
   return "";
 }
 
+bool internal::ParseHeaderBlock(ByteSpan data, std::vector<HeaderEntry>* header,
+                                std::vector<std::string>* transformers,
+                                uint64_t* fixed_item_size, ErrorReporter* err) {
+  header->clear();
+  transformers->clear();
+  *fixed_item_size = 0;
+  std::vector<ByteSpan> payloads;
+  Magic magic;
+  size_t size;
+  Block block;
+  if (!ParseBlock(data, &magic, &payloads, &size, err) ||
+      !block.Parse(IoVec(&payloads), nullptr, 0, err)) {
+    return false;
+  }
+  if (block.size() != 1) {
+    err->Set("Wrong # of items in header block");
+    return false;
+  }
+  const ByteSpan item = block.Item(0);
+  *header = DecodeHeader(item.data(), item.size(), err);
+  for (const HeaderEntry& e : *header) {
+    if (e.key != kKeyTransformer) continue;
+    if (e.value.type != HeaderValue::STRING) {
+      std::ostringstream msg;
+      msg << "Wrong type for transformer: " << e.value.type;
+      err->Set(msg.str());
+      return false;
+    }
+    transformers->push_back(e.value.s);
+  }
+  err->Set(GetFixedItemSize(*header, fixed_item_size));
+  return err->Ok();
+}
+
 }  // namespace recordio
 }  // namespace grail
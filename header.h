@@ -6,6 +6,8 @@
 #include <string>
 #include <vector>
 
+#include "./internal.h"
+
 namespace grail {
 namespace recordio {
 
@@ -32,15 +34,50 @@ extern const char* const kKeyTrailer;
 // Key "transformer". Sets the list of transformers for each block.
 extern const char* const kKeyTransformer;
 
+// Key "fixeditemsize". If present, every item in a data block is exactly this
+// many bytes, and the blocks don't store the per-item size table. The value is
+// UINT.
+extern const char* const kKeyFixedItemSize;
+
+// Key "blockindex". Indicates that the trailer block holds the block index
+// (see index.h) instead of user data. The value is BOOL.
+extern const char* const kKeyBlockIndex;
+
+// Key "sorted". Indicates that the items are sorted by the keys recorded in
+// the block index. The value is BOOL.
+extern const char* const kKeySorted;
+
 namespace internal {
-class ErrorReporter;
 
 // Decode the contents of a header item.
-std::vector<HeaderEntry> DecodeHeader(const uint8_t* data, int size,
+std::vector<HeaderEntry> DecodeHeader(const uint8_t* data, size_t size,
                                       ErrorReporter* err);
 
+// Encode the header entries into the format read by DecodeHeader. The result
+// is appended to *buf.
+void EncodeHeader(const std::vector<HeaderEntry>& header,
+                  std::vector<uint8_t>* buf);
+
 // See if the header has entry {"trailer", true}.
 std::string HasTrailer(const std::vector<HeaderEntry>& header, bool* v);
+
+// See if the header has entry {"blockindex", true}.
+std::string HasBlockIndex(const std::vector<HeaderEntry>& header, bool* v);
+
+// See if the header has entry {"sorted", true}.
+std::string IsSorted(const std::vector<HeaderEntry>& header, bool* v);
+
+// Find the "fixeditemsize" entry in the header. Sets *v=0 if absent.
+std::string GetFixedItemSize(const std::vector<HeaderEntry>& header,
+                             uint64_t* v);
+
+// Parse a V2 header block as stored in the file, chunk headers included. Sets
+// *header to its entries, *transformers to the names of the block
+// transformers, and *fixed_item_size to the fixed item size, or 0. On error,
+// sets err and returns false.
+bool ParseHeaderBlock(ByteSpan data, std::vector<HeaderEntry>* header,
+                      std::vector<std::string>* transformers,
+                      uint64_t* fixed_item_size, ErrorReporter* err);
 }  // namespace internal
 }  // namespace recordio
 }  // namespace grail
@@ -0,0 +1,151 @@
+#include "./index.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace grail {
+namespace recordio {
+namespace internal {
+
+namespace {
+// 64-bit FNV-1a.
+uint64_t HashKey(const std::string& key) {
+  uint64_t h = 14695981039346656037ULL;
+  for (char c : key) {
+    h ^= static_cast<uint8_t>(c);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void AppendString(std::vector<uint8_t>* buf, const std::string& s) {
+  AppendUVarint(buf, s.size());
+  buf->insert(buf->end(), s.begin(), s.end());
+}
+
+void AppendSection(std::vector<uint8_t>* buf, uint64_t tag,
+                   const std::vector<uint8_t>& section) {
+  AppendUVarint(buf, tag);
+  AppendUVarint(buf, section.size());
+  buf->insert(buf->end(), section.begin(), section.end());
+}
+
+bool DecodeKeyStats(const uint8_t* data, size_t size,
+                    std::vector<BlockKeyStats>* blocks, ErrorReporter* err) {
+  BinaryParser p(data, size, err);
+  const uint64_t n = p.ReadUVarint();
+  if (!err->Ok()) return false;
+  if (n > size) {
+    err->Set("Invalid block count in the block index");
+    return false;
+  }
+  blocks->resize(n);
+  for (auto& b : *blocks) {
+    b.offset = p.ReadUVarint();
+    b.n_items = p.ReadUVarint();
+    b.min_key = p.ReadString(p.ReadUVarint());
+    b.max_key = p.ReadString(p.ReadUVarint());
+    if (!err->Ok()) return false;
+  }
+  return true;
+}
+
+bool DecodeBloomFilters(const uint8_t* data, size_t size,
+                        std::vector<std::string>* filters,
+                        ErrorReporter* err) {
+  BinaryParser p(data, size, err);
+  const uint64_t n = p.ReadUVarint();
+  if (!err->Ok()) return false;
+  if (n > size) {
+    err->Set("Invalid filter count in the block index");
+    return false;
+  }
+  filters->resize(n);
+  for (auto& f : *filters) {
+    f = p.ReadString(p.ReadUVarint());
+    if (!err->Ok()) return false;
+  }
+  return true;
+}
+}  // namespace
+
+// The filter is a bit array followed by one byte that stores the number of
+// probes. The probe positions are derived from one 64-bit hash by double
+// hashing.
+std::string NewBloomFilter(const std::vector<std::string>& keys,
+                           int bits_per_key) {
+  const int probes = std::min(30, std::max(1, bits_per_key * 69 / 100));
+  const size_t bits = std::max<size_t>(64, keys.size() * bits_per_key);
+  const size_t bytes = (bits + 7) / 8;
+  std::string filter(bytes + 1, '\0');
+  for (const auto& key : keys) {
+    const uint64_t h = HashKey(key);
+    uint32_t h1 = static_cast<uint32_t>(h);
+    const uint32_t h2 = static_cast<uint32_t>(h >> 32);
+    for (int i = 0; i < probes; i++, h1 += h2) {
+      const size_t bit = h1 % (bytes * 8);
+      filter[bit / 8] |= 1 << (bit % 8);
+    }
+  }
+  filter[bytes] = static_cast<char>(probes);
+  return filter;
+}
+
+bool BloomFilterMayContain(const std::string& filter, const std::string& key) {
+  if (filter.size() < 2) return true;
+  const size_t bytes = filter.size() - 1;
+  const int probes = static_cast<uint8_t>(filter[bytes]);
+  const uint64_t h = HashKey(key);
+  uint32_t h1 = static_cast<uint32_t>(h);
+  const uint32_t h2 = static_cast<uint32_t>(h >> 32);
+  for (int i = 0; i < probes; i++, h1 += h2) {
+    const size_t bit = h1 % (bytes * 8);
+    if ((filter[bit / 8] & (1 << (bit % 8))) == 0) return false;
+  }
+  return true;
+}
+
+void EncodeBlockIndex(const BlockIndex& index, std::vector<uint8_t>* buf) {
+  std::vector<uint8_t> section;
+  AppendUVarint(&section, index.blocks.size());
+  for (const auto& b : index.blocks) {
+    AppendUVarint(&section, b.offset);
+    AppendUVarint(&section, b.n_items);
+    AppendString(&section, b.min_key);
+    AppendString(&section, b.max_key);
+  }
+  AppendSection(buf, TagKeyStats, section);
+  if (index.bloom_filters.empty()) return;
+  section.clear();
+  AppendUVarint(&section, index.bloom_filters.size());
+  for (const auto& f : index.bloom_filters) AppendString(&section, f);
+  AppendSection(buf, TagBloomFilters, section);
+}
+
+bool DecodeBlockIndex(ByteSpan data, BlockIndex* index, ErrorReporter* err) {
+  BinaryParser p(data.data(), data.size(), err);
+  while (err->Ok() && p.Data() < data.data() + data.size()) {
+    const uint64_t tag = p.ReadUVarint();
+    const uint64_t size = p.ReadUVarint();
+    const uint8_t* section = p.ReadBytes(size);
+    if (!err->Ok()) return false;
+    if (tag == TagKeyStats &&
+        !DecodeKeyStats(section, size, &index->blocks, err)) {
+      return false;
+    }
+    if (tag == TagBloomFilters &&
+        !DecodeBloomFilters(section, size, &index->bloom_filters, err)) {
+      return false;
+    }
+  }
+  if (!index->bloom_filters.empty() &&
+      index->bloom_filters.size() != index->blocks.size()) {
+    err->Set("Bloom filter count differs from the block count");
+    return false;
+  }
+  return err->Ok();
+}
+
+}  // namespace internal
+}  // namespace recordio
+}  // namespace grail
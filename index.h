@@ -0,0 +1,63 @@
+#ifndef LIB_RECORDIO_INDEX_H_
+#define LIB_RECORDIO_INDEX_H_
+
+// The block index is stored in the trailer block of a V2 file when the header
+// has {"blockindex", true}. It is a sequence of sections, each encoded as a
+// uvarint tag, a uvarint length, and the section contents. Readers skip the
+// sections they don't understand.
+//
+// Section TagKeyStats lists the data blocks in file order. Each block is
+// encoded as uvarint offset, uvarint item count, then the min and the max key
+// of the items, each as a uvarint length followed by the bytes.
+//
+// Section TagBloomFilters, if present, holds one Bloom filter of the keys per
+// block, in the same order as TagKeyStats. It is encoded as uvarint count,
+// then each filter as a uvarint length followed by the bytes.
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./internal.h"
+
+namespace grail {
+namespace recordio {
+namespace internal {
+
+constexpr uint64_t TagKeyStats = 1;
+constexpr uint64_t TagBloomFilters = 2;
+
+// Statistics of one data block.
+struct BlockKeyStats {
+  int64_t offset;    // File offset of the block.
+  uint64_t n_items;  // Number of items in the block.
+  std::string min_key;
+  std::string max_key;
+};
+
+struct BlockIndex {
+  std::vector<BlockKeyStats> blocks;  // Sorted by offset.
+  // Bloom filters of the keys, indexed as blocks. Empty if absent.
+  std::vector<std::string> bloom_filters;
+};
+
+// Build a Bloom filter of "keys" that uses about bits_per_key bits per key.
+// The false positive rate is about 1% with 10 bits per key.
+std::string NewBloomFilter(const std::vector<std::string>& keys,
+                           int bits_per_key);
+
+// Returns false if "key" was definitely not added to "filter".
+bool BloomFilterMayContain(const std::string& filter, const std::string& key);
+
+// Encode "index" into the trailer payload format. The result is appended to
+// *buf.
+void EncodeBlockIndex(const BlockIndex& index, std::vector<uint8_t>* buf);
+
+// Decode a trailer payload produced by EncodeBlockIndex. On error, sets err
+// and returns false.
+bool DecodeBlockIndex(ByteSpan data, BlockIndex* index, ErrorReporter* err);
+
+}  // namespace internal
+}  // namespace recordio
+}  // namespace grail
+
+#endif  // LIB_RECORDIO_INDEX_H_
@@ -1,9 +1,13 @@
 #include "./internal.h"
 
+#include <sys/mman.h>
+
 #include <algorithm>
 #include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <new>
 #include <sstream>
 
 #include "./portable_endian.h"
@@ -26,13 +30,19 @@ std::string MagicDebugString(const Magic& m) {
   return s.str();
 }
 
-Error ReadFull(ReadSeeker* in, uint8_t* data, int bytes) {
-  ssize_t n;
-  Error err = in->Read(data, bytes, &n);
-  if (err != "") return err;
-  if (n != bytes) {
+Error ReadFull(ReadSeeker* in, uint8_t* data, size_t bytes) {
+  // Pipes and sockets may return fewer bytes than asked for.
+  size_t done = 0;
+  while (done < bytes) {
+    ssize_t n;
+    Error err = in->Read(data + done, bytes - done, &n);
+    if (err != "") return err;
+    if (n <= 0) break;
+    done += n;
+  }
+  if (done != bytes) {
     std::ostringstream msg;
-    msg << "Failed to read " << bytes << " bytes from stream, read " << n
+    msg << "Failed to read " << bytes << " bytes from stream, read " << done
         << " bytes instead: " << std::strerror(errno);
     return msg.str();
   }
@@ -60,7 +70,7 @@ Error AbsSeek(ReadSeeker* in, off_t off) {
 
 uint64_t BinaryParser::ReadLEUint64() {
   uint64_t v;
-  if (bytes_ < static_cast<int>(sizeof v)) {
+  if (bytes_ < sizeof v) {
     err_->Set("Failed to read uint64");
     return 0;
   }
@@ -73,7 +83,7 @@ uint64_t BinaryParser::ReadLEUint64() {
 
 uint32_t BinaryParser::ReadLEUint32() {
   uint32_t v;
-  if (bytes_ < static_cast<int>(sizeof v)) {
+  if (bytes_ < sizeof v) {
     err_->Set("Failed to read uint32");
     return 0;
   }
@@ -121,7 +131,7 @@ int64_t BinaryParser::ReadVarint() {
   return v;
 }
 
-const uint8_t* BinaryParser::ReadBytes(int bytes) {
+const uint8_t* BinaryParser::ReadBytes(size_t bytes) {
   if (bytes_ < bytes) {
     std::ostringstream msg;
     msg << "ReadBytes: failed to read " << bytes << " bytes";
@@ -134,7 +144,7 @@ const uint8_t* BinaryParser::ReadBytes(int bytes) {
   return p;
 }
 
-std::string BinaryParser::ReadString(int bytes) {
+std::string BinaryParser::ReadString(size_t bytes) {
   std::string s;
   const uint8_t* v = ReadBytes(bytes);
   if (v == nullptr) return s;
@@ -142,6 +152,24 @@ std::string BinaryParser::ReadString(int bytes) {
   return s;
 }
 
+void AppendUVarint(std::vector<uint8_t>* buf, uint64_t v) {
+  while (v >= 0x80) {
+    buf->push_back(static_cast<uint8_t>(v) | 0x80);
+    v >>= 7;
+  }
+  buf->push_back(static_cast<uint8_t>(v));
+}
+
+void AppendVarint(std::vector<uint8_t>* buf, int64_t v) {
+  uint64_t u;
+  memcpy(&u, &v, sizeof(u));
+  u <<= 1;
+  if (v < 0) {
+    u = ~u;
+  }
+  AppendUVarint(buf, u);
+}
+
 std::vector<uint8_t> IoVecFlatten(IoVec iov) {
   std::vector<uint8_t> buf;
   buf.resize(IoVecSize(iov));
@@ -159,6 +187,20 @@ bool HasSuffix(const std::string& str, const std::string& suffix) {
   }
   return std::equal(suffix.rbegin(), suffix.rend(), str.rbegin());
 }
+
+void* AllocHugePages(size_t bytes) {
+  const size_t rounded = (bytes + HugePageSize - 1) / HugePageSize *
+                         HugePageSize;
+  void* p;
+  if (posix_memalign(&p, HugePageSize, rounded) != 0) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+  // Only advice. Without THP support the memory is simply not huge.
+  madvise(p, rounded, MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+void FreeHugePages(void* p) { free(p); }
 }  // namespace internal
 }  // namespace recordio
 }  // namespace grail
@@ -9,10 +9,14 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 namespace grail {
 namespace recordio {
+
+class Writer;
+
 namespace internal {
 
 typedef std::string Error;
@@ -26,8 +30,21 @@ const Magic MagicTrailer = {{0xfe, 0xba, 0x1a, 0xd7, 0xcb, 0xdf, 0x75, 0x3a}};
 
 std::string MagicDebugString(const Magic& m);
 
-inline uint32_t Crc32(const uint8_t* data, int bytes) {
-  return crc32(0, data, bytes);
+// Size of the block header in the V1 format: magic, the uint64 block size, and
+// the crc32 of the block size.
+constexpr int LegacyBlockHeaderSize = sizeof(Magic) + 8 + 4;
+
+// Compute the crc32 of [data, data+bytes). zlib takes a 32-bit length, so
+// larger ranges are fed to it in pieces.
+inline uint32_t Crc32(const uint8_t* data, size_t bytes) {
+  constexpr size_t MaxPiece = 1 << 30;
+  uLong crc = crc32(0, nullptr, 0);
+  while (bytes > MaxPiece) {
+    crc = crc32(crc, data, MaxPiece);
+    data += MaxPiece;
+    bytes -= MaxPiece;
+  }
+  return crc32(crc, data, bytes);
 }
 
 // ReadSeeker is an abstract interface for low-level file I/O.
@@ -49,7 +66,7 @@ class ReadSeeker {
 };
 
 // Read exactly "bytes". Returns an error string on error.
-Error ReadFull(ReadSeeker* in, uint8_t* data, int bytes);
+Error ReadFull(ReadSeeker* in, uint8_t* data, size_t bytes);
 
 // Seek to the given abs offset. Returns an error string on error.
 Error AbsSeek(ReadSeeker* in, int64_t off);
@@ -73,6 +90,9 @@ class ErrorReporter {
   // Return the error message.
   const Error& Err() const { return err_; }
 
+  // Forget the error.
+  void Clear() { err_.clear(); }
+
  private:
   Error err_;
   ErrorReporter(const ErrorReporter&) = delete;
@@ -83,7 +103,7 @@ class BinaryParser {
  public:
   // Arrange to parse data in range [data,data+bytes). Any parsing error will be
   // reported in err.
-  BinaryParser(const uint8_t* data, int bytes, ErrorReporter* err)
+  BinaryParser(const uint8_t* data, size_t bytes, ErrorReporter* err)
       : data_(data), bytes_(bytes), err_(err) {}
 
   // Return the pointer to the unread part of the data.
@@ -91,10 +111,10 @@ class BinaryParser {
 
   // Consume "bytes" of data. Return the pointer to the data consumed.  Returns
   // nil and sets err_ if less than "bytes" are remaining in the buffer.
-  const uint8_t* ReadBytes(int bytes);
+  const uint8_t* ReadBytes(size_t bytes);
 
   // Read a string of exactly "bytes". On error, returns "" and sets err_.
-  std::string ReadString(int bytes);
+  std::string ReadString(size_t bytes);
   // Read a 64bit little-endian 64bit uint. On error, returns 0 and sets err_.
   uint64_t ReadLEUint64();
   // Read a 32bit little-endian 64bit uint. On error, returns 0 and sets err_.
@@ -108,10 +128,17 @@ class BinaryParser {
 
  private:
   const uint8_t* data_;
-  int bytes_;
+  size_t bytes_;
   ErrorReporter* err_;
 };
 
+// Append "v" to "buf" in uvarint format. It is the inverse of
+// BinaryParser::ReadUVarint.
+void AppendUVarint(std::vector<uint8_t>* buf, uint64_t v);
+// Append "v" to "buf" in zigzag varint format. It is the inverse of
+// BinaryParser::ReadVarint.
+void AppendVarint(std::vector<uint8_t>* buf, int64_t v);
+
 std::string StrError(const std::string& prefix);
 
 // Span<T> is like vector<T>, but doesn't own data.
@@ -166,6 +193,68 @@ std::vector<uint8_t> IoVecFlatten(IoVec iov);
 // Check if str ends with the given suffix.
 bool HasSuffix(const std::string& str, const std::string& suffix);
 
+// Create a writer whose every operation fails with "err".
+std::unique_ptr<Writer> NewErrorWriter(Error err);
+
+// Size of a transparent huge page.
+constexpr size_t HugePageSize = 2 << 20;
+
+// Allocate "bytes" of memory aligned to HugePageSize, and ask the kernel to
+// back it with transparent huge pages. Throws std::bad_alloc on failure.
+// Free the memory with FreeHugePages.
+void* AllocHugePages(size_t bytes);
+void FreeHugePages(void* p);
+
+// Allocator that backs allocations of HugePageSize bytes or more with
+// transparent huge pages if huge_pages=true. Other allocations come from
+// operator new. Large buffers that are scanned end to end take far fewer TLB
+// misses on huge pages.
+template <typename T>
+class HugePageAllocator {
+ public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  explicit HugePageAllocator(bool huge_pages = false)
+      : huge_pages_(huge_pages) {}
+  template <typename U>
+  HugePageAllocator(const HugePageAllocator<U>& other)  // NOLINT
+      : huge_pages_(other.huge_pages()) {}
+
+  T* allocate(size_t n) {
+    if (UseHugePages(n)) return static_cast<T*>(AllocHugePages(n * sizeof(T)));
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* p, size_t n) {
+    if (UseHugePages(n)) {
+      FreeHugePages(p);
+    } else {
+      std::allocator<T>().deallocate(p, n);
+    }
+  }
+
+  bool huge_pages() const { return huge_pages_; }
+
+  bool operator==(const HugePageAllocator& other) const {
+    return huge_pages_ == other.huge_pages_;
+  }
+  bool operator!=(const HugePageAllocator& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  bool UseHugePages(size_t n) const {
+    return huge_pages_ && n * sizeof(T) >= HugePageSize;
+  }
+
+  bool huge_pages_;
+};
+
+// Byte buffer that may be backed by huge pages.
+typedef std::vector<uint8_t, HugePageAllocator<uint8_t>> HugePageBuffer;
+
 }  // namespace internal
 }  // namespace recordio
 }  // namespace grail
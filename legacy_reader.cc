@@ -19,10 +19,6 @@ constexpr int DataOffset = CrcOffset + 4;
 // HeaderSize is the size in bytes of the recordio header.
 constexpr int HeaderSize = DataOffset;
 
-// MaxReadRecordSize defines a max size for a record when reading to avoid
-// crashes for unreasonable requests.
-constexpr uint64_t MaxReadRecordSize = 1ULL << 29;
-
 internal::Error RunTransformer(Transformer* t, std::vector<uint8_t>* buf,
                                int buf_off) {
   ByteSpan span{buf->data() + buf_off, buf->size() - buf_off};
@@ -43,8 +39,11 @@ internal::Error RunTransformer(Transformer* t, std::vector<uint8_t>* buf,
 class BaseReader {
  public:
   explicit BaseReader(std::unique_ptr<ReadSeeker> in, internal::Magic magic,
-                      internal::ErrorReporter* err)
-      : in_(std::move(in)), magic_(magic), err_(err) {}
+                      uint64_t max_record_size, internal::ErrorReporter* err)
+      : in_(std::move(in)),
+        magic_(magic),
+        max_record_size_(max_record_size),
+        err_(err) {}
 
   bool Scan() {
     uint64_t size;
@@ -52,8 +51,8 @@ class BaseReader {
       return false;
     }
     buf_.resize(size);
-    int n = ReadBytes(buf_.data(), size);
-    if (static_cast<uint64_t>(n) != size) {
+    const size_t n = ReadBytes(buf_.data(), size);
+    if (n != size) {
       std::ostringstream msg;
       msg << "failed to read " << size << " byte body (found " << n << " bytes";
       err_->Set(msg.str());
@@ -69,13 +68,7 @@ class BaseReader {
   // length of the rest of the block.
   bool ReadHeader(uint64_t* size) {
     uint8_t header[HeaderSize];
-    ssize_t n = ReadBytes(header, sizeof(header));
-    if (n < 0) {
-      std::ostringstream msg;
-      msg << "Failed to read file: " << strerror(errno);
-      err_->Set(msg.str());
-      return false;  // EOF
-    }
+    const size_t n = ReadBytes(header, sizeof(header));
     if (n == 0) {
       return false;  // EOF
     }
@@ -110,10 +103,10 @@ class BaseReader {
       err_->Set(msg.str());
       return false;
     }
-    if (*size > MaxReadRecordSize) {
+    if (*size > max_record_size_) {
       std::ostringstream msg;
       msg << "unreasonably large read record encountered: " << *size << " > "
-          << MaxReadRecordSize << " bytes";
+          << max_record_size_ << " bytes";
       err_->Set(msg.str());
       return false;
     }
@@ -121,8 +114,8 @@ class BaseReader {
   }
 
   // Read "bytes" byte from in_.
-  ssize_t ReadBytes(uint8_t* data, int bytes) {
-    int remaining = bytes;
+  size_t ReadBytes(uint8_t* data, size_t bytes) {
+    size_t remaining = bytes;
     while (remaining > 0) {
       ssize_t n;
       in_->Read(reinterpret_cast<uint8_t*>(data), remaining, &n);
@@ -137,6 +130,7 @@ class BaseReader {
 
   std::unique_ptr<ReadSeeker> const in_;
   const internal::Magic magic_;
+  const uint64_t max_record_size_;  // Max size of a block, excluding header.
   internal::ErrorReporter* const err_;
   std::vector<uint8_t> buf_;
 };
@@ -145,8 +139,9 @@ class BaseReader {
 class UnpackedReaderImpl : public Reader {
  public:
   explicit UnpackedReaderImpl(std::unique_ptr<ReadSeeker> in,
-                              std::unique_ptr<Transformer> transformer)
-      : r_(std::move(in), internal::MagicUnpacked, &err_),
+                              std::unique_ptr<Transformer> transformer,
+                              uint64_t max_record_size)
+      : r_(std::move(in), internal::MagicUnpacked, max_record_size, &err_),
         transformer_(std::move(transformer)) {}
 
   std::vector<HeaderEntry> Header() override {
@@ -168,7 +163,27 @@ class UnpackedReaderImpl : public Reader {
 
   std::vector<uint8_t>* Mutable() override { return &block_; }
   ByteSpan Get() override { return ByteSpan{block_.data(), block_.size()}; }
+  ByteSpan GetFixedItems(size_t* item_size) override {
+    *item_size = 0;
+    return ByteSpan{nullptr, 0};
+  }
+  void GetItems(std::vector<ByteSpan>* items) override {
+    items->assign(1, Get());
+  }
   void Seek(ItemLocation loc) override { err_.Set("Seek not supported"); }
+  void Reset(std::unique_ptr<ReadSeeker> in) override {
+    err_.Set("Reset not supported");
+  }
+  Stats GetStats() override { return Stats(); }
+  bool Lookup(const std::string& key) override {
+    err_.Set("Lookup not supported");
+    return false;
+  }
+  bool Gather(const std::vector<ItemLocation>& locs,
+              const std::function<void(size_t, ByteSpan)>& callback) override {
+    err_.Set("Gather not supported");
+    return false;
+  }
   std::string GetError() override { return err_.Err(); }
   ByteSpan Trailer() override { return ByteSpan{nullptr, 0}; }
 
@@ -183,8 +198,9 @@ class UnpackedReaderImpl : public Reader {
 class PackedReaderImpl : public Reader {
  public:
   explicit PackedReaderImpl(std::unique_ptr<ReadSeeker> in,
-                            std::unique_ptr<Transformer> transformer)
-      : r_(std::move(in), internal::MagicPacked, &err_),
+                            std::unique_ptr<Transformer> transformer,
+                            uint64_t max_record_size)
+      : r_(std::move(in), internal::MagicPacked, max_record_size, &err_),
         transformer_(std::move(transformer)),
         cur_item_(0) {}
 
@@ -205,10 +221,34 @@ class PackedReaderImpl : public Reader {
 
   ByteSpan Get() override {
     const Item item = items_[cur_item_];
-    return ByteSpan{items_start_ + item.offset, static_cast<size_t>(item.size)};
+    return ByteSpan{items_start_ + item.offset, item.size};
+  }
+
+  ByteSpan GetFixedItems(size_t* item_size) override {
+    *item_size = 0;
+    return ByteSpan{nullptr, 0};
+  }
+
+  void GetItems(std::vector<ByteSpan>* items) override {
+    items->clear();
+    for (; cur_item_ < items_.size(); cur_item_++) items->push_back(Get());
+    cur_item_--;
   }
 
   void Seek(ItemLocation loc) override { err_.Set("Seek not supported"); }
+  void Reset(std::unique_ptr<ReadSeeker> in) override {
+    err_.Set("Reset not supported");
+  }
+  Stats GetStats() override { return Stats(); }
+  bool Lookup(const std::string& key) override {
+    err_.Set("Lookup not supported");
+    return false;
+  }
+  bool Gather(const std::vector<ItemLocation>& locs,
+              const std::function<void(size_t, ByteSpan)>& callback) override {
+    err_.Set("Gather not supported");
+    return false;
+  }
   Error GetError() override { return err_.Err(); }
   std::vector<HeaderEntry> Header() override {
     return std::vector<HeaderEntry>();
@@ -232,9 +272,9 @@ class PackedReaderImpl : public Reader {
       err_.Set("invalid block header (n_items)");
       return false;
     }
-    for (uint32_t i = 0; i < n_items; i++) {
+    for (uint64_t i = 0; i < n_items; i++) {
       uint64_t item_size = parser.ReadUVarint();
-      Item item = {0, static_cast<int>(item_size)};
+      Item item = {0, item_size};
       if (i > 0) {
         item.offset = items_[i - 1].offset + items_[i - 1].size;
       }
@@ -259,7 +299,7 @@ class PackedReaderImpl : public Reader {
     }
     items_limit = block_.data() + block_.size();
     if (items_.back().offset + items_.back().size !=
-        (items_limit - items_start_)) {
+        static_cast<uint64_t>(items_limit - items_start_)) {
       err_.Set("junk at the end of block");
       return false;
     }
@@ -267,8 +307,8 @@ class PackedReaderImpl : public Reader {
   }
 
   struct Item {
-    int offset;  // byte offset from items_start_
-    int size;    // byte size of the item
+    uint64_t offset;  // byte offset from items_start_
+    uint64_t size;    // byte size of the item
   };
   internal::ErrorReporter err_;
   BaseReader r_;  // Underlying unpacked reader.
@@ -283,15 +323,17 @@ class PackedReaderImpl : public Reader {
 
 namespace internal {
 std::unique_ptr<Reader> NewLegacyPackedReader(
-    std::unique_ptr<ReadSeeker> in, std::unique_ptr<Transformer> transformer) {
-  return std::unique_ptr<Reader>(
-      new PackedReaderImpl(std::move(in), std::move(transformer)));
+    std::unique_ptr<ReadSeeker> in, std::unique_ptr<Transformer> transformer,
+    uint64_t max_record_size) {
+  return std::unique_ptr<Reader>(new PackedReaderImpl(
+      std::move(in), std::move(transformer), max_record_size));
 }
 
 std::unique_ptr<Reader> NewLegacyUnpackedReader(
-    std::unique_ptr<ReadSeeker> in, std::unique_ptr<Transformer> transformer) {
-  return std::unique_ptr<Reader>(
-      new UnpackedReaderImpl(std::move(in), std::move(transformer)));
+    std::unique_ptr<ReadSeeker> in, std::unique_ptr<Transformer> transformer,
+    uint64_t max_record_size) {
+  return std::unique_ptr<Reader>(new UnpackedReaderImpl(
+      std::move(in), std::move(transformer), max_record_size));
 }
 }  // namespace internal
 
@@ -0,0 +1,215 @@
+#include "./prefetch.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace grail {
+namespace recordio {
+namespace internal {
+
+namespace {
+
+// The settings are adjusted after every this many blocks.
+constexpr int64_t TuneInterval = 16;
+
+// The caller is considered the bottleneck if it spends less than this
+// fraction of its time waiting for blocks.
+constexpr double StallFraction = 0.05;
+
+double Seconds(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
+}  // namespace
+
+Prefetcher::Prefetcher(ReadSeeker* in, int64_t offset,
+                       const std::vector<std::string>& transformers,
+                       uint64_t fixed_item_size, int max_depth,
+                       int max_threads, bool huge_pages,
+                       std::function<int64_t(int64_t offset)> skip)
+    : transformers_(transformers),
+      fixed_item_size_(fixed_item_size),
+      max_depth_(std::max(1, max_depth)),
+      max_threads_(std::max(1, max_threads)),
+      huge_pages_(huge_pages),
+      skip_(std::move(skip)),
+      next_offset_(offset),
+      depth_(std::min(max_depth_, 2)),
+      threads_(1) {
+  reader_ = std::thread([this, in, offset]() { ReadLoop(in, offset); });
+  workers_.emplace_back([this]() { DecodeLoop(0); });
+}
+
+Prefetcher::~Prefetcher() {
+  {
+    std::unique_lock<std::mutex> l(mu_);
+    stop_ = true;
+    cond_.notify_all();
+  }
+  reader_.join();
+  for (auto& t : workers_) t.join();
+}
+
+std::shared_ptr<Block> Prefetcher::Next(int64_t* offset, int64_t* next_offset,
+                                        ErrorReporter* err) {
+  const Clock::time_point start = Clock::now();
+  std::unique_lock<std::mutex> l(mu_);
+  if (started_) stats_.consumer_seconds += Seconds(start - last_next_);
+  started_ = true;
+  cond_.wait(l, [this]() {
+    return slots_.empty() ? eof_ : slots_.front()->done;
+  });
+  last_next_ = Clock::now();
+  stats_.wait_seconds += Seconds(last_next_ - start);
+  if (slots_.empty()) {
+    err->Set(read_err_);
+    return nullptr;
+  }
+  std::unique_ptr<Slot> slot = std::move(slots_.front());
+  slots_.pop_front();
+  if (!slot->err.empty()) {
+    err->Set(slot->err);
+    return nullptr;
+  }
+  stats_.blocks++;
+  if (stats_.blocks - last_tune_.blocks >= TuneInterval) Tune();
+  cond_.notify_all();
+  *offset = slot->offset;
+  *next_offset = slot->next_offset;
+  next_offset_ = slot->next_offset;
+  return std::move(slot->block);
+}
+
+void Prefetcher::AddStats(Reader::Stats* stats) {
+  std::unique_lock<std::mutex> l(mu_);
+  stats->blocks += stats_.blocks;
+  stats->io_seconds += stats_.io_seconds;
+  stats->decode_seconds += stats_.decode_seconds;
+  stats->wait_seconds += stats_.wait_seconds;
+  stats->consumer_seconds += stats_.consumer_seconds;
+  stats->prefetch_depth = depth_;
+  stats->decode_threads = threads_;
+}
+
+void Prefetcher::Tune() {
+  const Reader::Stats& s = stats_;
+  const Reader::Stats& p = last_tune_;
+  const double n = s.blocks - p.blocks;
+  const double io = (s.io_seconds - p.io_seconds) / n;
+  const double decode = (s.decode_seconds - p.decode_seconds) / n;
+  const double wait = s.wait_seconds - p.wait_seconds;
+  const double consumer = s.consumer_seconds - p.consumer_seconds;
+  last_tune_ = stats_;
+
+  if (wait < StallFraction * (wait + consumer)) {
+    // The caller is the bottleneck. Drop a worker if the others can keep up.
+    if (threads_ > 1 && decode / (threads_ - 1) < consumer / n) threads_--;
+    return;
+  }
+  if (decode / threads_ > io) {
+    // Decoding is the bottleneck. Every worker needs a block to decode.
+    if (threads_ < max_threads_) threads_++;
+    while (static_cast<int>(workers_.size()) < threads_) {
+      const int index = workers_.size();
+      workers_.emplace_back([this, index]() { DecodeLoop(index); });
+    }
+    depth_ = std::min(max_depth_, std::max(depth_, 2 * threads_));
+  } else {
+    // Reading is the bottleneck. Read further ahead to ride out slow reads.
+    depth_ = std::min(max_depth_, 2 * depth_);
+  }
+}
+
+void Prefetcher::ReadLoop(ReadSeeker* in, int64_t offset) {
+  ErrorReporter err;
+  ChunkReader cr(in, &err, huge_pages_);
+  if (offset >= 0) cr.Seek(offset);
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> l(mu_);
+      cond_.wait(l, [this]() {
+        return stop_ || static_cast<int>(slots_.size()) < depth_;
+      });
+      if (stop_) return;
+    }
+    const Clock::time_point start = Clock::now();
+    if (skip_ && cr.Offset() >= 0) {
+      const int64_t next = skip_(cr.Offset());
+      if (next != cr.Offset()) cr.Seek(next);
+    }
+    std::unique_ptr<Slot> slot;
+    if (err.Ok() && cr.Scan()) {
+      const Magic magic = cr.GetMagic();
+      if (magic == MagicPacked) {
+        slot.reset(new Slot(huge_pages_));
+        const IoVec chunks = cr.Chunks();
+        slot->raw.reserve(IoVecSize(chunks));
+        for (size_t i = 0; i < chunks.size(); i++) {
+          slot->raw.insert(slot->raw.end(), chunks[i].begin(), chunks[i].end());
+        }
+        slot->next_offset = cr.Offset();
+        if (slot->next_offset >= 0) slot->offset = cr.BlockOffset();
+      } else if (magic != MagicTrailer) {
+        std::ostringstream msg;
+        msg << "Bad magic: " << MagicDebugString(magic);
+        err.Set(msg.str());
+      }
+    }
+    const double secs = Seconds(Clock::now() - start);
+    std::unique_lock<std::mutex> l(mu_);
+    stats_.io_seconds += secs;
+    if (slot == nullptr) {
+      eof_ = true;
+      read_err_ = err.Err();
+      cond_.notify_all();
+      return;
+    }
+    slots_.push_back(std::move(slot));
+    cond_.notify_all();
+  }
+}
+
+void Prefetcher::DecodeLoop(int index) {
+  std::unique_ptr<Transformer> tr;
+  const Error tr_err = GetUntransformer(transformers_, &tr);
+  std::unique_lock<std::mutex> l(mu_);
+  for (;;) {
+    Slot* slot = nullptr;
+    cond_.wait(l, [this, index, &slot]() {
+      if (stop_) return true;
+      if (index >= threads_) return false;
+      for (const auto& s : slots_) {
+        if (!s->decoding) {
+          slot = s.get();
+          return true;
+        }
+      }
+      return false;
+    });
+    if (stop_) return;
+    slot->decoding = true;
+    l.unlock();
+
+    const Clock::time_point start = Clock::now();
+    ErrorReporter err;
+    err.Set(tr_err);
+    std::shared_ptr<Block> block(new Block(huge_pages_));
+    if (err.Ok()) {
+      const ByteSpan raw(slot->raw.data(), slot->raw.size());
+      block->Parse(IoVec(&raw, 1), tr.get(), fixed_item_size_, &err);
+    }
+    HugePageBuffer(slot->raw.get_allocator()).swap(slot->raw);
+    const double secs = Seconds(Clock::now() - start);
+
+    l.lock();
+    stats_.decode_seconds += secs;
+    slot->block = std::move(block);
+    slot->err = err.Err();
+    slot->done = true;
+    cond_.notify_all();
+  }
+}
+
+}  // namespace internal
+}  // namespace recordio
+}  // namespace grail
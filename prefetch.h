@@ -0,0 +1,117 @@
+#ifndef LIB_RECORDIO_PREFETCH_H_
+#define LIB_RECORDIO_PREFETCH_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./block.h"
+#include "./chunk.h"
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+namespace internal {
+
+// Prefetcher reads the data blocks of a V2 file ahead of Reader::Scan, and
+// decodes them in parallel. One thread reads the blocks in file order, and
+// up to max_threads workers decode them.
+//
+// It measures the time spent reading, decoding, waiting for blocks, and in the
+// caller between blocks, and periodically adjusts the read-ahead depth and
+// the number of active workers: more workers when decoding is the
+// bottleneck, deeper read-ahead when reading is, and fewer workers when the
+// caller is.
+//
+// This class is thread compatible. The methods are called by the reader's
+// thread.
+class Prefetcher {
+ public:
+  // Read "in" from "offset", or from its current position if offset < 0. The
+  // offsets of the blocks are known only in the former case. If non-null,
+  // "skip" is called with the offset of every block, and returns the offset
+  // of the block to read instead, which may be the same. Reading stops at the
+  // trailer or at EOF. If huge_pages=true, the buffers are allocated in huge
+  // pages.
+  Prefetcher(ReadSeeker* in, int64_t offset,
+             const std::vector<std::string>& transformers,
+             uint64_t fixed_item_size, int max_depth, int max_threads,
+             bool huge_pages, std::function<int64_t(int64_t offset)> skip);
+  ~Prefetcher();
+
+  // Wait for the next block. Sets *offset and *next_offset to the offsets of
+  // the block and the one after it, or -1 if unknown. Returns null at the end
+  // of the file, or on error, in which case err is set.
+  std::shared_ptr<Block> Next(int64_t* offset, int64_t* next_offset,
+                              ErrorReporter* err);
+
+  // Offset of the block that the next call to Next returns, or -1 if
+  // unknown.
+  int64_t NextOffset() const { return next_offset_; }
+
+  // Add the statistics to *stats.
+  void AddStats(Reader::Stats* stats);
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  // A block, from the time it is read until it is taken by Next.
+  struct Slot {
+    explicit Slot(bool huge_pages)
+        : raw(HugePageAllocator<uint8_t>(huge_pages)) {}
+    HugePageBuffer raw;  // Transformed block contents.
+    std::shared_ptr<Block> block;
+    int64_t offset = -1;
+    int64_t next_offset = -1;
+    bool decoding = false;  // A worker is decoding or has decoded the block.
+    bool done = false;      // The block is decoded, or failed to decode.
+    Error err;
+  };
+
+  void ReadLoop(ReadSeeker* in, int64_t offset);
+  void DecodeLoop(int index);
+  // Adjust depth_ and threads_ from the statistics since the last call.
+  //
+  // REQUIRES: mu_ is held.
+  void Tune();
+
+  const std::vector<std::string> transformers_;
+  const uint64_t fixed_item_size_;
+  const int max_depth_;
+  const int max_threads_;
+  const bool huge_pages_;
+  const std::function<int64_t(int64_t offset)> skip_;
+
+  // Accessed only by the caller thread.
+  int64_t next_offset_;
+  Clock::time_point last_next_;  // When the last call to Next returned.
+  bool started_ = false;         // Next has been called.
+
+  std::mutex mu_;
+  std::condition_variable cond_;
+  // Guarded by mu_.
+  std::deque<std::unique_ptr<Slot>> slots_;  // In file order.
+  bool eof_ = false;  // The read thread has read all the blocks.
+  Error read_err_;    // Error seen by the read thread.
+  bool stop_ = false;
+  int depth_;    // Max number of slots.
+  int threads_;  // Number of active workers.
+  Reader::Stats stats_;
+  Reader::Stats last_tune_;  // stats_ at the last call to Tune.
+
+  std::thread reader_;
+  std::vector<std::thread> workers_;  // Started on demand by Tune.
+};
+
+}  // namespace internal
+}  // namespace recordio
+}  // namespace grail
+
+#endif  // LIB_RECORDIO_PREFETCH_H_
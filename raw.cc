@@ -0,0 +1,352 @@
+// This file implements RawBlockReader and RawBlockWriter, which move blocks
+// between files, pipes and sockets without decoding them.
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#include "./portable_endian.h"
+#include "./chunk.h"
+#include "./internal.h"
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+namespace {
+
+using internal::ErrorReporter;
+using internal::Magic;
+
+// Max number of bytes moved by one sendfile or splice call.
+constexpr size_t MaxTransferSize = 1 << 30;
+
+// Read exactly "bytes" at offset "off". Sets *eof if the file ends at off.
+bool PreadFull(int fd, uint8_t* buf, size_t bytes, int64_t off, bool* eof,
+               ErrorReporter* err) {
+  *eof = false;
+  size_t done = 0;
+  while (done < bytes) {
+    const ssize_t n = pread(fd, buf + done, bytes - done, off + done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      err->Set(internal::StrError("pread"));
+      return false;
+    }
+    if (n == 0) {
+      if (done == 0) {
+        *eof = true;
+      } else {
+        std::ostringstream msg;
+        msg << "Truncated block at offset " << off << ": read " << done
+            << " bytes, expect " << bytes;
+        err->Set(msg.str());
+      }
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+// Write all of buf to fd.
+bool WriteFull(int fd, const uint8_t* buf, size_t bytes, ErrorReporter* err) {
+  while (bytes > 0) {
+    const ssize_t n = write(fd, buf, bytes);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      err->Set(internal::StrError("write"));
+      return false;
+    }
+    buf += n;
+    bytes -= n;
+  }
+  return true;
+}
+
+class RawBlockReaderImpl : public RawBlockReader {
+ public:
+  RawBlockReaderImpl(int fd, int64_t off) : fd_(fd), next_off_(off) {}
+  explicit RawBlockReaderImpl(Error err) : fd_(-1) { err_.Set(err); }
+
+  ~RawBlockReaderImpl() override {
+    if (fd_ >= 0) close(fd_);
+  }
+
+  bool Scan() override {
+    if (!err_.Ok()) return false;
+    off_ = next_off_;
+    if (format_ == Format::UNKNOWN && !SniffFormat()) return false;
+
+    bool eof;
+    if (format_ == Format::V2) {
+      uint8_t header[internal::ChunkHeaderSize];
+      if (!PreadFull(fd_, header, sizeof header, off_, &eof, &err_)) {
+        return false;
+      }
+      memcpy(magic_.data(), header, magic_.size());
+      internal::BinaryParser p(header + sizeof(Magic) + 8,
+                               sizeof header - sizeof(Magic) - 8, &err_);
+      p.ReadLEUint32();  // size
+      const uint32_t total = p.ReadLEUint32();
+      const uint32_t index = p.ReadLEUint32();
+      if (!err_.Ok()) return false;
+      if (index != 0 || total == 0) {
+        std::ostringstream msg;
+        msg << "Offset " << off_ << " is not at a block boundary (chunk "
+            << index << "/" << total << ")";
+        err_.Set(msg.str());
+        return false;
+      }
+      size_ = static_cast<int64_t>(total) * internal::ChunkSize;
+    } else {
+      uint8_t header[internal::LegacyBlockHeaderSize];
+      if (!PreadFull(fd_, header, sizeof header, off_, &eof, &err_)) {
+        return false;
+      }
+      memcpy(magic_.data(), header, magic_.size());
+      internal::BinaryParser p(header + sizeof(Magic),
+                               sizeof header - sizeof(Magic), &err_);
+      const uint64_t size = p.ReadLEUint64();
+      const uint32_t expected_crc = p.ReadLEUint32();
+      if (!err_.Ok()) return false;
+      if (internal::Crc32(header + sizeof(Magic), 8) != expected_crc) {
+        std::ostringstream msg;
+        msg << "Corrupt block header crc at offset " << off_;
+        err_.Set(msg.str());
+        return false;
+      }
+      size_ = sizeof header + size;
+    }
+    next_off_ = off_ + size_;
+    loaded_ = false;
+    return true;
+  }
+
+  std::array<uint8_t, 8> GetMagic() override { return magic_; }
+  int64_t Offset() override { return off_; }
+  int64_t Size() override { return size_; }
+
+  ByteSpan Get() override {
+    if (!loaded_) {
+      buf_.resize(size_);
+      bool eof;
+      if (!PreadFull(fd_, buf_.data(), size_, off_, &eof, &err_)) {
+        if (eof) err_.Set("Unexpected EOF");
+        buf_.clear();
+      }
+      loaded_ = true;
+    }
+    return ByteSpan(&buf_);
+  }
+
+  bool SendTo(int out) override {
+    if (!err_.Ok()) return false;
+    off_t off = off_;
+    int64_t remaining = size_;
+    while (remaining > 0) {
+      const ssize_t n = sendfile(out, fd_, &off,
+                                 std::min<size_t>(remaining, MaxTransferSize));
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        if ((errno == EINVAL || errno == ENOSYS) && remaining == size_) {
+          // sendfile doesn't support this pair of descriptors.
+          const ByteSpan data = Get();
+          return err_.Ok() && WriteFull(out, data.data(), data.size(), &err_);
+        }
+        err_.Set(internal::StrError("sendfile"));
+        return false;
+      }
+      if (n == 0) {
+        err_.Set("sendfile: unexpected EOF");
+        return false;
+      }
+      remaining -= n;
+    }
+    return true;
+  }
+
+  Error GetError() override { return err_.Err(); }
+
+ private:
+  enum class Format { UNKNOWN, V1, V2 };
+
+  // Determine the file format from the magic number of the first block.
+  bool SniffFormat() {
+    Magic magic;
+    bool eof;
+    if (!PreadFull(fd_, magic.data(), magic.size(), off_, &eof, &err_)) {
+      return false;
+    }
+    if (magic == internal::MagicPacked || magic == internal::MagicUnpacked) {
+      format_ = Format::V1;
+    } else {
+      format_ = Format::V2;
+    }
+    return true;
+  }
+
+  const int fd_;
+  ErrorReporter err_;
+  Format format_ = Format::UNKNOWN;
+  Magic magic_ = internal::MagicInvalid;
+  int64_t off_ = 0;       // Offset of the current block.
+  int64_t size_ = 0;      // Size of the current block.
+  int64_t next_off_ = 0;  // Offset of the next block.
+  bool loaded_ = false;   // Whether buf_ holds the current block.
+  std::vector<uint8_t> buf_;
+};
+
+class RawBlockWriterImpl : public RawBlockWriter {
+ public:
+  RawBlockWriterImpl(int fd, std::unique_ptr<WriterIndexer> indexer)
+      : fd_(fd), indexer_(std::move(indexer)) {
+    // Block offsets are relative to the initial position, as in Writer. They
+    // start at zero for pipes and sockets.
+    const off_t off = lseek(fd_, 0, SEEK_CUR);
+    initial_off_ = off < 0 ? 0 : off;
+    off_ = initial_off_;
+  }
+  explicit RawBlockWriterImpl(Error err) : fd_(-1) { err_.Set(err); }
+
+  ~RawBlockWriterImpl() override { Close(); }
+
+  bool Write(ByteSpan block) override {
+    if (!err_.Ok()) return false;
+    if (!WriteFull(fd_, block.data(), block.size(), &err_)) return false;
+    return Index(block.size());
+  }
+
+  bool WriteFrom(int in, int64_t bytes) override {
+    if (!err_.Ok()) return false;
+    struct stat st;
+    if (fstat(in, &st) < 0) {
+      err_.Set(internal::StrError("fstat"));
+      return false;
+    }
+    if (S_ISFIFO(st.st_mode)) {
+      if (!Splice(in, fd_, bytes)) return false;
+    } else {
+      // splice needs a pipe on one side, so go through an internal pipe.
+      if (pipe_[0] < 0 && pipe2(pipe_, O_CLOEXEC) < 0) {
+        err_.Set(internal::StrError("pipe"));
+        return false;
+      }
+      int64_t remaining = bytes;
+      while (remaining > 0) {
+        const ssize_t n = splice(in, nullptr, pipe_[1], nullptr,
+                                 std::min<int64_t>(remaining, 1 << 16),
+                                 SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+          err_.Set(n == 0 ? "splice: unexpected EOF"
+                          : internal::StrError("splice"));
+          return false;
+        }
+        if (!Splice(pipe_[0], fd_, n)) return false;
+        remaining -= n;
+      }
+    }
+    return Index(bytes);
+  }
+
+  bool Close() override {
+    for (int& fd : pipe_) {
+      if (fd >= 0) close(fd);
+      fd = -1;
+    }
+    if (fd_ >= 0) {
+      if (close(fd_) < 0) err_.Set(internal::StrError("close"));
+      fd_ = -1;
+    }
+    return err_.Ok();
+  }
+
+  Error GetError() override { return err_.Err(); }
+
+ private:
+  // Move exactly "bytes" bytes from "in" to "out". One of them must be a pipe.
+  bool Splice(int in, int out, int64_t bytes) {
+    while (bytes > 0) {
+      const ssize_t n =
+          splice(in, nullptr, out, nullptr,
+                 std::min<int64_t>(bytes, MaxTransferSize), SPLICE_F_MOVE);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        err_.Set(n == 0 ? "splice: unexpected EOF"
+                        : internal::StrError("splice"));
+        return false;
+      }
+      bytes -= n;
+    }
+    return true;
+  }
+
+  // Record that a block of "bytes" bytes has been written.
+  bool Index(int64_t bytes) {
+    const int64_t start = off_ - initial_off_;
+    off_ += bytes;
+    if (indexer_ != nullptr) {
+      const Error error = indexer_->IndexBlock(start);
+      if (!error.empty()) {
+        err_.Set("Indexer error: " + error);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int fd_;
+  const std::unique_ptr<WriterIndexer> indexer_;
+  ErrorReporter err_;
+  int64_t initial_off_ = 0;
+  int64_t off_ = 0;
+  int pipe_[2] = {-1, -1};
+};
+
+}  // namespace
+
+std::unique_ptr<RawBlockReader> NewRawBlockReaderFromDescriptor(int fd) {
+  const off_t off = lseek(fd, 0, SEEK_CUR);
+  if (off < 0) {
+    close(fd);
+    return std::unique_ptr<RawBlockReader>(
+        new RawBlockReaderImpl(internal::StrError("lseek")));
+  }
+  return std::unique_ptr<RawBlockReader>(new RawBlockReaderImpl(fd, off));
+}
+
+std::unique_ptr<RawBlockReader> NewRawBlockReader(const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return std::unique_ptr<RawBlockReader>(
+        new RawBlockReaderImpl(internal::StrError("open " + path)));
+  }
+  return NewRawBlockReaderFromDescriptor(fd);
+}
+
+std::unique_ptr<RawBlockWriter> NewRawBlockWriterFromDescriptor(
+    int fd, std::unique_ptr<WriterIndexer> indexer) {
+  return std::unique_ptr<RawBlockWriter>(
+      new RawBlockWriterImpl(fd, std::move(indexer)));
+}
+
+std::unique_ptr<RawBlockWriter> NewRawBlockWriter(
+    const std::string& path, std::unique_ptr<WriterIndexer> indexer) {
+  const int fd =
+      open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    return std::unique_ptr<RawBlockWriter>(
+        new RawBlockWriterImpl(internal::StrError("open " + path)));
+  }
+  return NewRawBlockWriterFromDescriptor(fd, std::move(indexer));
+}
+
+}  // namespace recordio
+}  // namespace grail
@@ -1,15 +1,23 @@
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <fstream>
 #include <memory>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include "./portable_endian.h"
+#include "./block.h"
+#include "./block_cache.h"
 #include "./chunk.h"
 #include "./header.h"
+#include "./index.h"
+#include "./prefetch.h"
 #include "./recordio.h"
 
 namespace grail {
@@ -27,9 +35,11 @@ ReaderOpts DefaultReaderOpts(const std::string& path) {
 
 namespace internal {
 std::unique_ptr<Reader> NewLegacyPackedReader(
-    std::unique_ptr<ReadSeeker> in, std::unique_ptr<Transformer> transformer);
+    std::unique_ptr<ReadSeeker> in, std::unique_ptr<Transformer> transformer,
+    uint64_t max_record_size);
 std::unique_ptr<Reader> NewLegacyUnpackedReader(
-    std::unique_ptr<ReadSeeker> in, std::unique_ptr<Transformer> transformer);
+    std::unique_ptr<ReadSeeker> in, std::unique_ptr<Transformer> transformer,
+    uint64_t max_record_size);
 
 namespace {
 class ErrorReaderImpl : public Reader {
@@ -37,8 +47,20 @@ class ErrorReaderImpl : public Reader {
   explicit ErrorReaderImpl(std::string err) : err_(std::move(err)) {}
   bool Scan() override { return false; }
   void Seek(ItemLocation loc) override {}
+  void Reset(std::unique_ptr<ReadSeeker> in) override {}
+  Stats GetStats() override { return Stats(); }
+  bool Lookup(const std::string& key) override { return false; }
+  bool Gather(const std::vector<ItemLocation>& locs,
+              const std::function<void(size_t, ByteSpan)>& callback) override {
+    return false;
+  }
   std::vector<uint8_t>* Mutable() override { return nullptr; }
   ByteSpan Get() override { return ByteSpan{nullptr, 0}; }
+  ByteSpan GetFixedItems(size_t* item_size) override {
+    *item_size = 0;
+    return ByteSpan{nullptr, 0};
+  }
+  void GetItems(std::vector<ByteSpan>* items) override { items->clear(); }
   Error GetError() override { return err_; }
   std::vector<HeaderEntry> Header() override {
     return std::vector<HeaderEntry>();
@@ -49,60 +71,75 @@ class ErrorReaderImpl : public Reader {
   Error err_;
 };
 
-int ParseChunksToItems(const IoVec& raw_iov, Transformer* tr,
-                       std::vector<std::vector<uint8_t>>* buf,
-                       ErrorReporter* err) {
-  IoVec iov = raw_iov;
-  if (tr != nullptr) {
-    err->Set(tr->Transform(raw_iov, &iov));
-    if (!err->Ok()) return 0;
-  }
-  ByteSpan data;
-  std::vector<uint8_t> tmp;
-  if (iov.size() == 0) {
-    return 0;
-  }
-  data = iov[0];
-  if (iov.size() > 1) {
-    // TODO(saito) remove memcpy.
-    tmp = IoVecFlatten(iov);
-    data = ByteSpan(&tmp);
-  }
-  BinaryParser p(data.data(), data.size(), err);
-  uint64_t n = p.ReadUVarint();
-  std::vector<uint64_t> item_sizes;
-  for (size_t i = 0; i < n; i++) {
-    uint64_t size = p.ReadUVarint();
-    item_sizes.push_back(size);
-  }
-  for (size_t i = 0; i < n; i++) {
-    // TODO(saito) remove memcpy.
-    const uint64_t item_size = item_sizes[i];
-    const uint8_t* data = p.ReadBytes(item_size);
-    if (data == nullptr) return 0;
-    if (buf->size() <= i) {
-      buf->resize((i + 1) * 2);
-    }
-    (*buf)[i].resize(item_size);
-    memcpy((*buf)[i].data(), data, item_size);
-  }
-  return n;
-}  // namespace
-
-class ReaderImpl : public Reader {
+class ReaderImpl final : public Reader {
  public:
   ReaderImpl(std::unique_ptr<ReadSeeker> in, ReaderOpts opts)
-      : cr_(new ChunkReader(in.get(), &err_)), in_(std::move(in)) {
+      : cr_(new ChunkReader(in.get(), &err_, opts.huge_pages)),
+        in_(std::move(in)),
+        huge_pages_(opts.huge_pages),
+        decode_threads_(opts.decode_threads),
+        prefetch_blocks_(opts.prefetch_blocks),
+        use_key_range_(opts.use_key_range),
+        min_key_(std::move(opts.min_key)),
+        max_key_(std::move(opts.max_key)),
+        key_extractor_(std::move(opts.key_extractor)) {
+    if (opts.cache != nullptr && !opts.cache_key.empty()) {
+      cache_ = std::static_pointer_cast<BlockCacheImpl>(opts.cache);
+      cache_key_ = opts.cache_key;
+    }
+    const int n_cached = std::max(1, opts.max_cached_blocks);
+    for (int i = 0; i < n_cached; i++) {
+      blocks_.emplace_back(new CachedBlock(huge_pages_));
+    }
+    Init();
+  }
+
+  void Reset(std::unique_ptr<ReadSeeker> in) override {
+    StopPrefetch();
+    in_ = std::move(in);
+    cr_->Reset(in_.get());
+    err_.Clear();
+    cache_.reset();
+    for (auto& b : blocks_) {
+      b->offset = -1;
+      b->shared.reset();
+    }
+    header_.clear();
+    fixed_item_size_ = 0;
+    trailer_.clear();
+    trailer_offset_ = -1;
+    key_stats_.clear();
+    bloom_filters_.clear();
+    sorted_ = false;
+    n_items_ = -1;
+    next_item_ = 0;
+    cur_item_ = 0;
+    Init();
+  }
+
+  // Read the header and the trailer of in_, and position at the first data
+  // block.
+  //
+  // A source that can't seek, such as a pipe, is read as a stream. Its
+  // trailer is skipped, and Seek, Gather and Lookup fail.
+  void Init() {
     readHeader();
     int64_t cur_off;
-    err_.Set(in_->Seek(0, SEEK_CUR, &cur_off));
+    seekable_ = in_->Seek(0, SEEK_CUR, &cur_off) == "";
     bool has_trailer;
     err_.Set(HasTrailer(header_, &has_trailer));
+    err_.Set(GetFixedItemSize(header_, &fixed_item_size_));
     if (!err_.Ok()) return;
 
+    if (!seekable_) {
+      n_items_ = 0;
+      next_item_ = 0;
+      return;
+    }
     if (has_trailer) {
       readTrailer();
     }
+    if (use_key_range_ || key_extractor_) readBlockIndex();
     cr_->Seek(cur_off);
     n_items_ = 0;
     next_item_ = 0;
@@ -111,20 +148,22 @@ class ReaderImpl : public Reader {
   bool Scan() override {
     while (next_item_ >= n_items_) {
       next_item_ = 0;
+      if (prefetch_blocks_ > 0) {
+        if (!ReadPrefetchedBlock()) return false;
+        continue;
+      }
+      if (use_key_range_ && !key_stats_.empty()) SkipBlocksOutsideKeyRange();
       if (!ReadBlock()) {
         return false;
       }
     }
-    item_ = &itembuf_[next_item_];
+    cur_item_ = next_item_;
     next_item_++;
     return true;
   }
 
   void Seek(ItemLocation loc) override {
-    cr_->Seek(loc.block);
-    if (!ReadBlock()) {
-      return;
-    }
+    if (!err_.Ok() || !ReadBlockAt(loc.block)) return;
     if (loc.item < 0 || loc.item >= n_items_) {
       std::ostringstream msg;
       msg << "Invalid location (" << loc.block << "," << loc.item
@@ -135,20 +174,148 @@ class ReaderImpl : public Reader {
     next_item_ = loc.item;
   }
 
-  // TODO(saito) this is unsafe. Change Mutable to return a vector<uint8_t>.
-  std::vector<uint8_t>* Mutable() override { return item_; }
-  ByteSpan Get() override { return ByteSpan{item_->data(), item_->size()}; }
+  bool Lookup(const std::string& key) override {
+    if (!err_.Ok()) return false;
+    if (!seekable_) {
+      err_.Set("Lookup requires a seekable source");
+      return false;
+    }
+    if (!key_extractor_ || (!sorted_ && bloom_filters_.empty())) {
+      err_.Set(
+          "Lookup requires ReaderOpts::key_extractor, and a sorted file or "
+          "Bloom filters");
+      return false;
+    }
+    if (!sorted_) return LookupUnsorted(key);
+    // The first block that may contain "key". Keys are sorted, so so are the
+    // max keys of the blocks.
+    auto it = std::lower_bound(
+        key_stats_.begin(), key_stats_.end(), key,
+        [](const BlockKeyStats& b, const std::string& k) {
+          return b.max_key < k;
+        });
+    if (it == key_stats_.end() || !MayContain(it - key_stats_.begin(), key)) {
+      return false;
+    }
+    if (!ReadBlockAt(it->offset)) return false;
+    const Block& block = *blocks_[0]->get();
+    int lo = 0, hi = n_items_;
+    while (lo < hi) {
+      const int mid = lo + (hi - lo) / 2;
+      if (key_extractor_(block.Item(mid)) < key) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo == n_items_ || key_extractor_(block.Item(lo)) != key) {
+      next_item_ = lo;
+      return false;
+    }
+    cur_item_ = lo;
+    next_item_ = lo + 1;
+    return true;
+  }
+
+  bool Gather(const std::vector<ItemLocation>& locs,
+              const std::function<void(size_t, ByteSpan)>& callback) override {
+    if (!err_.Ok()) return false;
+    StopPrefetch();
+    std::vector<int64_t> offsets;
+    offsets.reserve(locs.size());
+    for (const auto& loc : locs) offsets.push_back(loc.block);
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+
+    // blocks[i] is the decoded block at offsets[i]. Blocks in blocks_ are used
+    // as is, and the rest are read into "raw".
+    std::vector<const Block*> blocks(offsets.size(), nullptr);
+    std::vector<int64_t> missing;
+    for (size_t i = 0; i < offsets.size(); i++) {
+      for (const auto& b : blocks_) {
+        if (b->offset >= 0 && b->offset == offsets[i]) {
+          blocks[i] = b->get();
+          break;
+        }
+      }
+      if (blocks[i] == nullptr) missing.push_back(offsets[i]);
+    }
+    const int64_t pos = cr_->Offset();
+    std::vector<std::unique_ptr<RawBlock>> raw;
+    const bool ok = ReadRawBlocks(missing, &raw);
+    if (pos >= 0) cr_->Seek(pos);
+    if (!ok) return false;
+    DecodeRawBlocks(&raw);
+    if (!err_.Ok()) return false;
+    for (size_t i = 0, j = 0; i < offsets.size(); i++) {
+      if (blocks[i] == nullptr) blocks[i] = &raw[j++]->block;
+    }
+
+    std::vector<const Block*> item_blocks(locs.size());
+    for (size_t i = 0; i < locs.size(); i++) {
+      const ItemLocation& loc = locs[i];
+      const size_t idx =
+          std::lower_bound(offsets.begin(), offsets.end(), loc.block) -
+          offsets.begin();
+      item_blocks[i] = blocks[idx];
+      if (loc.item < 0 || loc.item >= blocks[idx]->size()) {
+        std::ostringstream msg;
+        msg << "Invalid location (" << loc.block << "," << loc.item
+            << "): block has only " << blocks[idx]->size() << " items";
+        err_.Set(msg.str());
+        return false;
+      }
+    }
+    for (size_t i = 0; i < locs.size(); i++) {
+      callback(i, item_blocks[i]->Item(locs[i].item));
+    }
+    return true;
+  }
+
+  std::vector<uint8_t>* Mutable() override {
+    const ByteSpan span = Get();
+    tmp_.resize(span.size());
+    std::copy(span.begin(), span.end(), tmp_.begin());
+    return &tmp_;
+  }
+
+  ByteSpan Get() override { return blocks_[0]->get()->Item(cur_item_); }
+
+  ByteSpan GetFixedItems(size_t* item_size) override {
+    const Block& block = *blocks_[0]->get();
+    *item_size = block.fixed_item_size();
+    if (*item_size == 0) return ByteSpan{nullptr, 0};
+    next_item_ = n_items_;
+    return block.FixedItems(cur_item_);
+  }
+
+  void GetItems(std::vector<ByteSpan>* items) override {
+    const Block& block = *blocks_[0]->get();
+    items->resize(n_items_ - cur_item_);
+    for (int i = cur_item_; i < n_items_; i++) {
+      (*items)[i - cur_item_] = block.Item(i);
+    }
+    next_item_ = n_items_;
+  }
+
   Error GetError() override { return err_.Err(); }
+
+  Stats GetStats() override {
+    Stats stats = stats_;
+    if (prefetcher_ != nullptr) prefetcher_->AddStats(&stats);
+    return stats;
+  }
+
   std::vector<HeaderEntry> Header() override { return header_; }
   ByteSpan Trailer() override { return ByteSpan(&trailer_); }
 
  private:
   void readHeader() {
-    std::vector<uint8_t>* payload;
+    std::vector<uint8_t> payload;
     if (!ReadSpecialBlock(MagicHeader, &payload)) {
       return;
     }
-    header_ = DecodeHeader(payload->data(), payload->size(), &err_);
+    header_ = DecodeHeader(payload.data(), payload.size(), &err_);
     std::vector<std::string> transformers;
     for (const HeaderEntry& e : header_) {
       if (e.key == kKeyTransformer) {
@@ -162,26 +329,281 @@ class ReaderImpl : public Reader {
         }
       }
     }
-    err_.Set(GetUntransformer(transformers, &untransformer_));
+    // After Reset, the untransformer is reused if the file uses the same
+    // transformers.
+    if (untransformer_ == nullptr || transformers != transformer_names_) {
+      err_.Set(GetUntransformer(transformers, &untransformer_));
+      transformer_names_ = transformers;
+    }
   }
 
   void readTrailer() {
     cr_->SeekLastBlock();
-    std::vector<uint8_t>* payload;
-    if (ReadSpecialBlock(MagicTrailer, &payload)) {
-      trailer_ = *payload;
+    trailer_offset_ = cr_->Offset();
+    ReadSpecialBlock(MagicTrailer, &trailer_);
+  }
+
+  // Decode the key statistics from the trailer, if the file has them.
+  void readBlockIndex() {
+    bool has_index;
+    err_.Set(HasBlockIndex(header_, &has_index));
+    err_.Set(IsSorted(header_, &sorted_));
+    if (!err_.Ok() || !has_index || trailer_offset_ < 0) return;
+    BlockIndex index;
+    if (DecodeBlockIndex(ByteSpan(&trailer_), &index, &err_)) {
+      key_stats_ = std::move(index.blocks);
+      bloom_filters_ = std::move(index.bloom_filters);
+    }
+  }
+
+  // Returns false if block key_stats_[i] definitely doesn't contain "key".
+  bool MayContain(size_t i, const std::string& key) const {
+    const BlockKeyStats& b = key_stats_[i];
+    if (key < b.min_key || key > b.max_key) return false;
+    return bloom_filters_.empty() ||
+           BloomFilterMayContain(bloom_filters_[i], key);
+  }
+
+  // Lookup in a file whose blocks are not sorted by key. Scans the blocks
+  // that may contain the key, in file order.
+  bool LookupUnsorted(const std::string& key) {
+    for (size_t i = 0; i < key_stats_.size(); i++) {
+      if (!MayContain(i, key)) continue;
+      if (!ReadBlockAt(key_stats_[i].offset)) return false;
+      const Block& block = *blocks_[0]->get();
+      for (int j = 0; j < n_items_; j++) {
+        if (key_extractor_(block.Item(j)) == key) {
+          cur_item_ = j;
+          next_item_ = j + 1;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // Make the block at "offset" the current block.
+  bool ReadBlockAt(int64_t offset) {
+    StopPrefetch();
+    if (UseCachedBlock(offset)) return true;
+    cr_->Seek(offset);
+    return ReadBlock();
+  }
+
+  // If the block at the current position and the ones following it have no
+  // keys in [min_key_, max_key_], seek past them.
+  void SkipBlocksOutsideKeyRange() {
+    const int64_t offset = cr_->Offset();
+    if (offset < 0) return;
+    const int64_t next = NextBlockInKeyRange(offset);
+    if (next != offset) cr_->Seek(next);
+  }
+
+  // Returns the offset of the first block at or after the block at "offset"
+  // that may have keys in [min_key_, max_key_], or of the trailer if there is
+  // none. Returns "offset" if it isn't the offset of a block.
+  int64_t NextBlockInKeyRange(int64_t offset) const {
+    auto it = std::lower_bound(
+        key_stats_.begin(), key_stats_.end(), offset,
+        [](const BlockKeyStats& b, int64_t off) { return b.offset < off; });
+    if (it == key_stats_.end() || it->offset != offset) return offset;
+    while (it != key_stats_.end() &&
+           (it->max_key < min_key_ || it->min_key > max_key_)) {
+      ++it;
+    }
+    return it != key_stats_.end() ? it->offset : trailer_offset_;
+  }
+
+  // Make the next block from prefetcher_ the current block, starting
+  // prefetcher_ if needed.
+  bool ReadPrefetchedBlock() {
+    if (!err_.Ok()) return false;
+    if (prefetcher_ == nullptr) {
+      std::function<int64_t(int64_t)> skip;
+      if (use_key_range_ && !key_stats_.empty()) {
+        skip = [this](int64_t offset) { return NextBlockInKeyRange(offset); };
+      }
+      int n_threads = decode_threads_;
+      if (n_threads <= 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+      }
+      prefetcher_.reset(new Prefetcher(
+          in_.get(), cr_->Offset(), transformer_names_, fixed_item_size_,
+          prefetch_blocks_, n_threads, huge_pages_, skip));
+    }
+    int64_t offset, next_offset;
+    std::shared_ptr<Block> block =
+        prefetcher_->Next(&offset, &next_offset, &err_);
+    if (block == nullptr) return false;
+    std::rotate(blocks_.begin(), blocks_.end() - 1, blocks_.end());
+    CachedBlock* b = blocks_[0].get();
+    b->offset = offset;
+    b->next_offset = next_offset;
+    b->shared = block;
+    if (cache_ != nullptr && offset >= 0) {
+      cache_->Insert(cache_key_, offset, next_offset, block);
+    }
+    n_items_ = block->size();
+    next_item_ = 0;
+    return true;
+  }
+
+  // Stop prefetcher_, and position cr_ at the first block it hasn't
+  // returned.
+  void StopPrefetch() {
+    if (prefetcher_ == nullptr) return;
+    const int64_t offset = prefetcher_->NextOffset();
+    prefetcher_->AddStats(&stats_);
+    prefetcher_.reset();
+    // prefetcher_ moved the file position behind cr_'s back.
+    cr_->Reset(in_.get());
+    if (offset >= 0) cr_->Seek(offset);
+  }
+
+  // If the block at "offset" is in blocks_, make it the current block and
+  // return true.
+  bool UseCachedBlock(int64_t offset) {
+    for (size_t i = 0; i < blocks_.size(); i++) {
+      CachedBlock* b = blocks_[i].get();
+      if (b->offset < 0 || b->offset != offset) continue;
+      std::rotate(blocks_.begin(), blocks_.begin() + i,
+                  blocks_.begin() + i + 1);
+      // Position the chunk reader so that Scan continues after this block.
+      cr_->Seek(b->next_offset);
+      n_items_ = b->get()->size();
+      next_item_ = 0;
+      return err_.Ok();
+    }
+    return false;
+  }
+
+  // A block read by Gather, before and after decoding.
+  struct RawBlock {
+    explicit RawBlock(bool huge_pages) : block(huge_pages) {}
+    std::shared_ptr<std::vector<uint8_t>> buf;  // Chunks read from the file.
+    std::vector<ByteSpan> payloads;             // Chunk payloads in buf.
+    Block block;
+  };
+
+  // Read the packed blocks at the given sorted offsets. Blocks that are close
+  // to each other are read together with one read call.
+  bool ReadRawBlocks(const std::vector<int64_t>& offsets,
+                     std::vector<std::unique_ptr<RawBlock>>* raw) {
+    // Reading the unrequested blocks in a gap this large is cheaper than
+    // issuing another read.
+    constexpr int64_t kMaxGap = 1 << 20;
+    // Start a new read once this many bytes are covered, so that a long run of
+    // nearby blocks doesn't need one huge buffer. The last block of a read
+    // may extend past the limit.
+    constexpr int64_t kMaxReadBytes = 64 << 20;
+    for (size_t i = 0; i < offsets.size();) {
+      size_t j = i;
+      while (j + 1 < offsets.size() &&
+             offsets[j + 1] - offsets[j] <= kMaxGap &&
+             offsets[j + 1] - offsets[i] < kMaxReadBytes) {
+        j++;
+      }
+      // Read [offsets[i], end of the block at offsets[j]). The length of the
+      // last block is known only after reading its first chunk.
+      const int64_t start = offsets[i];
+      auto buf = std::make_shared<std::vector<uint8_t>>(offsets[j] - start +
+                                                        ChunkSize);
+      if (!cr_->ReadAt(start, buf->data(), buf->size())) return false;
+      Magic magic;
+      uint32_t index, total;
+      ChunkFlag flag;
+      ByteSpan payload;
+      if (!ParseChunk(buf->data() + (offsets[j] - start), &magic, &index,
+                      &total, &flag, &payload, &err_)) {
+        return false;
+      }
+      if (total > 1) {
+        const size_t n = buf->size();
+        buf->resize(n + static_cast<size_t>(total - 1) * ChunkSize);
+        if (!cr_->ReadAt(start + n, buf->data() + n, buf->size() - n)) {
+          return false;
+        }
+      }
+      for (; i <= j; i++) {
+        std::unique_ptr<RawBlock> b(new RawBlock(huge_pages_));
+        b->buf = buf;
+        const size_t off = offsets[i] - start;
+        size_t size;
+        if (!ParseBlock(ByteSpan(buf->data() + off, buf->size() - off), &magic,
+                        &b->payloads, &size, &err_)) {
+          return false;
+        }
+        if (magic != MagicPacked) {
+          std::ostringstream msg;
+          msg << "Bad magic at offset " << offsets[i] << ": "
+              << MagicDebugString(magic);
+          err_.Set(msg.str());
+          return false;
+        }
+        raw->push_back(std::move(b));
+      }
     }
+    return true;
+  }
+
+  // Untransform and parse the blocks, in parallel.
+  void DecodeRawBlocks(std::vector<std::unique_ptr<RawBlock>>* raw) {
+    int n_threads = decode_threads_;
+    if (n_threads <= 0) {
+      n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    n_threads = std::min<int>(n_threads, raw->size());
+    std::atomic<size_t> next(0);
+    std::vector<std::unique_ptr<ErrorReporter>> errs;
+    auto decode = [this, raw, &next](Transformer* tr, ErrorReporter* err) {
+      for (size_t i = next++; i < raw->size() && err->Ok(); i = next++) {
+        RawBlock* b = (*raw)[i].get();
+        b->block.Parse(IoVec(&b->payloads), tr, fixed_item_size_, err);
+        b->buf.reset();
+      }
+    };
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<Transformer>> trs(n_threads);
+    for (int t = 1; t < n_threads; t++) {
+      errs.emplace_back(new ErrorReporter);
+      errs.back()->Set(GetUntransformer(transformer_names_, &trs[t]));
+      threads.emplace_back(decode, trs[t].get(), errs.back().get());
+    }
+    decode(untransformer_.get(), &err_);
+    for (auto& t : threads) t.join();
+    for (const auto& e : errs) err_.Set(e->Err());
   }
 
   bool ReadBlock() {
     if (!err_.Ok()) return false;
+    if (cache_ != nullptr && UseBlockCache()) return true;
     if (!cr_->Scan()) return false;
     const Magic magic = cr_->GetMagic();
 
     if (magic == MagicPacked) {
-      n_items_ = ParseChunksToItems(cr_->Chunks(), untransformer_.get(),
-                                    &itembuf_, &err_);
-      if (!err_.Ok()) return false;
+      n_items_ = 0;
+      // Decode into the least recently used slot, and make it the current
+      // block. With a block cache, decode into a new block that the cache
+      // can share.
+      std::rotate(blocks_.begin(), blocks_.end() - 1, blocks_.end());
+      CachedBlock* b = blocks_[0].get();
+      b->offset = -1;
+      b->shared.reset();
+      std::shared_ptr<Block> shared;
+      if (cache_ != nullptr) shared = std::make_shared<Block>(huge_pages_);
+      Block* block = shared != nullptr ? shared.get() : &b->block;
+      if (!block->Parse(cr_->Chunks(), untransformer_.get(), fixed_item_size_,
+                        &err_)) {
+        return false;
+      }
+      b->shared = shared;
+      b->offset = cr_->BlockOffset();
+      b->next_offset = cr_->Offset();
+      if (b->next_offset < 0) b->offset = -1;
+      if (shared != nullptr && b->offset >= 0) {
+        cache_->Insert(cache_key_, b->offset, b->next_offset, shared);
+      }
+      n_items_ = block->size();
       next_item_ = 0;
       return true;
     }
@@ -194,8 +616,30 @@ class ReaderImpl : public Reader {
     return false;
   }
 
+  // If the block at the current position is in cache_, make it the current
+  // block and return true.
+  bool UseBlockCache() {
+    const int64_t offset = cr_->Offset();
+    if (offset < 0) return false;
+    int64_t next_offset;
+    std::shared_ptr<const Block> block =
+        cache_->Lookup(cache_key_, offset, &next_offset);
+    if (block == nullptr) return false;
+    std::rotate(blocks_.begin(), blocks_.end() - 1, blocks_.end());
+    CachedBlock* b = blocks_[0].get();
+    b->offset = offset;
+    b->next_offset = next_offset;
+    b->shared = std::move(block);
+    cr_->Seek(next_offset);
+    n_items_ = b->shared->size();
+    next_item_ = 0;
+    return err_.Ok();
+  }
+
+  // Read a header or a trailer block. It always has an item-size table, and
+  // exactly one item, which is copied into *payload.
   bool ReadSpecialBlock(const Magic expected_magic,
-                        std::vector<uint8_t>** payload) {
+                        std::vector<uint8_t>* payload) {
     if (!cr_->Scan()) {
       err_.Set("Failed to read trailer block");
       return false;
@@ -207,14 +651,20 @@ class ReaderImpl : public Reader {
       err_.Set(msg.str());
       return false;
     }
-    n_items_ = ParseChunksToItems(cr_->Chunks(), untransformer_.get(),
-                                  &itembuf_, &err_);
-    if (!err_.Ok()) return false;
-    if (n_items_ != 1) {
+    n_items_ = 0;
+    // The header block is never transformed.
+    Transformer* tr =
+        expected_magic == MagicHeader ? nullptr : untransformer_.get();
+    Block block;
+    if (!block.Parse(cr_->Chunks(), tr, 0, &err_)) {
+      return false;
+    }
+    if (block.size() != 1) {
       err_.Set("Wrong # of items in header block");
       return false;
     }
-    *payload = &itembuf_[0];
+    const ByteSpan item = block.Item(0);
+    payload->assign(item.begin(), item.end());
     return true;
   }
 
@@ -223,38 +673,108 @@ class ReaderImpl : public Reader {
   std::unique_ptr<ChunkReader> cr_;
   std::unique_ptr<ReadSeeker> in_;
   int next_item_ = 0;
-  std::vector<uint8_t>* item_ = nullptr;
+  int cur_item_ = 0;
 
-  std::vector<std::vector<uint8_t>> itembuf_;
+  struct CachedBlock {
+    explicit CachedBlock(bool huge_pages) : block(huge_pages) {}
+    int64_t offset = -1;       // File offset of the block. -1 if invalid.
+    int64_t next_offset = -1;  // File offset of the following block.
+    Block block;
+    std::shared_ptr<const Block> shared;  // Overrides block if non-null.
+    const Block* get() const {
+      return shared != nullptr ? shared.get() : &block;
+    }
+  };
+  // Recently decoded blocks, most recently used first. blocks_[0] is the
+  // current block.
+  std::vector<std::unique_ptr<CachedBlock>> blocks_;
   int n_items_ = -1;
+  std::vector<uint8_t> tmp_;  // For implementing Mutable().
   std::vector<HeaderEntry> header_;
+  uint64_t fixed_item_size_ = 0;
   std::vector<uint8_t> trailer_;
+  int64_t trailer_offset_ = -1;  // File offset of the trailer. -1 if none.
   std::unique_ptr<Transformer> untransformer_;
+  std::vector<std::string> transformer_names_;
+  const bool huge_pages_;
+  const int decode_threads_;
+  const int prefetch_blocks_;
+  // Reads ahead for Scan. Null unless prefetch_blocks_ > 0 and Scan has been
+  // called since the last Seek, Gather, Lookup or Reset.
+  std::unique_ptr<Prefetcher> prefetcher_;
+  Stats stats_;  // Statistics of the prefetchers stopped so far.
+  std::shared_ptr<BlockCacheImpl> cache_;  // May be null.
+  std::string cache_key_;
+
+  const bool use_key_range_;
+  const std::string min_key_;
+  const std::string max_key_;
+  const std::function<std::string(ByteSpan item)> key_extractor_;
+  // Key statistics of the data blocks, sorted by offset. Empty unless
+  // use_key_range_ or key_extractor_ is set, and the file has them.
+  std::vector<BlockKeyStats> key_stats_;
+  std::vector<std::string> bloom_filters_;  // Indexed as key_stats_.
+  bool sorted_ = false;  // The file has {"sorted", true}.
+  bool seekable_ = true;  // False if in_ is read as a stream.
+};
+
+// ReadSeeker that returns "data" and then the rest of "in". It can't seek.
+// NewReader uses it to put back the magic number read from a non-seekable
+// source.
+class PushbackReadSeeker final : public ReadSeeker {
+ public:
+  PushbackReadSeeker(std::unique_ptr<ReadSeeker> in, ByteSpan data)
+      : in_(std::move(in)), buf_(data.begin(), data.end()) {}
+
+  Error Seek(off_t off, int whence, off_t* new_off) override {
+    *new_off = -1;
+    return "Seek is not supported on a non-seekable source";
+  }
+
+  Error Read(uint8_t* buf, size_t bytes, ssize_t* bytes_read) override {
+    if (pos_ < buf_.size()) {
+      const size_t n = std::min(bytes, buf_.size() - pos_);
+      memcpy(buf, buf_.data() + pos_, n);
+      pos_ += n;
+      *bytes_read = n;
+      return "";
+    }
+    return in_->Read(buf, bytes, bytes_read);
+  }
+
+ private:
+  const std::unique_ptr<ReadSeeker> in_;
+  const std::vector<uint8_t> buf_;
+  size_t pos_ = 0;  // Bytes of buf_ already returned.
 };
 
 std::unique_ptr<Reader> NewReader(std::unique_ptr<ReadSeeker> in,
                                   ReaderOpts opts) {
   int64_t cur_off;
-  internal::Error err = in->Seek(0, SEEK_CUR, &cur_off);
-  if (err != "") {
-    return std::unique_ptr<Reader>(new ErrorReaderImpl(err));
-  }
+  const bool seekable = in->Seek(0, SEEK_CUR, &cur_off) == "";
   Magic magic;
-  err = ReadFull(in.get(), magic.data(), magic.size());
+  internal::Error err = ReadFull(in.get(), magic.data(), magic.size());
   if (err != "") {
     return std::unique_ptr<Reader>(new ErrorReaderImpl(err));
   }
-  err = AbsSeek(in.get(), cur_off);
+  if (seekable) {
+    err = AbsSeek(in.get(), cur_off);
+  } else {
+    in.reset(new PushbackReadSeeker(std::move(in),
+                                    ByteSpan(magic.data(), magic.size())));
+  }
   if (err != "") {
     return std::unique_ptr<Reader>(new ErrorReaderImpl(err));
   }
   if (magic == MagicPacked) {
     return NewLegacyPackedReader(std::move(in),
-                                 std::move(opts.legacy_transformer));
+                                 std::move(opts.legacy_transformer),
+                                 opts.max_read_record_size);
   }
   if (magic == MagicUnpacked) {
     return internal::NewLegacyUnpackedReader(
-        std::move(in), std::move(opts.legacy_transformer));
+        std::move(in), std::move(opts.legacy_transformer),
+        opts.max_read_record_size);
   }
   return std::unique_ptr<Reader>(
       new ReaderImpl(std::move(in), std::move(opts)));
@@ -306,6 +826,86 @@ class ReadSeekerAdapter : public ReadSeeker {
   const Error err_;
 };
 
+// See MmapReadSeeker.
+constexpr size_t MmapSequentialBytes = 1 << 20;
+constexpr size_t MmapWindowBytes = 16 << 20;
+
+// ReadSeeker that reads from a memory-mapped file.
+//
+// Once the reads have been sequential for MmapSequentialBytes, the rest of the
+// file is advised MADV_SEQUENTIAL, and the next MmapWindowBytes ahead of the
+// reads are kept advised MADV_WILLNEED, so that the kernel reads them in the
+// background. A Seek elsewhere reverts the file to MADV_NORMAL, so that
+// point lookups don't read ahead.
+class MmapReadSeeker final : public ReadSeeker {
+ public:
+  MmapReadSeeker(int fd, const uint8_t* data, size_t size)
+      : fd_(fd), data_(data), size_(size) {}
+
+  ~MmapReadSeeker() override {
+    munmap(const_cast<uint8_t*>(data_), size_);
+    close(fd_);
+  }
+
+  Error Seek(off_t off, int whence, off_t* new_off) override {
+    off_t pos = off;
+    if (whence == SEEK_CUR) pos += static_cast<off_t>(pos_);
+    if (whence == SEEK_END) pos += static_cast<off_t>(size_);
+    if (pos < 0) {
+      *new_off = -1;
+      std::ostringstream msg;
+      msg << "lseek " << off << ": " << std::strerror(EINVAL);
+      return msg.str();
+    }
+    if (static_cast<size_t>(pos) != pos_) {
+      if (sequential_) Advise(run_start_, size_, MADV_NORMAL);
+      sequential_ = false;
+      run_start_ = pos;
+      advised_end_ = pos;
+    }
+    pos_ = pos;
+    *new_off = pos;
+    return "";
+  }
+
+  Error Read(uint8_t* buf, size_t bytes, ssize_t* bytes_read) override {
+    const size_t n =
+        pos_ >= size_ ? 0 : std::min<size_t>(bytes, size_ - pos_);
+    std::memcpy(buf, data_ + pos_, n);
+    pos_ += n;
+    *bytes_read = n;
+    if (!sequential_ && pos_ - run_start_ >= MmapSequentialBytes) {
+      Advise(run_start_, size_, MADV_SEQUENTIAL);
+      sequential_ = true;
+    }
+    if (sequential_ && advised_end_ < size_ &&
+        pos_ + MmapWindowBytes / 2 > advised_end_) {
+      const size_t end = std::min(size_, pos_ + MmapWindowBytes);
+      Advise(std::max(pos_, advised_end_), end, MADV_WILLNEED);
+      advised_end_ = end;
+    }
+    return "";
+  }
+
+ private:
+  // madvise [start, end) of the file. madvise needs a page-aligned address,
+  // so start is rounded down.
+  void Advise(size_t start, size_t end, int advice) {
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    start -= start % page;
+    if (start >= end) return;
+    madvise(const_cast<uint8_t*>(data_) + start, end - start, advice);
+  }
+
+  const int fd_;
+  const uint8_t* const data_;
+  const size_t size_;
+  size_t pos_ = 0;
+  size_t run_start_ = 0;  // Start of the current run of sequential reads.
+  bool sequential_ = false;  // The run is advised MADV_SEQUENTIAL.
+  size_t advised_end_ = 0;   // End of the range advised MADV_WILLNEED.
+};
+
 }  // namespace
 }  // namespace internal
 
@@ -320,7 +920,10 @@ std::unique_ptr<ReadSeeker> NewReadSeekerFromDescriptor(int fd) {
 }
 
 std::unique_ptr<Reader> NewReader(const std::string& path) {
-  auto opts = DefaultReaderOpts(path);
+  return NewReader(path, DefaultReaderOpts(path));
+}
+
+std::unique_ptr<Reader> NewReader(const std::string& path, ReaderOpts opts) {
   int fd = open(path.c_str(), O_RDONLY);
   if (fd < 0) {
     std::ostringstream msg;
@@ -328,6 +931,23 @@ std::unique_ptr<Reader> NewReader(const std::string& path) {
     std::unique_ptr<ReadSeeker> r(new internal::ReadSeekerAdapter(msg.str()));
     return internal::NewReader(std::move(r), std::move(opts));
   }
+  struct stat st;
+  if (opts.cache != nullptr && opts.cache_key.empty() && fstat(fd, &st) == 0) {
+    // Include the inode and the modification time, so that a rewritten file
+    // doesn't hit stale blocks.
+    std::ostringstream key;
+    key << path << ":" << st.st_dev << ":" << st.st_ino << ":" << st.st_size
+        << ":" << st.st_mtim.tv_sec << "." << st.st_mtim.tv_nsec;
+    opts.cache_key = key.str();
+  }
+  if (opts.mmap && fstat(fd, &st) == 0 && st.st_size > 0) {
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data != MAP_FAILED) {
+      std::unique_ptr<ReadSeeker> in(new internal::MmapReadSeeker(
+          fd, static_cast<const uint8_t*>(data), st.st_size));
+      return internal::NewReader(std::move(in), std::move(opts));
+    }
+  }
   return internal::NewReader(NewReadSeekerFromDescriptor(fd), std::move(opts));
 }
 
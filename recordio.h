@@ -7,7 +7,10 @@
 //
 // The C++ reader handles the old and the new file formats.
 //
-// The writer supports only the old file format as of 2018-02.
+// The writer supports the old file format, and the new file format when
+// WriterOpts::v2 is set.
+#include <array>
+#include <chrono>
 #include <cstdint>
 #include <functional>
 #include <memory>
@@ -64,6 +67,31 @@ class Reader {
   // writes.
   virtual void Seek(ItemLocation loc) = 0;
 
+  // Read the items at the given locations, and call callback(i, item) for
+  // each locs[i], in order of i. The item is owned by the reader and is valid
+  // only during the callback. Each block is read and decoded once, adjacent
+  // blocks are read together, and blocks are decoded in parallel (see
+  // ReaderOpts::decode_threads). Gather does not change the position of
+  // Scan(). Returns false on error; check GetError().
+  //
+  // REQUIRES: every location must be one of the values passed to the Index
+  // callback during writes.
+  virtual bool Gather(
+      const std::vector<ItemLocation>& locs,
+      const std::function<void(size_t index, ByteSpan item)>& callback) = 0;
+
+  // Find the first record whose key equals "key". The keys are extracted by
+  // ReaderOpts::key_extractor. In a file written with WriterOpts::sorted,
+  // Lookup reads at most one block, found by a binary search over the block
+  // index, and binary-searches the records in it. In an unsorted file written
+  // with WriterOpts::bloom_bits_per_key, it scans only the blocks whose key
+  // range and Bloom filter admit the key. Blocks whose filters rule out the
+  // key are never read. On success, it returns true and the record becomes
+  // the current one, so Get() returns it and Scan() continues with the
+  // records that follow. Returns false if the key is absent or on error;
+  // check GetError() to distinguish the two.
+  virtual bool Lookup(const std::string& key) = 0;
+
   // Get the current record. The caller may take ownership of the data by
   // swapping the contents. The record is invalidated on the next call to Scan
   // or the destructor.
@@ -71,6 +99,26 @@ class Reader {
   // REQUIRES: The last call to Scan() returned true.
   virtual std::vector<uint8_t>* Mutable() = 0;
 
+  // Fast path for files written with WriterOpts::fixed_item_size. Returns the
+  // current record and all the records that follow it in the same block as
+  // one contiguous array, and sets *item_size to the size of each record. The
+  // next Scan() moves to the first record of the following block. The array
+  // is owned by the reader and is invalidated on the next call to Scan or the
+  // destructor. If the file doesn't use fixed-size records, it returns an
+  // empty span and sets *item_size=0.
+  //
+  // REQUIRES: The last call to Scan() returned true.
+  virtual ByteSpan GetFixedItems(size_t* item_size) = 0;
+
+  // Like GetFixedItems, but for any file. Sets *items to the current record
+  // and all the records that follow it in the same block. The next Scan()
+  // moves to the first record of the following block. The spans are owned by
+  // the reader and are invalidated on the next call to Scan or the
+  // destructor. See ForEachItem.
+  //
+  // REQUIRES: The last call to Scan() returned true.
+  virtual void GetItems(std::vector<ByteSpan>* items) = 0;
+
   // Return the header-block contents. It returns an empty array if the header
   // doesn't exist, or on error. Check Error() distinguish the two cases.
   virtual std::vector<HeaderEntry> Header() = 0;
@@ -82,6 +130,29 @@ class Reader {
   // Get any error seen by the reader. It returns "" if there is no error.
   virtual Error GetError() = 0;
 
+  // Start reading "in" from its current position, as if the reader had been
+  // created by NewReader(std::move(in), opts) with the original options. The
+  // previous source is destroyed and any error is cleared. The chunk and
+  // block buffers and the untransformers are reused, which makes reading many
+  // small files much cheaper than creating a reader for each. The block cache
+  // (ReaderOpts::cache) is not used for the new source, since cache_key
+  // identifies the original file. Only V2 readers support Reset, and "in"
+  // must be a V2 file; other readers set an error.
+  virtual void Reset(std::unique_ptr<ReadSeeker> in) = 0;
+
+  // Statistics of Scan with prefetching (ReaderOpts::prefetch_blocks > 0).
+  // The times are in seconds, and accumulate over the life of the reader.
+  struct Stats {
+    int64_t blocks = 0;           // Blocks returned by the prefetcher.
+    int prefetch_depth = 0;       // Current read-ahead depth, in blocks.
+    int decode_threads = 0;       // Current number of decode threads.
+    double io_seconds = 0;        // Reading blocks.
+    double decode_seconds = 0;    // Decoding blocks, summed over threads.
+    double wait_seconds = 0;      // Scan waiting for a block.
+    double consumer_seconds = 0;  // The caller, between blocks.
+  };
+  virtual Stats GetStats() = 0;
+
   Reader() = default;
   Reader(const Reader&) = delete;
   virtual ~Reader() = default;
@@ -94,12 +165,56 @@ class Transformer {
   // this function should return another span. The span contents are owned by
   // this object, and it may be destroyed on the next call to Transform.  On
   // error, this function should set a nonempty *error.
+  //
+  // *out may hold any number of spans, e.g., a frame header, the payload and
+  // a trailing tag, and they may point into "in". The writers write the
+  // spans in order, in place, without concatenating them first.
   virtual Error Transform(IoVec in, IoVec* out) = 0;
   Transformer() = default;
   Transformer(const Transformer&) = delete;
   virtual ~Transformer() = default;
 };
 
+// BlockCache keeps decoded V2 blocks across readers, so that a file scanned
+// repeatedly, e.g., once per iteration of an algorithm, is read and
+// decompressed only once. Blocks are kept in memory up to a budget. The least
+// recently used blocks beyond it are spilled to a local file, from which they
+// are read back without decompression. Blocks that fit in neither are dropped.
+//
+// A cache may be shared by any number of readers, in any threads. Create one
+// with NewBlockCache, and set it in ReaderOpts::cache.
+//
+// This class is thread safe.
+class BlockCache {
+ public:
+  struct Stats {
+    int64_t hits = 0;          // Blocks served from memory.
+    int64_t spill_hits = 0;    // Blocks served from the spill file.
+    int64_t misses = 0;        // Blocks read and decoded by the reader.
+    int64_t memory_bytes = 0;  // Bytes of blocks held in memory.
+    int64_t spill_bytes = 0;   // Bytes written to the spill file.
+  };
+  virtual Stats GetStats() = 0;
+
+  // Returns the first error of the spill file, e.g., if it couldn't be
+  // created, or "" if none. The cache stops spilling after an error, but keeps
+  // working in memory.
+  virtual Error GetError() = 0;
+
+  BlockCache() = default;
+  BlockCache(const BlockCache&) = delete;
+  virtual ~BlockCache() = default;
+};
+
+// Create a BlockCache that holds up to "memory_bytes" of decoded blocks in
+// memory. If "spill_dir" is nonempty, up to "spill_bytes" of blocks evicted
+// from memory are kept in an unlinked temporary file in that directory.
+std::shared_ptr<BlockCache> NewBlockCache(int64_t memory_bytes,
+                                          const std::string& spill_dir = "",
+                                          int64_t spill_bytes = 0);
+
+constexpr uint64_t ReaderDefaultMaxReadRecordSize = 1ULL << 29;
+
 struct ReaderOpts {
   // If non-null, this function is called for every block read. It is called
   // sequentially.
@@ -107,13 +222,77 @@ struct ReaderOpts {
   // TODO(saito) This guarantee allows efficient implementations.  Maybe relax
   // the guarantee of sequential invocation in a future.
   std::unique_ptr<Transformer> legacy_transformer;
+
+  // Max size of a block, in bytes, that the reader accepts. A larger size in
+  // a block header is reported as an error, so that a corrupt header doesn't
+  // cause a huge allocation. Raise it to read files written with a larger
+  // max_packed_bytes. Only for the V1 format.
+  uint64_t max_read_record_size = ReaderDefaultMaxReadRecordSize;
+
+  // Max number of decoded blocks the reader keeps, most recently used first.
+  // Seek() to an item in one of these blocks repositions without any I/O or
+  // decoding. The current block is always kept, so values <= 1 keep just the
+  // current block. Only for the V2 format.
+  int max_cached_blocks = 1;
+
+  // Max number of threads Reader::Gather, and Scan with prefetching, use to
+  // decode blocks. Values <= 0 mean the number of hardware threads.
+  int decode_threads = 0;
+
+  // If prefetch_blocks > 0, Scan reads blocks ahead in a background thread,
+  // and decodes them in parallel. The reader measures the time spent reading,
+  // decoding and in the caller, and adjusts the read-ahead depth, up to
+  // prefetch_blocks, and the number of decode threads, up to decode_threads,
+  // as it goes (see Reader::GetStats). Blocks read ahead are added to "cache",
+  // but Scan doesn't look them up there. Seek, Gather, Lookup and Reset stop
+  // the read-ahead, and the next Scan restarts it. Only for the V2 format.
+  int prefetch_blocks = 0;
+
+  // If non-null, decoded blocks are looked up in and added to this cache.
+  // "cache_key" identifies the file in the cache, and the cache is not used if
+  // it is empty. NewReader(path, opts) sets it from the path and the file
+  // metadata if it is empty. Only for the V2 format.
+  std::shared_ptr<BlockCache> cache;
+  std::string cache_key;
+
+  // If use_key_range=true, the reader skips, without reading them, the blocks
+  // whose keys all fall outside [min_key, max_key] (inclusive, compared
+  // bytewise). It needs the key statistics recorded by
+  // WriterOpts::key_extractor; files without them are read whole. Items are
+  // filtered only at block granularity: the blocks that are read are returned
+  // whole, so the caller must still check the key of every item. Only for the
+  // V2 format.
+  bool use_key_range = false;
+  std::string min_key;
+  std::string max_key;
+
+  // Extracts the key of a record for Reader::Lookup. It must match the
+  // WriterOpts::key_extractor used to write the file. Blocks read by Lookup go
+  // through "cache" and the max_cached_blocks most recent blocks, so repeated
+  // lookups of hot keys cost no I/O.
+  std::function<std::string(ByteSpan item)> key_extractor;
+
+  // If mmap=true, NewReader(path, opts) maps the file into memory and reads
+  // the chunks from the mapping, without a system call per chunk. It falls
+  // back to read(2) if the file can't be mapped. Ignored by
+  // NewReader(ReadSeeker, opts). The kernel is advised to read ahead of
+  // sequential scans of the mapping.
+  bool mmap = false;
+
+  // If huge_pages=true, the chunk buffers and the decoded blocks of 2 MiB or
+  // more are allocated in transparent huge pages, which cuts TLB misses when
+  // scanning large blocks. It has no effect if the kernel doesn't support
+  // transparent huge pages. Only for the V2 format.
+  bool huge_pages = false;
 };
 
 // Create a ReadSeeker object that reads from file "fd".  "fd" will be closed
 // when the readseeker is destroyed.
 std::unique_ptr<ReadSeeker> NewReadSeekerFromDescriptor(int fd);
 
-// Create a new reader that reads from "in".
+// Create a new reader that reads from "in". "in" may be a non-seekable
+// source, such as a pipe or stdin, in which case the file is read as a
+// stream: Trailer() is empty, and Seek, Gather and Lookup fail.
 std::unique_ptr<Reader> NewReader(std::unique_ptr<ReadSeeker> in,
                                   ReaderOpts opts);
 
@@ -122,6 +301,62 @@ std::unique_ptr<Reader> NewReader(std::unique_ptr<ReadSeeker> in,
 // (e.g., nonexistent file) are reported through Reader::Error.
 std::unique_ptr<Reader> NewReader(const std::string& path);
 
+// Create a new reader for the given file with the given options.
+std::unique_ptr<Reader> NewReader(const std::string& path, ReaderOpts opts);
+
+// Call fn(ByteSpan item) for every remaining record of "r", in order. It makes
+// one virtual call per block rather than two per record, and fn is inlined
+// into the per-record loop, so prefer it to Scan() and Get() for files with
+// many tiny records. The span is valid only during the call. Check
+// r->GetError() afterwards.
+template <typename Fn>
+void ForEachItem(Reader* r, Fn&& fn) {
+  std::vector<ByteSpan> items;
+  while (r->Scan()) {
+    r->GetItems(&items);
+    for (const ByteSpan& item : items) fn(item);
+  }
+}
+
+// ShuffleReader reads the records of one or more V2 files in a pseudo-random
+// order, for example to feed one training epoch. The data blocks of all the
+// files are visited in a random permutation. Their records go through a
+// shuffle buffer, and each Scan() picks a random record from it. Upcoming
+// blocks are read and decoded by background threads, so the random block
+// order costs no throughput. The same files, buffer size and seed always
+// produce the same sequence.
+//
+// This class is thread compatible.
+class ShuffleReader {
+ public:
+  // Move to the next record. Returns false after the last record or on error.
+  // Check GetError() to distinguish the two.
+  virtual bool Scan() = 0;
+
+  // Get the current record. The span contents are owned by the reader, and
+  // are invalidated on the next call to Scan or the destructor.
+  //
+  // REQUIRES: The last call to Scan() returned true.
+  virtual ByteSpan Get() = 0;
+
+  // Get any error seen by the reader. It returns "" if there is no error.
+  virtual Error GetError() = 0;
+
+  ShuffleReader() = default;
+  ShuffleReader(const ShuffleReader&) = delete;
+  virtual ~ShuffleReader() = default;
+};
+
+// Create a ShuffleReader for the given files. "buffer_items" is the size of
+// the shuffle buffer; larger values randomize better and use more memory.
+// "prefetch_threads" is the number of threads that read and decode blocks
+// ahead; values <= 0 mean the number of hardware threads. This function always
+// returns a non-null reader. Errors are reported through
+// ShuffleReader::GetError.
+std::unique_ptr<ShuffleReader> NewShuffleReader(
+    const std::vector<std::string>& paths, size_t buffer_items, uint64_t seed,
+    int prefetch_threads = 0);
+
 // Register callbacks to create a transformer and a reverse transformer.  Name
 // is a string such as "flate", "zstd". The transformer_factory should create a
 // closure that takes an iovec and produces another iovec suitable for storing
@@ -161,6 +396,14 @@ class Writer {
   // failure.
   virtual bool Write(ByteSpan in) = 0;
 
+  // Write a new record of exactly "size" bytes. "fill" is called once with a
+  // buffer of "size" bytes, owned by the writer, that it must fill with the
+  // record contents. It returns false on error. This lets callers serialize
+  // directly into the writer's block buffer. The default implementation fills
+  // a temporary buffer and calls Write().
+  virtual bool WriteWith(size_t size,
+                         const std::function<bool(uint8_t* buf)>& fill);
+
   // Close the writer and underlying resources. After Close(), callers must not
   // Write() anymore. Callers may still call Error(). To ensure the last block
   // is written, Close() must be called after the last Write().
@@ -193,9 +436,7 @@ class WriterIndexer {
   virtual ~WriterIndexer();
 };
 
-// Caution: The writer only supports the V1 format.
-//
-// TODO(saito) Support V2.
+// Caution: The writer produces the V1 format unless WriterOpts::v2 is set.
 
 struct WriterOpts {
   // If packed=true, then write the "packed" recordio file as defined in
@@ -220,6 +461,68 @@ struct WriterOpts {
 
   // If non-null, this function is called after every block write.
   std::unique_ptr<WriterIndexer> indexer = nullptr;
+
+  // If v2=true, write the V2 (chunked) file format. V2 files are always
+  // packed, and "packed" is ignored. The V2 writer creates the transformer
+  // from "transformers", so "transformer" must be null.
+  bool v2 = false;
+
+  // Names of the transformers, e.g., {"flate"}, applied to every V2 block.
+  // They are recorded in the header so that the reader can build the
+  // untransformers. Only for v2.
+  std::vector<std::string> transformers;
+
+  // Extra entries written in the header block. Only for v2.
+  std::vector<HeaderEntry> header;
+
+  // If nonzero, every item must be exactly fixed_item_size bytes. The size is
+  // declared in the header, and the blocks omit the per-item size table. Only
+  // for v2.
+  uint64_t fixed_item_size = 0;
+
+  // If direct_io=true, NewWriter(path, opts) writes the file with O_DIRECT,
+  // bypassing the page cache. Use it for files that won't be read back soon
+  // on the same host. It falls back to buffered writes if the filesystem
+  // doesn't support O_DIRECT. Ignored by NewWriter(ostream*, opts).
+  bool direct_io = false;
+
+  // If huge_pages=true and max_packed_bytes is 2 MiB or more, the buffer of
+  // the block being filled is allocated once, in transparent huge pages. Only
+  // for packed and v2 writers.
+  bool huge_pages = false;
+
+  // If nonzero, NewWriter(path, opts) expects the file to grow to about
+  // expected_size bytes, and reserves disk space for it in large contiguous
+  // extents ahead of the writes. Unused space is released on Close. Ignored by
+  // NewWriter(ostream*, opts).
+  int64_t expected_size = 0;
+
+  // If set, the writer calls it on every item to extract the item's key, and
+  // records the min and the max key of each block in the trailer. Readers use
+  // them to skip blocks outside the key range in ReaderOpts. Keys are compared
+  // bytewise, so encode numbers (e.g., timestamps) in big-endian. Only for v2.
+  std::function<std::string(ByteSpan item)> key_extractor;
+
+  // If sorted=true, items must be written in nondecreasing key order, and the
+  // writer fails on an item whose key is smaller than the previous one. The
+  // file is marked as sorted, which enables Reader::Lookup. Requires
+  // key_extractor. Only for v2.
+  bool sorted = false;
+
+  // If positive, the writer also stores a Bloom filter of the keys of each
+  // block in the trailer, using about this many bits per key. Reader::Lookup
+  // skips the blocks whose filters rule out the key, so a miss usually costs
+  // no block read. 10 bits per key gives about 1% false positives. Requires
+  // key_extractor. Only for v2.
+  int bloom_bits_per_key = 0;
+
+  // If chunk_aligned_blocks=true, the V2 writer seals a block early when the
+  // next item would push its transformed size just past a multiple of the
+  // chunk payload size, so that the last chunk of the block isn't mostly
+  // padding. The transformed size is estimated from the compression ratio of
+  // the blocks written so far. max_packed_items and max_packed_bytes remain
+  // upper bounds. Only for v2.
+  bool chunk_aligned_blocks = false;
 };
 
 // Create a new writer that writes to "out". "out" remains owned by the caller,
@@ -231,9 +534,204 @@ std::unique_ptr<Writer> NewWriter(std::ostream* out, WriterOpts opts);
 // (e.g., nonexistent file) are reported through Writer::Error.
 std::unique_ptr<Writer> NewWriter(const std::string& path);
 
+// Create a new writer for the given file with the given options. This
+// function always returns a non-null writer. Errors are reported through
+// Writer::Error.
+std::unique_ptr<Writer> NewWriter(const std::string& path, WriterOpts opts);
+
 // Given a pathname, construct options for parsing the file contents.
 WriterOpts DefaultWriterOpts(const std::string& path);
 
+// Create a writer that spreads its records over a sequence of files. The name
+// of the n'th file (n=0,1,...) is "pattern" with the first "%d" replaced by n.
+// The current file is closed, always at a block boundary, and the next one is
+// started when the items written to it would exceed "max_bytes" (measured
+// before transformation), or when it has been current for "max_age". Zero
+// disables either limit. "opts" creates the options for every file, and
+// NewWriter(path, opts(path)) creates its writer.
+//
+// The next file is opened and preallocated (see WriterOpts::expected_size) in
+// the background before it is needed, and the previous file is closed in the
+// background, so that Write() does not stall at a rollover. Close() waits for
+// all the files to be closed, and removes the unused pre-opened one.
+std::unique_ptr<Writer> NewRotatingWriter(
+    const std::string& pattern, int64_t max_bytes,
+    std::chrono::steady_clock::duration max_age,
+    std::function<WriterOpts(const std::string& path)> opts =
+        DefaultWriterOpts);
+
+// Create a writer that can be used by multiple threads concurrently. Producers
+// copy their records into per-thread staging buffers and return; a background
+// sealer thread passes the staged records to "w", which packs, transforms and
+// writes them. Records written by one thread keep their relative order, but
+// records from different threads are interleaved arbitrarily. "shards" is the
+// number of staging buffers; 0 means one per CPU.
+//
+// Write and WriteWith may be called concurrently. Close must be called once,
+// after all the Write calls have returned.
+std::unique_ptr<Writer> NewConcurrentWriter(std::unique_ptr<Writer> w,
+                                            int shards = 0);
+
+// An output of NewTeeWriter.
+struct TeeSink {
+  // The stream to write to. It remains owned by the caller, and it must
+  // remain live until the writer is closed.
+  std::ostream* out = nullptr;
+  // If non-null, called on the sink's thread after each data block has been
+  // written to "out". The offsets are the same for every sink.
+  std::unique_ptr<WriterIndexer> indexer;
+};
+
+// Create a writer that packs and transforms each block once, and writes the
+// identical bytes to every sink, for example a local file and a replication
+// stream. "opts" are as for NewWriter(out, opts); opts.indexer, if set, is
+// called on the caller's thread.
+//
+// Each sink is written by its own thread from a queue of up to
+// "max_buffered_bytes" of encoded data, so a slow sink stalls Write only when
+// its queue is full. Close flushes every sink. An error on any sink fails the
+// writer.
+std::unique_ptr<Writer> NewTeeWriter(std::vector<TeeSink> sinks,
+                                     WriterOpts opts,
+                                     int64_t max_buffered_bytes = 64 << 20);
+
+// RawBlockReader reads the blocks of a recordio file as they are stored in
+// the file, still framed and transformed, so that they can be forwarded to
+// another file or host without being decoded. A V1 block is the block header
+// (magic, size, crc) followed by the payload. A V2 block is a run of whole
+// chunks. Scan() reads only the framing, and does not verify the V2 chunk
+// checksums; the final reader of the data does.
+//
+// This class is thread compatible.
+class RawBlockReader {
+ public:
+  // Move to the next block. Returns false on EOF or error. Check GetError() to
+  // distinguish the two.
+  virtual bool Scan() = 0;
+
+  // Get the magic number, the file offset, and the size in bytes of the
+  // current block, including the framing.
+  //
+  // REQUIRES: The last call to Scan() returned true.
+  virtual std::array<uint8_t, 8> GetMagic() = 0;
+  virtual int64_t Offset() = 0;
+  virtual int64_t Size() = 0;
+
+  // Read the bytes of the current block. The span contents are owned by the
+  // reader, and are invalidated on the next call to Scan or the destructor.
+  //
+  // REQUIRES: The last call to Scan() returned true.
+  virtual ByteSpan Get() = 0;
+
+  // Copy the bytes of the current block to file descriptor "out", which may
+  // be a file, a pipe or a socket, using sendfile(2). The data does not pass
+  // through user space. Returns false on error.
+  //
+  // REQUIRES: The last call to Scan() returned true.
+  virtual bool SendTo(int out) = 0;
+
+  // Get any error seen by the reader. It returns "" if there is no error.
+  virtual Error GetError() = 0;
+
+  RawBlockReader() = default;
+  RawBlockReader(const RawBlockReader&) = delete;
+  virtual ~RawBlockReader() = default;
+};
+
+// Create a RawBlockReader that reads from file "fd", starting at its current
+// position. "fd" will be closed when the reader is destroyed.
+std::unique_ptr<RawBlockReader> NewRawBlockReaderFromDescriptor(int fd);
+
+// Create a RawBlockReader for the given file. This function always returns a
+// non-null reader. Errors are reported through RawBlockReader::GetError.
+std::unique_ptr<RawBlockReader> NewRawBlockReader(const std::string& path);
+
+// RawBlockWriter appends blocks produced by RawBlockReader to a file
+// descriptor. The caller is responsible for writing the blocks in an order
+// that forms a valid file, e.g., for V2, the header block first and the
+// trailer block last.
+//
+// This class is not thread safe.
+class RawBlockWriter {
+ public:
+  // Append a block, as returned by RawBlockReader::Get. Returns false on
+  // error.
+  virtual bool Write(ByteSpan block) = 0;
+
+  // Append a block of "bytes" bytes read from file descriptor "in", typically
+  // a pipe or a socket fed by RawBlockReader::SendTo. The data is moved with
+  // splice(2), and does not pass through user space. Returns false on error.
+  virtual bool WriteFrom(int in, int64_t bytes) = 0;
+
+  // Close the underlying file descriptor. Returns false on error.
+  virtual bool Close() = 0;
+
+  // Get any error seen by the writer. It returns "" if there is no error.
+  virtual Error GetError() = 0;
+
+  RawBlockWriter() = default;
+  RawBlockWriter(const RawBlockWriter&) = delete;
+  virtual ~RawBlockWriter() = default;
+};
+
+// Create a RawBlockWriter that appends to "fd", which may be a file, a pipe or
+// a socket. "fd" will be closed by Close() or the destructor. If "indexer" is
+// non-null, it is called after every block write, as in WriterOpts::indexer.
+std::unique_ptr<RawBlockWriter> NewRawBlockWriterFromDescriptor(
+    int fd, std::unique_ptr<WriterIndexer> indexer);
+
+// Create a RawBlockWriter for the given file. This function always returns a
+// non-null writer. Errors are reported through RawBlockWriter::GetError.
+std::unique_ptr<RawBlockWriter> NewRawBlockWriter(
+    const std::string& path, std::unique_ptr<WriterIndexer> indexer);
+
+// FileAnalysis describes how a recordio file is laid out, for tuning the
+// writer options. It is filled by AnalyzeFile.
+struct FileAnalysis {
+  // Statistics of one data block.
+  struct Block {
+    int64_t offset;              // File offset of the block.
+    uint64_t file_bytes;         // Bytes in the file, including the framing.
+    uint64_t transformed_bytes;  // Transformed (e.g., compressed) payload.
+    uint64_t raw_bytes;          // Untransformed payload.
+    uint64_t padding_bytes;      // V2 chunk padding. Zero for V1.
+    uint64_t n_items;
+  };
+
+  std::string format;  // "v2", "v1-packed", or "v1-unpacked".
+  uint64_t file_bytes = 0;
+  std::vector<HeaderEntry> header;        // Empty for V1 files.
+  std::vector<std::string> transformers;  // E.g., {"flate"}.
+  std::vector<Block> blocks;              // Data blocks, in file order.
+
+  // Totals over "blocks".
+  uint64_t n_items = 0;
+  uint64_t raw_bytes = 0;
+  uint64_t transformed_bytes = 0;
+  uint64_t padding_bytes = 0;
+
+  // item_sizes[i] is the number of items whose size is in [2^(i-1), 2^i),
+  // and item_sizes[0] is the number of empty items.
+  std::vector<uint64_t> item_sizes;
+
+  // Compressed/raw size ratio of the data when compressed with flate,
+  // measured on the file (if it uses flate) or on a sample of its blocks.
+  double flate_ratio = 1;
+
+  // Suggested writer options for data like this file's. Blocks should be a
+  // whole number of chunks, large enough that the padding is a few percent,
+  // and no larger, to keep random access cheap.
+  int64_t recommended_max_packed_bytes = 0;
+  int64_t recommended_max_packed_items = 0;
+  std::vector<std::string> recommended_transformers;
+  // Set if the file wastes a significant fraction of its space on padding.
+  bool recommend_chunk_aligned_blocks = false;
+};
+
+// Read the file at "path", and fill *analysis. The blocks are read and
+// untransformed, but the items aren't copied out. Returns "" on success.
+Error AnalyzeFile(const std::string& path, FileAnalysis* analysis);
+
 //
 //  Following definitions are deprecated. Don't use in new code.
 //
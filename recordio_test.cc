@@ -3,6 +3,7 @@
 #include <gtest/gtest.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <cerrno>
@@ -10,8 +11,10 @@
 #include <cstring>
 #include <fstream>
 #include <iterator>
+#include <numeric>
 #include <random>
 #include <sstream>
+#include <thread>
 #include <utility>
 
 #include "./internal.h"
@@ -191,6 +194,36 @@ TEST(Recordio, WritePackingOptions) {
   remove(filename.c_str());
 }
 
+TEST(Recordio, MaxReadRecordSize) {
+  std::string filename = TempDir() + "/test.grail-rpk";
+  const std::string item(4096, 'x');
+  {
+    recordio::WriterOpts opts;
+    opts.packed = true;
+    std::ofstream out(filename);
+    auto w = recordio::NewWriter(&out, std::move(opts));
+    ASSERT_TRUE(w->Write(recordio::ByteSpan{
+        reinterpret_cast<const uint8_t*>(item.data()), item.size()}));
+    ASSERT_TRUE(w->Close());
+  }
+  for (uint64_t max_size : {uint64_t(1024), uint64_t(1 << 20)}) {
+    recordio::ReaderOpts opts;
+    opts.max_read_record_size = max_size;
+    auto r = recordio::NewReader(filename, std::move(opts));
+    if (max_size < item.size()) {
+      EXPECT_FALSE(r->Scan());
+      EXPECT_NE(std::string::npos, r->GetError().find("unreasonably large"))
+          << r->GetError();
+    } else {
+      ASSERT_TRUE(r->Scan()) << r->GetError();
+      EXPECT_EQ(item, Str(r.get()));
+      EXPECT_FALSE(r->Scan());
+      EXPECT_EQ("", r->GetError());
+    }
+  }
+  remove(filename.c_str());
+}
+
 class TestIndexer : public recordio::WriterIndexer {
  public:
   // Caller retains ownership of block_offsets.
@@ -241,6 +274,1319 @@ TEST(Recordio, WriteIndex) {
   }
 }
 
+TEST(Recordio, WriteV2) {
+  std::string filename = TempDir() + "/test-v2.grail-rio";
+  std::vector<uint64_t> block_offsets;
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 10;
+    opts.indexer.reset(new TestIndexer(&block_offsets));
+    opts.header.push_back(recordio::HeaderEntry{
+        "strflag",
+        recordio::HeaderValue{recordio::HeaderValue::STRING, false, 0, 0,
+                              "Hello"}});
+    std::ofstream out(filename);
+    auto w = recordio::NewWriter(&out, std::move(opts));
+    WriteContentsAndClose(w.get());
+  }
+  ASSERT_EQ((TestBlockCount + 9) / 10, block_offsets.size());
+  EXPECT_EQ(32768, block_offsets[0]);
+
+  auto r = recordio::NewReader(filename);
+  CheckContents(r.get());
+  auto h = r->Header();
+  ASSERT_EQ(1, h.size());
+  EXPECT_EQ("strflag", h[0].key);
+  EXPECT_EQ("Hello", h[0].value.s);
+  CheckSeek(r.get(), block_offsets[2], 3, TestBlock(23));
+  remove(filename.c_str());
+}
+
+// ReadSeeker that counts Read() calls.
+class CountingReadSeeker : public recordio::ReadSeeker {
+ public:
+  CountingReadSeeker(std::unique_ptr<recordio::ReadSeeker> in, int* reads)
+      : in_(std::move(in)), reads_(reads) {}
+  recordio::Error Seek(off_t offset, int whence, off_t* new_offset) override {
+    return in_->Seek(offset, whence, new_offset);
+  }
+  recordio::Error Read(uint8_t* buf, size_t bytes,
+                       ssize_t* bytes_read) override {
+    (*reads_)++;
+    return in_->Read(buf, bytes, bytes_read);
+  }
+
+ private:
+  std::unique_ptr<recordio::ReadSeeker> in_;
+  int* reads_;
+};
+
+TEST(Recordio, SeekCachedBlocks) {
+  std::string filename = TempDir() + "/test-v2.grail-rio";
+  std::vector<uint64_t> block_offsets;
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 10;
+    opts.transformers.push_back("flate");
+    opts.indexer.reset(new TestIndexer(&block_offsets));
+    std::ofstream out(filename);
+    auto w = recordio::NewWriter(&out, std::move(opts));
+    WriteContentsAndClose(w.get());
+  }
+  int reads = 0;
+  int fd = open(filename.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  recordio::ReaderOpts opts;
+  opts.max_cached_blocks = 2;
+  auto r = recordio::NewReader(
+      std::unique_ptr<recordio::ReadSeeker>(new CountingReadSeeker(
+          recordio::NewReadSeekerFromDescriptor(fd), &reads)),
+      std::move(opts));
+
+  CheckSeek(r.get(), block_offsets[2], 3, TestBlock(23));
+  const int initial_reads = reads;
+  // Seeks within the current block don't read.
+  CheckSeek(r.get(), block_offsets[2], 7, TestBlock(27));
+  CheckSeek(r.get(), block_offsets[2], 0, TestBlock(20));
+  EXPECT_EQ(initial_reads, reads);
+
+  CheckSeek(r.get(), block_offsets[5], 1, TestBlock(51));
+  EXPECT_EQ(initial_reads + 1, reads);
+  // Block 2 is still cached.
+  CheckSeek(r.get(), block_offsets[2], 9, TestBlock(29));
+  EXPECT_EQ(initial_reads + 1, reads);
+  // Scanning past the end of a cached block continues with the next block.
+  ASSERT_TRUE(r->Scan());
+  EXPECT_EQ(TestBlock(30), Str(r.get()));
+  EXPECT_EQ(initial_reads + 2, reads);
+  // Block 5 has been evicted.
+  CheckSeek(r.get(), block_offsets[5], 0, TestBlock(50));
+  EXPECT_EQ(initial_reads + 3, reads);
+  for (int i = 51; i < TestBlockCount; i++) {
+    ASSERT_TRUE(r->Scan());
+    EXPECT_EQ(TestBlock(i), Str(r.get()));
+  }
+  EXPECT_FALSE(r->Scan());
+  EXPECT_EQ("", r->GetError());
+  remove(filename.c_str());
+}
+
+void DoGatherTest(int max_packed_items, int decode_threads) {
+  std::string filename = TempDir() + "/test-v2-gather.grail-rio";
+  std::vector<uint64_t> block_offsets;
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = max_packed_items;
+    opts.transformers.push_back("flate");
+    opts.indexer.reset(new TestIndexer(&block_offsets));
+    std::ofstream out(filename);
+    auto w = recordio::NewWriter(&out, std::move(opts));
+    WriteContentsAndClose(w.get());
+  }
+  recordio::ReaderOpts opts;
+  opts.decode_threads = decode_threads;
+  int fd = open(filename.c_str(), O_RDONLY);
+  ASSERT_GE(fd, 0);
+  auto r = recordio::NewReader(recordio::NewReadSeekerFromDescriptor(fd),
+                               std::move(opts));
+  // Start a scan, to check that Gather doesn't disturb it.
+  ASSERT_TRUE(r->Scan());
+  ASSERT_TRUE(r->Scan());
+  EXPECT_EQ(TestBlock(1), Str(r.get()));
+
+  std::default_random_engine rand;
+  std::vector<recordio::ItemLocation> locs;
+  std::vector<int> expected;
+  for (int i = 0; i < 100; i++) {
+    const int n =
+        std::uniform_int_distribution<int>(0, TestBlockCount - 1)(rand);
+    locs.push_back({static_cast<int64_t>(block_offsets[n / max_packed_items]),
+                    n % max_packed_items});
+    expected.push_back(n);
+  }
+  std::vector<size_t> indexes;
+  ASSERT_TRUE(r->Gather(locs, [&](size_t i, recordio::ByteSpan item) {
+    indexes.push_back(i);
+    EXPECT_EQ(TestBlock(expected[i]),
+              std::string(reinterpret_cast<const char*>(item.data()),
+                          item.size()));
+  })) << r->GetError();
+  ASSERT_EQ(locs.size(), indexes.size());
+  for (size_t i = 0; i < indexes.size(); i++) EXPECT_EQ(i, indexes[i]);
+
+  for (int i = 2; i < TestBlockCount; i++) {
+    ASSERT_TRUE(r->Scan());
+    EXPECT_EQ(TestBlock(i), Str(r.get()));
+  }
+  EXPECT_FALSE(r->Scan());
+  EXPECT_EQ("", r->GetError());
+
+  EXPECT_FALSE(r->Gather({{static_cast<int64_t>(block_offsets[0]), 1000}},
+                         [](size_t, recordio::ByteSpan) { FAIL(); }));
+  EXPECT_THAT(r->GetError(), ::testing::HasSubstr("Invalid location"));
+  remove(filename.c_str());
+}
+
+TEST(Recordio, Gather) {
+  DoGatherTest(5, 0);
+  DoGatherTest(7, 1);
+  DoGatherTest(64, 3);
+}
+
+// Gather a run of adjacent blocks that is too long to read in one call.
+TEST(Recordio, GatherLongRun) {
+  std::string filename = TempDir() + "/test-v2-gather-long.grail-rio";
+  const int n_blocks = 160;
+  std::vector<uint64_t> block_offsets;
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 1;
+    opts.indexer.reset(new TestIndexer(&block_offsets));
+    auto w = recordio::NewWriter(filename, std::move(opts));
+    for (int i = 0; i < n_blocks; i++) {
+      const std::string item(512 << 10, 'a' + i % 26);
+      EXPECT_TRUE(w->Write(recordio::ByteSpan{
+          reinterpret_cast<const uint8_t*>(item.data()), item.size()}));
+    }
+    EXPECT_TRUE(w->Close()) << w->GetError();
+  }
+  ASSERT_EQ(n_blocks, block_offsets.size());
+  ASSERT_GT(block_offsets.back() - block_offsets.front(), 64 << 20);
+
+  std::vector<recordio::ItemLocation> locs;
+  for (int i = 0; i < n_blocks; i++) {
+    locs.push_back({static_cast<int64_t>(block_offsets[i]), 0});
+  }
+  auto r = recordio::NewReader(filename);
+  int n = 0;
+  ASSERT_TRUE(r->Gather(locs, [&](size_t i, recordio::ByteSpan item) {
+    EXPECT_EQ(std::string(512 << 10, 'a' + i % 26),
+              std::string(reinterpret_cast<const char*>(item.data()),
+                          item.size()))
+        << i;
+    n++;
+  })) << r->GetError();
+  EXPECT_EQ(n_blocks, n);
+  remove(filename.c_str());
+}
+
+TEST(Recordio, WriteV2Flate) {
+  std::string filename = TempDir() + "/test-v2.grail-rio";
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 7;
+    opts.transformers.push_back("flate");
+    std::ofstream out(filename);
+    auto w = recordio::NewWriter(&out, std::move(opts));
+    WriteContentsAndClose(w.get());
+  }
+  auto r = recordio::NewReader(filename);
+  CheckContents(r.get());
+  remove(filename.c_str());
+}
+
+// Transformer that frames the block as a 4-byte tag, the untouched input
+// spans, and the little-endian crc32 of the payload, without copying the
+// payload.
+class FrameTransformer : public recordio::Transformer {
+ public:
+  std::string Transform(recordio::IoVec in, recordio::IoVec* out) override {
+    spans_.assign(1, recordio::ByteSpan{Tag(), 4});
+    uint32_t crc = 0;
+    for (size_t i = 0; i < in.size(); i++) {
+      spans_.push_back(in[i]);
+      crc = crc32(crc, in[i].data(), in[i].size());
+    }
+    for (int i = 0; i < 4; i++) crc_[i] = crc >> (8 * i);
+    spans_.push_back(recordio::ByteSpan{crc_, 4});
+    *out = recordio::IoVec(&spans_);
+    return "";
+  }
+
+  static const uint8_t* Tag() {
+    return reinterpret_cast<const uint8_t*>("FRM1");
+  }
+
+ private:
+  std::vector<recordio::ByteSpan> spans_;
+  uint8_t crc_[4];
+};
+
+class UnframeTransformer : public recordio::Transformer {
+ public:
+  std::string Transform(recordio::IoVec in, recordio::IoVec* out) override {
+    buf_ = recordio::internal::IoVecFlatten(in);
+    if (buf_.size() < 8 || memcmp(buf_.data(), FrameTransformer::Tag(), 4)) {
+      return "bad frame";
+    }
+    payload_ = recordio::ByteSpan{buf_.data() + 4, buf_.size() - 8};
+    const uint32_t crc = crc32(0, payload_.data(), payload_.size());
+    for (int i = 0; i < 4; i++) {
+      if (buf_[buf_.size() - 4 + i] != static_cast<uint8_t>(crc >> (8 * i))) {
+        return "bad frame crc";
+      }
+    }
+    *out = recordio::IoVec(&payload_, 1);
+    return "";
+  }
+
+ private:
+  std::vector<uint8_t> buf_;
+  recordio::ByteSpan payload_;
+};
+
+TEST(Recordio, MultiSpanTransformer) {
+  recordio::RegisterTransformer(
+      "test-frame",
+      [](const std::string&, std::unique_ptr<recordio::Transformer>* tr) {
+        tr->reset(new FrameTransformer);
+        return "";
+      },
+      [](const std::string&, std::unique_ptr<recordio::Transformer>* tr) {
+        tr->reset(new UnframeTransformer);
+        return "";
+      });
+  std::string filename = TempDir() + "/test-frame.grail-rio";
+  for (int format = 0; format < 3; format++) {
+    {
+      recordio::WriterOpts opts;
+      if (format == 2) {
+        opts.v2 = true;
+        opts.transformers.push_back("test-frame");
+      } else {
+        opts.packed = format == 1;
+        opts.transformer.reset(new FrameTransformer);
+      }
+      opts.max_packed_items = 5;
+      std::ofstream out(filename);
+      auto w = recordio::NewWriter(&out, std::move(opts));
+      WriteContentsAndClose(w.get());
+    }
+    recordio::ReaderOpts opts;
+    if (format < 2) opts.legacy_transformer.reset(new UnframeTransformer);
+    auto r = recordio::NewReader(filename, std::move(opts));
+    CheckContents(r.get());
+  }
+  remove(filename.c_str());
+}
+
+TEST(Recordio, WriteV2LargeBlock) {
+  // Items that span multiple chunks.
+  std::string filename = TempDir() + "/test-v2.grail-rio";
+  std::vector<std::string> items;
+  std::vector<uint64_t> block_offsets;
+  for (int i = 0; i < 5; i++) {
+    items.push_back(std::string(50000 + i * 1000, 'a' + i));
+  }
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 2;
+    opts.indexer.reset(new TestIndexer(&block_offsets));
+    std::ofstream out(filename);
+    auto w = recordio::NewWriter(&out, std::move(opts));
+    for (const auto& item : items) {
+      ASSERT_TRUE(w->Write(recordio::ByteSpan{
+          reinterpret_cast<const uint8_t*>(item.data()), item.size()}));
+    }
+    ASSERT_TRUE(w->Close());
+  }
+  auto r = recordio::NewReader(filename);
+  for (const auto& item : items) {
+    ASSERT_TRUE(r->Scan()) << r->GetError();
+    EXPECT_EQ(item, Str(r.get()));
+  }
+  EXPECT_FALSE(r->Scan());
+  EXPECT_EQ("", r->GetError());
+
+  std::vector<recordio::ItemLocation> locs;
+  for (int i = 4; i >= 0; i--) {
+    locs.push_back({static_cast<int64_t>(block_offsets[i / 2]), i % 2});
+  }
+  std::vector<std::string> gathered;
+  ASSERT_TRUE(r->Gather(locs, [&gathered](size_t, recordio::ByteSpan item) {
+    gathered.emplace_back(reinterpret_cast<const char*>(item.data()),
+                          item.size());
+  })) << r->GetError();
+  EXPECT_EQ(std::vector<std::string>(items.rbegin(), items.rend()), gathered);
+  remove(filename.c_str());
+}
+
+TEST(Recordio, WriteV2FixedItemSize) {
+  std::string filename = TempDir() + "/test-v2-fixed.grail-rio";
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 50;
+    opts.fixed_item_size = TestRecordSize;
+    opts.transformers.push_back("flate");
+    std::ofstream out(filename);
+    auto w = recordio::NewWriter(&out, std::move(opts));
+    std::string bad = "short";
+    EXPECT_TRUE(w->Write(recordio::ByteSpan{
+        reinterpret_cast<const uint8_t*>(TestBlock(0).data()),
+        TestRecordSize}));
+    EXPECT_FALSE(w->Write(recordio::ByteSpan{
+        reinterpret_cast<const uint8_t*>(bad.data()), bad.size()}));
+    EXPECT_THAT(w->GetError(), ::testing::HasSubstr("fixed item size"));
+  }
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 50;
+    opts.fixed_item_size = TestRecordSize;
+    std::ofstream out(filename);
+    auto w = recordio::NewWriter(&out, std::move(opts));
+    WriteContentsAndClose(w.get());
+  }
+  {
+    auto r = recordio::NewReader(filename);
+    CheckContents(r.get());
+  }
+  {
+    // Read the blocks as strided arrays.
+    auto r = recordio::NewReader(filename);
+    int n = 0;
+    std::vector<int> block_sizes;
+    while (r->Scan()) {
+      size_t item_size;
+      auto items = r->GetFixedItems(&item_size);
+      ASSERT_EQ(TestRecordSize, item_size);
+      ASSERT_EQ(0, items.size() % item_size);
+      block_sizes.push_back(items.size() / item_size);
+      for (size_t off = 0; off < items.size(); off += item_size) {
+        EXPECT_EQ(TestBlock(n),
+                  std::string(reinterpret_cast<const char*>(items.data()) + off,
+                              item_size));
+        n++;
+      }
+    }
+    EXPECT_EQ("", r->GetError());
+    EXPECT_EQ(TestBlockCount, n);
+    EXPECT_EQ(std::vector<int>({50, 50, 28}), block_sizes);
+  }
+  remove(filename.c_str());
+}
+
+TEST(Recordio, WriteDirectIO) {
+  for (const std::string suffix : {"grail-rio", "grail-rpk-gz", "v2"}) {
+    std::string filename = TempDir() + "/test-direct." + suffix;
+    std::string buffered_filename = TempDir() + "/test-buffered." + suffix;
+    for (bool direct_io : {false, true}) {
+      auto opts = recordio::DefaultWriterOpts(filename);
+      opts.v2 = suffix == "v2";
+      opts.max_packed_items = 10;
+      opts.direct_io = direct_io;
+      auto w = recordio::NewWriter(direct_io ? filename : buffered_filename,
+                                   std::move(opts));
+      WriteContentsAndClose(w.get());
+      EXPECT_EQ("", w->GetError());
+    }
+    // The padding of the final O_DIRECT write must be truncated away.
+    EXPECT_EQ(ReadFile(buffered_filename), ReadFile(filename)) << suffix;
+    auto r = recordio::NewReader(filename);
+    CheckContents(r.get());
+    remove(filename.c_str());
+    remove(buffered_filename.c_str());
+  }
+  auto w = recordio::NewWriter(TempDir() + "/nonexistent/test.grail-rio");
+  EXPECT_FALSE(w->Close());
+  EXPECT_THAT(w->GetError(), ::testing::HasSubstr("No such file"));
+}
+
+TEST(Recordio, WritePreallocated) {
+  std::string filename = TempDir() + "/test-prealloc.grail-rpk";
+  for (bool direct_io : {false, true}) {
+    auto opts = recordio::DefaultWriterOpts(filename);
+    opts.max_packed_items = 10;
+    opts.direct_io = direct_io;
+    opts.expected_size = 100 << 20;
+    auto w = recordio::NewWriter(filename, std::move(opts));
+    WriteContentsAndClose(w.get());
+
+    // The space reserved past the end of the data must be released.
+    struct stat st;
+    ASSERT_EQ(0, stat(filename.c_str(), &st));
+    EXPECT_LT(st.st_blocks * 512, 1 << 20);
+    auto r = recordio::NewReader(filename);
+    CheckContents(r.get());
+  }
+  remove(filename.c_str());
+}
+
+TEST(Recordio, RotatingWriter) {
+  const std::string pattern = TempDir() + "/test-rotate-%d.grail-rpk";
+  auto path = [](int index) {
+    return TempDir() + "/test-rotate-" + std::to_string(index) + ".grail-rpk";
+  };
+  {
+    auto w = recordio::NewRotatingWriter(
+        pattern, 12 * TestRecordSize,
+        std::chrono::steady_clock::duration::zero(),
+        [](const std::string& path) {
+          auto opts = recordio::DefaultWriterOpts(path);
+          opts.max_packed_items = 5;
+          return opts;
+        });
+    WriteContentsAndClose(w.get());
+    EXPECT_EQ("", w->GetError());
+  }
+  const int n_files = (TestBlockCount + 11) / 12;
+  int n = 0;
+  for (int i = 0; i < n_files; i++) {
+    auto r = recordio::NewReader(path(i));
+    while (r->Scan()) {
+      EXPECT_EQ(TestBlock(n), Str(r.get()));
+      n++;
+    }
+    EXPECT_EQ("", r->GetError());
+    EXPECT_EQ(std::min(12 * (i + 1), TestBlockCount), n);
+    remove(path(i).c_str());
+  }
+  EXPECT_EQ(TestBlockCount, n);
+  // The pre-opened successor of the last file must be removed.
+  struct stat st;
+  EXPECT_NE(0, stat(path(n_files).c_str(), &st));
+
+  {
+    auto w = recordio::NewRotatingWriter(pattern, 0,
+                                         std::chrono::milliseconds(1));
+    for (int i = 0; i < 3; i++) {
+      std::string block = TestBlock(i);
+      ASSERT_TRUE(w->Write(recordio::ByteSpan{
+          reinterpret_cast<const uint8_t*>(block.data()), block.size()}));
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    ASSERT_TRUE(w->Close());
+  }
+  for (int i = 0; i < 3; i++) {
+    auto r = recordio::NewReader(path(i));
+    ASSERT_TRUE(r->Scan());
+    EXPECT_EQ(TestBlock(i), Str(r.get()));
+    EXPECT_FALSE(r->Scan());
+    remove(path(i).c_str());
+  }
+  EXPECT_NE(0, stat(path(3).c_str(), &st));
+
+  auto w = recordio::NewRotatingWriter(TempDir() + "/test-rotate", 0,
+                                       std::chrono::seconds(1));
+  EXPECT_THAT(w->GetError(), ::testing::HasSubstr("%d"));
+}
+
+TEST(Recordio, RotatingWriterPreallocated) {
+  const std::string pattern = TempDir() + "/test-rotate-%d.grail-rpk";
+  auto path = [](int index) {
+    return TempDir() + "/test-rotate-" + std::to_string(index) + ".grail-rpk";
+  };
+  const int64_t expected_size = 8 << 20;
+  auto w = recordio::NewRotatingWriter(
+      pattern, 0, std::chrono::hours(1),
+      [expected_size](const std::string& path) {
+        auto opts = recordio::DefaultWriterOpts(path);
+        opts.expected_size = expected_size;
+        return opts;
+      });
+  // The successor is opened, and its space reserved, in the background,
+  // before anything is written to it.
+  struct stat st;
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (stat(path(1).c_str(), &st) != 0 ||
+         st.st_blocks * 512 < expected_size) {
+    ASSERT_LT(std::chrono::steady_clock::now(), deadline)
+        << "successor has " << st.st_blocks * 512 << " bytes allocated";
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(0, st.st_size);
+  ASSERT_TRUE(w->Close()) << w->GetError();
+  EXPECT_NE(0, stat(path(1).c_str(), &st));
+  remove(path(0).c_str());
+}
+
+TEST(Recordio, TeeWriter) {
+  const std::string paths[2] = {TempDir() + "/test-tee0.grail-rio",
+                                TempDir() + "/test-tee1.grail-rio"};
+  std::vector<uint64_t> offsets[2];
+  {
+    std::ofstream out0(paths[0], std::ios::binary);
+    std::ofstream out1(paths[1], std::ios::binary);
+    std::vector<recordio::TeeSink> sinks(2);
+    sinks[0].out = &out0;
+    sinks[0].indexer.reset(new TestIndexer(&offsets[0]));
+    sinks[1].out = &out1;
+    sinks[1].indexer.reset(new TestIndexer(&offsets[1]));
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 10;
+    opts.transformers.push_back("flate");
+    // Allow only one queued piece per sink.
+    auto w = recordio::NewTeeWriter(std::move(sinks), std::move(opts), 1);
+    WriteContentsAndClose(w.get());
+    EXPECT_EQ("", w->GetError());
+  }
+  std::string data[2];
+  for (int i = 0; i < 2; i++) {
+    std::ifstream in(paths[i], std::ios::binary);
+    data[i].assign(std::istreambuf_iterator<char>(in),
+                   std::istreambuf_iterator<char>());
+  }
+  EXPECT_GT(data[0].size(), 0);
+  EXPECT_EQ(data[0], data[1]);
+  EXPECT_EQ(TestBlockCount / 10 + 1, offsets[0].size());
+  EXPECT_EQ(offsets[0], offsets[1]);
+  auto r = recordio::NewReader(paths[1]);
+  CheckContents(r.get());
+
+  // A failing sink fails the writer.
+  {
+    std::ofstream out0(paths[0], std::ios::binary);
+    std::ofstream bad(TempDir() + "/nonexistent/test-tee.grail-rio");
+    std::vector<recordio::TeeSink> sinks(2);
+    sinks[0].out = &out0;
+    sinks[1].out = &bad;
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    auto w = recordio::NewTeeWriter(std::move(sinks), std::move(opts));
+    for (int i = 0; i < TestBlockCount; i++) {
+      const std::string block = TestBlock(i);
+      w->Write(recordio::ByteSpan{
+          reinterpret_cast<const uint8_t*>(block.data()), block.size()});
+    }
+    EXPECT_FALSE(w->Close());
+    EXPECT_THAT(w->GetError(), ::testing::HasSubstr("tee sink 1"));
+  }
+  for (const auto& path : paths) remove(path.c_str());
+}
+
+TEST(Recordio, ConcurrentWriter) {
+  const int n_threads = 8;
+  const int n_items = 20000;
+  std::string filename = TempDir() + "/test-concurrent.grail-rpk-gz";
+  {
+    auto w = recordio::NewConcurrentWriter(recordio::NewWriter(filename), 3);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++) {
+      threads.emplace_back([&w, t]() {
+        for (int i = 0; i < n_items; i++) {
+          const std::string item = std::to_string(t) + ":" + std::to_string(i);
+          ASSERT_TRUE(w->Write(recordio::ByteSpan{
+              reinterpret_cast<const uint8_t*>(item.data()), item.size()}));
+        }
+      });
+    }
+    for (auto& thread : threads) thread.join();
+    ASSERT_TRUE(w->Close()) << w->GetError();
+  }
+
+  // Records of each thread must appear exactly once, in order.
+  std::vector<int> next(n_threads);
+  auto r = recordio::NewReader(filename);
+  while (r->Scan()) {
+    int t, i;
+    ASSERT_EQ(2, sscanf(Str(r.get()).c_str(), "%d:%d", &t, &i));
+    ASSERT_EQ(next[t], i);
+    next[t]++;
+  }
+  EXPECT_EQ("", r->GetError());
+  EXPECT_EQ(std::vector<int>(n_threads, n_items), next);
+  remove(filename.c_str());
+}
+
+TEST(Recordio, ShuffleReader) {
+  std::vector<std::string> paths;
+  for (int f = 0; f < 3; f++) {
+    paths.push_back(TempDir() + "/test-shuffle-" + std::to_string(f) +
+                    ".grail-rio");
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 7;
+    opts.transformers.push_back("flate");
+    auto w = recordio::NewWriter(paths.back(), std::move(opts));
+    for (int i = 0; i < 100; i++) {
+      const std::string item = std::to_string(f * 100 + i);
+      ASSERT_TRUE(w->Write(recordio::ByteSpan{
+          reinterpret_cast<const uint8_t*>(item.data()), item.size()}));
+    }
+    ASSERT_TRUE(w->Close());
+  }
+
+  auto read_all = [&paths](uint64_t seed, int threads) {
+    std::vector<int> items;
+    auto r = recordio::NewShuffleReader(paths, 20, seed, threads);
+    while (r->Scan()) {
+      const recordio::ByteSpan item = r->Get();
+      items.push_back(std::stoi(std::string(
+          reinterpret_cast<const char*>(item.data()), item.size())));
+    }
+    EXPECT_EQ("", r->GetError());
+    return items;
+  };
+  const std::vector<int> items = read_all(1, 3);
+  std::vector<int> sorted = items;
+  std::sort(sorted.begin(), sorted.end());
+  std::vector<int> expected(300);
+  std::iota(expected.begin(), expected.end(), 0);
+  EXPECT_EQ(expected, sorted);
+  EXPECT_NE(expected, items);
+  EXPECT_EQ(items, read_all(1, 1));
+  EXPECT_NE(items, read_all(2, 3));
+
+  paths.push_back(TempDir() + "/nonexistent.grail-rio");
+  auto r = recordio::NewShuffleReader(paths, 20, 1);
+  EXPECT_FALSE(r->Scan());
+  EXPECT_THAT(r->GetError(), ::testing::HasSubstr("nonexistent"));
+  for (int f = 0; f < 3; f++) remove(paths[f].c_str());
+}
+
+TEST(Recordio, BlockCache) {
+  std::string filename = TempDir() + "/test-cache.grail-rio";
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 10;
+    opts.transformers.push_back("flate");
+    auto w = recordio::NewWriter(filename, std::move(opts));
+    WriteContentsAndClose(w.get());
+  }
+  const int n_blocks = (TestBlockCount + 9) / 10;
+  auto scan = [&filename](std::shared_ptr<recordio::BlockCache> cache) {
+    recordio::ReaderOpts opts;
+    opts.cache = cache;
+    auto r = recordio::NewReader(filename, std::move(opts));
+    CheckContents(r.get());
+  };
+
+  // Everything fits in memory.
+  auto cache = recordio::NewBlockCache(1 << 20);
+  scan(cache);
+  EXPECT_EQ(0, cache->GetStats().hits);
+  scan(cache);
+  scan(cache);
+  EXPECT_EQ(2 * n_blocks, cache->GetStats().hits);
+  EXPECT_GT(cache->GetStats().memory_bytes, 0);
+
+  // Only one block fits in memory, and the rest are spilled.
+  cache = recordio::NewBlockCache(1, TempDir(), 1 << 20);
+  scan(cache);
+  scan(cache);
+  auto stats = cache->GetStats();
+  EXPECT_EQ(n_blocks, stats.hits + stats.spill_hits);
+  EXPECT_GE(stats.spill_hits, n_blocks - 1);
+  EXPECT_GT(stats.spill_bytes, 0);
+  EXPECT_EQ("", cache->GetError());
+
+  // Readers in several threads share a spilling cache.
+  cache = recordio::NewBlockCache(1, TempDir(), 1 << 20);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back([&scan, cache]() {
+      scan(cache);
+      scan(cache);
+    });
+  }
+  for (auto& t : threads) t.join();
+  stats = cache->GetStats();
+  EXPECT_GT(stats.spill_hits, 0);
+  EXPECT_EQ("", cache->GetError());
+
+  // Neither fits; blocks are dropped and read again.
+  cache = recordio::NewBlockCache(1);
+  scan(cache);
+  scan(cache);
+  EXPECT_EQ(0, cache->GetStats().hits + cache->GetStats().spill_hits);
+
+  // The spill file can't be created. The cache reports it, and works in
+  // memory.
+  cache = recordio::NewBlockCache(1 << 20, TempDir() + "/nonexistent", 1 << 20);
+  EXPECT_THAT(cache->GetError(), ::testing::HasSubstr("mkstemp"));
+  scan(cache);
+  scan(cache);
+  EXPECT_EQ(n_blocks, cache->GetStats().hits);
+  remove(filename.c_str());
+}
+
+std::string BigEndianKey(uint64_t v) {
+  std::string key(8, '\0');
+  for (int i = 7; i >= 0; i--, v >>= 8) key[i] = static_cast<char>(v & 0xff);
+  return key;
+}
+
+TEST(Recordio, KeyRange) {
+  std::string filename = TempDir() + "/test-keyrange.grail-rio";
+  auto key_of = [](recordio::ByteSpan item) {
+    return std::string(reinterpret_cast<const char*>(item.data()), 8);
+  };
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 10;
+    opts.transformers.push_back("flate");
+    opts.key_extractor = key_of;
+    auto w = recordio::NewWriter(filename, std::move(opts));
+    for (int i = 0; i < 100; i++) {
+      const std::string item = BigEndianKey(i) + "data";
+      ASSERT_TRUE(w->Write(recordio::ByteSpan{
+          reinterpret_cast<const uint8_t*>(item.data()), item.size()}));
+    }
+    ASSERT_TRUE(w->Close()) << w->GetError();
+  }
+
+  auto scan = [&](bool use_key_range, int min_key, int max_key,
+                  int prefetch_blocks = 0) {
+    recordio::ReaderOpts opts;
+    opts.prefetch_blocks = prefetch_blocks;
+    opts.use_key_range = use_key_range;
+    opts.min_key = BigEndianKey(min_key);
+    opts.max_key = BigEndianKey(max_key);
+    auto r = recordio::NewReader(filename, std::move(opts));
+    std::vector<std::string> keys;
+    while (r->Scan()) keys.push_back(key_of(r->Get()));
+    EXPECT_EQ("", r->GetError());
+    return keys;
+  };
+  EXPECT_EQ(100, scan(false, 0, 0).size());
+  // Only the blocks holding items 20-29 and 30-39 overlap the range.
+  auto keys = scan(true, 25, 34);
+  ASSERT_EQ(20, keys.size());
+  EXPECT_EQ(BigEndianKey(20), keys.front());
+  EXPECT_EQ(BigEndianKey(39), keys.back());
+  EXPECT_EQ(10, scan(true, 95, 1000).size());
+  EXPECT_EQ(0, scan(true, 200, 300).size());
+  // The read-ahead skips the same blocks.
+  EXPECT_EQ(keys, scan(true, 25, 34, 4));
+  EXPECT_EQ(10, scan(true, 95, 1000, 4).size());
+
+  // Key statistics need the V2 format.
+  recordio::WriterOpts opts;
+  opts.packed = true;
+  opts.key_extractor = key_of;
+  std::ostringstream out;
+  auto w = recordio::NewWriter(&out, std::move(opts));
+  EXPECT_FALSE(w->Write(recordio::ByteSpan{nullptr, 0}));
+  EXPECT_NE("", w->GetError());
+  remove(filename.c_str());
+}
+
+TEST(Recordio, Lookup) {
+  std::string filename = TempDir() + "/test-lookup.grail-rio";
+  auto key_of = [](recordio::ByteSpan item) {
+    return std::string(reinterpret_cast<const char*>(item.data()), 8);
+  };
+  auto write = [&](recordio::Writer* w, int key) {
+    const std::string item = BigEndianKey(key) + "value";
+    return w->Write(recordio::ByteSpan{
+        reinterpret_cast<const uint8_t*>(item.data()), item.size()});
+  };
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 10;
+    opts.transformers.push_back("flate");
+    opts.key_extractor = key_of;
+    opts.sorted = true;
+    auto w = recordio::NewWriter(filename, std::move(opts));
+    // Even keys 0-198. Key 100 spans two blocks.
+    for (int i = 0; i < 100; i++) {
+      ASSERT_TRUE(write(w.get(), 2 * i));
+      if (i == 50) {
+        for (int j = 0; j < 10; j++) ASSERT_TRUE(write(w.get(), 100));
+      }
+    }
+    ASSERT_TRUE(w->Close()) << w->GetError();
+  }
+
+  recordio::ReaderOpts opts;
+  opts.key_extractor = key_of;
+  auto r = recordio::NewReader(filename, std::move(opts));
+  ASSERT_TRUE(r->Lookup(BigEndianKey(42)));
+  EXPECT_EQ(BigEndianKey(42) + "value", Str(r.get()));
+  ASSERT_TRUE(r->Scan());
+  EXPECT_EQ(BigEndianKey(44), key_of(r->Get()));
+  EXPECT_FALSE(r->Lookup(BigEndianKey(43)));
+  EXPECT_FALSE(r->Lookup(BigEndianKey(1000)));
+  ASSERT_TRUE(r->Lookup(BigEndianKey(0)));
+  ASSERT_TRUE(r->Lookup(BigEndianKey(198)));
+  EXPECT_FALSE(r->Scan());
+  // The first of the duplicates is found.
+  ASSERT_TRUE(r->Lookup(BigEndianKey(100)));
+  int n = 1;
+  while (r->Scan() && key_of(r->Get()) == BigEndianKey(100)) n++;
+  EXPECT_EQ(11, n);
+  EXPECT_EQ("", r->GetError());
+
+  // Lookup needs the key extractor.
+  r = recordio::NewReader(filename);
+  EXPECT_FALSE(r->Lookup(BigEndianKey(42)));
+  EXPECT_NE("", r->GetError());
+
+  // The writer rejects out-of-order keys.
+  recordio::WriterOpts wopts;
+  wopts.v2 = true;
+  wopts.key_extractor = key_of;
+  wopts.sorted = true;
+  std::ostringstream out;
+  auto w = recordio::NewWriter(&out, std::move(wopts));
+  EXPECT_TRUE(write(w.get(), 2));
+  EXPECT_FALSE(write(w.get(), 1));
+  EXPECT_NE("", w->GetError());
+  remove(filename.c_str());
+}
+
+TEST(Recordio, BloomFilter) {
+  std::string filename = TempDir() + "/test-bloom.grail-rio";
+  auto key_of = [](recordio::ByteSpan item) {
+    return std::string(reinterpret_cast<const char*>(item.data()), 8);
+  };
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 10;
+    opts.key_extractor = key_of;
+    opts.bloom_bits_per_key = 10;
+    auto w = recordio::NewWriter(filename, std::move(opts));
+    // Even keys 0-198 in a scrambled order, so every block spans most of the
+    // key space.
+    for (int i = 0; i < 100; i++) {
+      const std::string item = BigEndianKey((i * 37 % 100) * 2) + "value";
+      ASSERT_TRUE(w->Write(recordio::ByteSpan{
+          reinterpret_cast<const uint8_t*>(item.data()), item.size()}));
+    }
+    ASSERT_TRUE(w->Close()) << w->GetError();
+  }
+
+  auto cache = recordio::NewBlockCache(1 << 20);
+  recordio::ReaderOpts opts;
+  opts.key_extractor = key_of;
+  opts.cache = cache;
+  auto r = recordio::NewReader(filename, std::move(opts));
+  for (int i = 0; i < 100; i++) {
+    ASSERT_TRUE(r->Lookup(BigEndianKey(2 * i))) << i;
+    EXPECT_EQ(BigEndianKey(2 * i), key_of(r->Get()));
+  }
+  const auto hits = cache->GetStats();
+  for (int i = 0; i < 100; i++) {
+    EXPECT_FALSE(r->Lookup(BigEndianKey(2 * i + 1))) << i;
+  }
+  EXPECT_EQ("", r->GetError());
+  // Without the filters, each miss would touch every block whose key range
+  // covers the key, i.e., about 1000 lookups in total.
+  const auto misses = cache->GetStats();
+  EXPECT_LT((misses.hits + misses.misses) - (hits.hits + hits.misses), 100);
+  remove(filename.c_str());
+}
+
+void CheckForEachItem(recordio::Reader* r) {
+  int n = 0;
+  recordio::ForEachItem(r, [&n](recordio::ByteSpan item) {
+    EXPECT_EQ(TestBlock(n++),
+              std::string(reinterpret_cast<const char*>(item.data()),
+                          item.size()));
+  });
+  EXPECT_EQ("", r->GetError());
+  EXPECT_EQ(TestBlockCount, n);
+}
+
+TEST(Recordio, ForEachItemMmap) {
+  for (bool v2 : {false, true}) {
+    std::string filename = TempDir() + "/test-foreach.grail-rio";
+    {
+      recordio::WriterOpts opts;
+      opts.v2 = v2;
+      opts.packed = true;
+      opts.max_packed_items = 10;
+      if (v2) opts.transformers.push_back("flate");
+      auto w = recordio::NewWriter(filename, std::move(opts));
+      WriteContentsAndClose(w.get());
+    }
+    for (bool mmap : {false, true}) {
+      recordio::ReaderOpts opts;
+      opts.mmap = mmap;
+      CheckForEachItem(recordio::NewReader(filename, std::move(opts)).get());
+      opts = recordio::ReaderOpts();
+      opts.mmap = mmap;
+      CheckContents(recordio::NewReader(filename, std::move(opts)).get());
+    }
+    remove(filename.c_str());
+  }
+}
+
+std::unique_ptr<recordio::ReadSeeker> OpenReadSeeker(
+    const std::string& path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  EXPECT_GE(fd, 0) << path;
+  return recordio::NewReadSeekerFromDescriptor(fd);
+}
+
+TEST(Recordio, Reset) {
+  const std::vector<std::vector<std::string>> transformers = {
+      {"flate"}, {}, {"flate"}};
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < transformers.size(); i++) {
+    paths.push_back(TempDir() + "/test-reset" + std::to_string(i) +
+                    ".grail-rio");
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 10;
+    opts.transformers = transformers[i];
+    auto w = recordio::NewWriter(paths.back(), std::move(opts));
+    WriteContentsAndClose(w.get());
+  }
+  auto r =
+      recordio::NewReader(OpenReadSeeker(paths[0]), recordio::ReaderOpts());
+  CheckContents(r.get());
+  for (int i : {1, 2, 0}) {
+    r->Reset(OpenReadSeeker(paths[i]));
+    CheckContents(r.get());
+  }
+
+  // A V1 file can't be read after Reset, but the reader recovers on the next
+  // Reset.
+  const std::string v1_path = TempDir() + "/test-reset-v1.grail-rio";
+  {
+    recordio::WriterOpts opts;
+    opts.packed = true;
+    auto w = recordio::NewWriter(v1_path, std::move(opts));
+    WriteContentsAndClose(w.get());
+  }
+  r->Reset(OpenReadSeeker(v1_path));
+  EXPECT_FALSE(r->Scan());
+  EXPECT_NE("", r->GetError());
+  r->Reset(OpenReadSeeker(paths[1]));
+  CheckContents(r.get());
+  remove(v1_path.c_str());
+  for (const auto& path : paths) remove(path.c_str());
+}
+
+// Return a ReadSeeker for a pipe that is fed the contents of "path" in small
+// pieces by *thread.
+std::unique_ptr<recordio::ReadSeeker> OpenPipe(const std::string& path,
+                                               std::thread* thread) {
+  int fds[2];
+  EXPECT_EQ(0, pipe(fds));
+  std::ifstream in(path, std::ios::binary);
+  std::string data((std::istreambuf_iterator<char>(in)),
+                   std::istreambuf_iterator<char>());
+  *thread = std::thread([data, fds]() {
+    for (size_t i = 0; i < data.size(); i += 1000) {
+      const size_t n = std::min<size_t>(1000, data.size() - i);
+      EXPECT_EQ(static_cast<ssize_t>(n), write(fds[1], data.data() + i, n));
+    }
+    close(fds[1]);
+  });
+  return recordio::NewReadSeekerFromDescriptor(fds[0]);
+}
+
+TEST(Recordio, Pipe) {
+  const std::string path = TempDir() + "/test-pipe.grail-rio";
+  for (int format = 0; format < 3; format++) {
+    recordio::WriterOpts opts;
+    if (format == 0) {
+      opts.packed = true;
+    } else {
+      opts.v2 = true;
+      opts.max_packed_items = 10;
+      opts.transformers.push_back("flate");
+      if (format == 2) {
+        // Adds a trailer, which the stream reader skips.
+        opts.key_extractor = [](recordio::ByteSpan item) {
+          return std::string(item.begin(), item.end());
+        };
+      }
+    }
+    WriteContentsAndClose(recordio::NewWriter(path, std::move(opts)).get());
+
+    std::thread thread;
+    recordio::ReaderOpts ropts;
+    if (format == 2) {
+      ropts.key_extractor = [](recordio::ByteSpan item) {
+        return std::string(item.begin(), item.end());
+      };
+    }
+    auto r = recordio::NewReader(OpenPipe(path, &thread), std::move(ropts));
+    CheckContents(r.get());
+    if (format > 0) {
+      EXPECT_EQ(0, r->Trailer().size());
+      EXPECT_FALSE(r->Lookup(TestBlock(0)));
+      EXPECT_THAT(r->GetError(), ::testing::HasSubstr("seekable"));
+    }
+    thread.join();
+  }
+  remove(path.c_str());
+}
+
+TEST(Recordio, Prefetch) {
+  const std::string path = TempDir() + "/test-prefetch.grail-rio";
+  std::vector<uint64_t> offsets;
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 4;
+    opts.transformers.push_back("flate");
+    opts.indexer.reset(new TestIndexer(&offsets));
+    WriteContentsAndClose(recordio::NewWriter(path, std::move(opts)).get());
+  }
+  ASSERT_EQ(TestBlockCount / 4, offsets.size());
+  auto new_reader = [&path]() {
+    recordio::ReaderOpts opts;
+    opts.prefetch_blocks = 8;
+    opts.decode_threads = 4;
+    return recordio::NewReader(path, std::move(opts));
+  };
+  {
+    auto r = new_reader();
+    CheckContents(r.get());
+    const auto stats = r->GetStats();
+    EXPECT_EQ(offsets.size(), stats.blocks);
+    EXPECT_GE(stats.prefetch_depth, 1);
+    EXPECT_LE(stats.prefetch_depth, 8);
+    EXPECT_GE(stats.decode_threads, 1);
+    EXPECT_LE(stats.decode_threads, 4);
+    EXPECT_GT(stats.decode_seconds, 0);
+  }
+  {
+    // Seek stops the read-ahead, and Scan resumes it from the new position.
+    auto r = new_reader();
+    for (int i = 0; i < 10; i++) ASSERT_TRUE(r->Scan());
+    r->Seek(recordio::ItemLocation{static_cast<int64_t>(offsets[20]), 1});
+    for (int i = 81; i < TestBlockCount; i++) {
+      ASSERT_TRUE(r->Scan()) << r->GetError();
+      ASSERT_EQ(TestBlock(i), Str(r.get()));
+    }
+    EXPECT_FALSE(r->Scan());
+    EXPECT_EQ("", r->GetError());
+  }
+  {
+    // Stream from a pipe.
+    std::thread thread;
+    recordio::ReaderOpts opts;
+    opts.prefetch_blocks = 4;
+    auto r = recordio::NewReader(OpenPipe(path, &thread), std::move(opts));
+    CheckContents(r.get());
+    thread.join();
+  }
+  remove(path.c_str());
+}
+
+TEST(Recordio, HugePages) {
+  recordio::internal::HugePageBuffer buf(
+      recordio::internal::HugePageAllocator<uint8_t>(true));
+  buf.resize(3 << 20);
+  EXPECT_EQ(0, reinterpret_cast<uintptr_t>(buf.data()) %
+                   recordio::internal::HugePageSize);
+
+  // Large blocks, and enough data for the mmap reader to read ahead.
+  const std::string path = TempDir() + "/test-hugepages.grail-rio";
+  std::mt19937 rng(1);
+  std::vector<std::string> items;
+  for (int i = 0; i < 400; i++) {
+    std::string item(64 << 10, '\0');
+    for (auto& ch : item) ch = 'a' + rng() % 26;
+    items.push_back(item);
+  }
+  for (bool v2 : {false, true}) {
+    recordio::WriterOpts opts;
+    opts.packed = true;
+    opts.v2 = v2;
+    opts.huge_pages = true;
+    opts.max_packed_bytes = 4 << 20;
+    auto w = recordio::NewWriter(path, std::move(opts));
+    for (const auto& item : items) {
+      ASSERT_TRUE(w->Write(recordio::ByteSpan{
+          reinterpret_cast<const uint8_t*>(item.data()), item.size()}));
+    }
+    ASSERT_TRUE(w->Close()) << w->GetError();
+    for (bool mmap : {false, true}) {
+      recordio::ReaderOpts ropts;
+      ropts.huge_pages = true;
+      ropts.mmap = mmap;
+      auto r = recordio::NewReader(path, std::move(ropts));
+      size_t n = 0;
+      while (r->Scan()) {
+        ASSERT_LT(n, items.size());
+        ASSERT_EQ(items[n], Str(r.get()));
+        n++;
+      }
+      EXPECT_EQ("", r->GetError());
+      EXPECT_EQ(items.size(), n);
+    }
+  }
+  remove(path.c_str());
+}
+
+TEST(Recordio, ChunkAlignedBlocks) {
+  std::string filename = TempDir() + "/test-aligned.grail-rio";
+  std::vector<std::string> items;
+  std::mt19937 rng(1);
+  for (int i = 0; i < 20000; i++) {
+    std::string item;
+    for (int j = 0; j < 100; j++) item.push_back('a' + rng() % 8);
+    items.push_back(item);
+  }
+  auto write = [&](bool aligned) {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_bytes = 200 << 10;
+    opts.transformers.push_back("flate");
+    opts.chunk_aligned_blocks = aligned;
+    auto w = recordio::NewWriter(filename, std::move(opts));
+    for (const auto& item : items) {
+      EXPECT_TRUE(w->Write(recordio::ByteSpan{
+          reinterpret_cast<const uint8_t*>(item.data()), item.size()}));
+    }
+    EXPECT_TRUE(w->Close()) << w->GetError();
+    struct stat st;
+    EXPECT_EQ(0, stat(filename.c_str(), &st));
+    return st.st_size;
+  };
+  const int64_t unaligned_size = write(false);
+  const int64_t aligned_size = write(true);
+  EXPECT_LT(aligned_size, unaligned_size * 0.95)
+      << aligned_size << " " << unaligned_size;
+
+  auto r = recordio::NewReader(filename);
+  size_t n = 0;
+  while (r->Scan()) {
+    ASSERT_EQ(items[n], Str(r.get()));
+    n++;
+  }
+  EXPECT_EQ("", r->GetError());
+  EXPECT_EQ(items.size(), n);
+
+  // A target of 150 chunks. The blocks should fill them, up to the margin
+  // and the last item.
+  const int64_t chunk = 32 << 10, payload = chunk - 28;
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_bytes = 150 * payload + payload / 2;
+    opts.chunk_aligned_blocks = true;
+    auto w = recordio::NewWriter(filename, std::move(opts));
+    const std::string item(1000, 'x');
+    for (int i = 0; i < 16000; i++) {
+      EXPECT_TRUE(w->Write(recordio::ByteSpan{
+          reinterpret_cast<const uint8_t*>(item.data()), item.size()}));
+    }
+    EXPECT_TRUE(w->Close()) << w->GetError();
+  }
+  recordio::FileAnalysis a;
+  ASSERT_EQ("", recordio::AnalyzeFile(filename, &a));
+  ASSERT_EQ(4, a.blocks.size());
+  for (size_t i = 0; i + 1 < a.blocks.size(); i++) {
+    EXPECT_EQ(150 * chunk, a.blocks[i].file_bytes) << i;
+    EXPECT_LT(a.blocks[i].padding_bytes, chunk / 8) << i;
+  }
+  remove(filename.c_str());
+}
+
+TEST(Recordio, AnalyzeFile) {
+  std::string filename = TempDir() + "/test-analyze.grail-rio";
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    opts.max_packed_items = 10;
+    auto w = recordio::NewWriter(filename, std::move(opts));
+    WriteContentsAndClose(w.get());
+  }
+  recordio::FileAnalysis a;
+  ASSERT_EQ("", recordio::AnalyzeFile(filename, &a));
+  EXPECT_EQ("v2", a.format);
+  EXPECT_TRUE(a.transformers.empty());
+  EXPECT_EQ((TestBlockCount + 9) / 10, a.blocks.size());
+  EXPECT_EQ(TestBlockCount, a.n_items);
+  EXPECT_EQ(a.raw_bytes, a.transformed_bytes);
+  // Each block holds at most 10 small items in one chunk.
+  EXPECT_GT(a.padding_bytes, a.file_bytes / 2);
+  ASSERT_EQ(5, a.item_sizes.size());
+  EXPECT_EQ(TestBlockCount, a.item_sizes[4]);  // [8, 16) bytes.
+  // The test records are highly repetitive.
+  EXPECT_LT(a.flate_ratio, 0.9);
+  EXPECT_EQ(std::vector<std::string>{"flate"}, a.recommended_transformers);
+  EXPECT_GT(a.recommended_max_packed_bytes, 16 * 32 << 10);
+  EXPECT_GE(a.recommended_max_packed_items,
+            a.recommended_max_packed_bytes / TestRecordSize);
+  EXPECT_TRUE(a.recommend_chunk_aligned_blocks);
+
+  EXPECT_NE("", recordio::AnalyzeFile("/non/existent/file", &a));
+  remove(filename.c_str());
+}
+
+// Copy "src" to "dest" block by block with RawBlockReader and RawBlockWriter.
+// If "via_pipe" is true, the blocks are sent through a pipe with SendTo and
+// WriteFrom instead of being read into memory.
+void RawCopy(const std::string& src, const std::string& dest, bool via_pipe,
+             std::vector<uint64_t>* block_offsets) {
+  auto r = recordio::NewRawBlockReader(src);
+  auto w = recordio::NewRawBlockWriter(
+      dest, std::unique_ptr<recordio::WriterIndexer>(
+                new TestIndexer(block_offsets)));
+  int fds[2] = {-1, -1};
+  if (via_pipe) {
+    ASSERT_EQ(0, pipe(fds));
+  }
+  int64_t off = 0;
+  while (r->Scan()) {
+    EXPECT_EQ(off, r->Offset());
+    off += r->Size();
+    if (via_pipe) {
+      // The pipe buffer may be smaller than a block, so send from another
+      // thread.
+      bool sent = false;
+      std::thread sender([&r, &sent, &fds]() { sent = r->SendTo(fds[1]); });
+      ASSERT_TRUE(w->WriteFrom(fds[0], r->Size())) << w->GetError();
+      sender.join();
+      ASSERT_TRUE(sent) << r->GetError();
+    } else {
+      ASSERT_TRUE(w->Write(r->Get())) << w->GetError();
+    }
+  }
+  EXPECT_EQ("", r->GetError());
+  EXPECT_TRUE(w->Close()) << w->GetError();
+  if (via_pipe) {
+    close(fds[0]);
+    close(fds[1]);
+  }
+}
+
+TEST(Recordio, RawCopy) {
+  for (const std::string suffix : {"grail-rpk-gz", "grail-rio", "v2"}) {
+    std::string src = TempDir() + "/test-raw-src." + suffix;
+    std::string dest = TempDir() + "/test-raw-dest." + suffix;
+    std::vector<uint64_t> block_offsets;
+    {
+      auto opts = recordio::DefaultWriterOpts(src);
+      if (suffix == "v2") {
+        opts.v2 = true;
+        opts.transformers.push_back("flate");
+      }
+      opts.max_packed_items = 10;
+      opts.indexer.reset(new TestIndexer(&block_offsets));
+      std::ofstream out(src);
+      auto w = recordio::NewWriter(&out, std::move(opts));
+      WriteContentsAndClose(w.get());
+    }
+    for (bool via_pipe : {false, true}) {
+      std::vector<uint64_t> raw_offsets;
+      RawCopy(src, dest, via_pipe, &raw_offsets);
+      EXPECT_EQ(ReadFile(src), ReadFile(dest)) << suffix;
+      if (suffix == "v2") {
+        // The header block is not reported by the writer.
+        ASSERT_EQ(block_offsets.size() + 1, raw_offsets.size());
+        raw_offsets.erase(raw_offsets.begin());
+      }
+      EXPECT_EQ(block_offsets, raw_offsets) << suffix;
+      auto r = recordio::NewReader(dest);
+      CheckContents(r.get());
+    }
+    remove(src.c_str());
+    remove(dest.c_str());
+  }
+}
+
 TEST(Recordio, ReadPacked) {
   auto r = recordio::NewReader("lib/recordio/testdata/test.grail-rpk");
   CheckContents(r.get());
@@ -0,0 +1,176 @@
+// rio_analyze reports the layout of recordio files and suggests writer
+// options for them.
+//
+// Usage:
+//   rio_analyze [--blocks] path...
+//
+// For each file, it reports the format, the header, block, item and padding
+// totals, the distribution of the per-block compression ratio, and the item
+// size histogram, followed by the recommended WriterOpts settings.
+//
+// --blocks additionally lists every data block.
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+namespace {
+
+struct Flags {
+  std::vector<std::string> paths;
+  bool blocks = false;
+};
+
+void Usage() {
+  std::cerr << "Usage: rio_analyze [--blocks] path...\n";
+  exit(2);
+}
+
+Flags ParseFlags(int argc, char** argv) {
+  Flags f;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--blocks") {
+      f.blocks = true;
+    } else if (arg.compare(0, 2, "--") == 0) {
+      Usage();
+    } else {
+      f.paths.push_back(arg);
+    }
+  }
+  if (f.paths.empty()) Usage();
+  return f;
+}
+
+std::string Percent(uint64_t n, uint64_t total) {
+  char buf[32];
+  snprintf(buf, sizeof buf, "%.1f%%", total > 0 ? 100.0 * n / total : 0.0);
+  return buf;
+}
+
+void PrintHeaderValue(const HeaderValue& v) {
+  switch (v.type) {
+    case HeaderValue::BOOL:
+      std::cout << (v.b ? "true" : "false");
+      break;
+    case HeaderValue::INT:
+      std::cout << v.i;
+      break;
+    case HeaderValue::UINT:
+      std::cout << v.u;
+      break;
+    case HeaderValue::STRING:
+      std::cout << "\"" << v.s << "\"";
+      break;
+    default:
+      std::cout << "?";
+  }
+}
+
+// Print the min, quartiles and max of the transformed/raw size ratio of the
+// blocks.
+void PrintRatios(const std::vector<FileAnalysis::Block>& blocks) {
+  std::vector<double> ratios;
+  for (const auto& b : blocks) {
+    if (b.raw_bytes > 0) {
+      ratios.push_back(static_cast<double>(b.transformed_bytes) / b.raw_bytes);
+    }
+  }
+  if (ratios.empty()) return;
+  std::sort(ratios.begin(), ratios.end());
+  char buf[128];
+  auto q = [&ratios](double p) {
+    return ratios[static_cast<size_t>(p * (ratios.size() - 1))];
+  };
+  snprintf(buf, sizeof buf,
+           "compression ratio: min %.3f p25 %.3f p50 %.3f p75 %.3f max %.3f\n",
+           q(0), q(0.25), q(0.5), q(0.75), q(1));
+  std::cout << buf;
+}
+
+void Print(const std::string& path, const FileAnalysis& a, bool blocks) {
+  std::cout << "file: " << path << " (" << a.file_bytes << " bytes)\n";
+  std::cout << "format: " << a.format << "\n";
+  std::cout << "transformer:";
+  if (a.transformers.empty()) std::cout << " none";
+  for (const auto& t : a.transformers) std::cout << " " << t;
+  std::cout << "\n";
+  if (!a.header.empty()) {
+    std::cout << "header:\n";
+    for (const auto& e : a.header) {
+      std::cout << "  " << e.key << " = ";
+      PrintHeaderValue(e.value);
+      std::cout << "\n";
+    }
+  }
+  std::cout << "blocks: " << a.blocks.size() << "\n";
+  std::cout << "items: " << a.n_items << "\n";
+  std::cout << "raw bytes: " << a.raw_bytes << "\n";
+  std::cout << "transformed bytes: " << a.transformed_bytes << "\n";
+  std::cout << "padding bytes: " << a.padding_bytes << " ("
+            << Percent(a.padding_bytes, a.file_bytes) << " of file)\n";
+  PrintRatios(a.blocks);
+  std::cout << "item size histogram (bytes):\n";
+  for (size_t b = 0; b < a.item_sizes.size(); b++) {
+    if (a.item_sizes[b] == 0) continue;
+    const uint64_t lo = (b == 0) ? 0 : (1ULL << (b - 1));
+    const uint64_t hi = (1ULL << b);
+    std::cout << "  [" << lo << ", " << hi << "): " << a.item_sizes[b]
+              << "\n";
+  }
+  if (blocks) {
+    std::cout << "offset file_bytes transformed raw padding items\n";
+    for (const auto& b : a.blocks) {
+      std::cout << "  " << b.offset << " " << b.file_bytes << " "
+                << b.transformed_bytes << " " << b.raw_bytes << " "
+                << b.padding_bytes << " " << b.n_items << "\n";
+    }
+  }
+  char buf[64];
+  snprintf(buf, sizeof buf, "%.3f", a.flate_ratio);
+  std::cout << "flate ratio: " << buf << "\n";
+  std::cout << "recommended:\n";
+  std::cout << "  v2 = true\n";
+  std::cout << "  max_packed_bytes = " << a.recommended_max_packed_bytes
+            << "\n";
+  std::cout << "  max_packed_items = " << a.recommended_max_packed_items
+            << "\n";
+  std::cout << "  transformers = {";
+  for (size_t i = 0; i < a.recommended_transformers.size(); i++) {
+    std::cout << (i > 0 ? ", " : "") << "\"" << a.recommended_transformers[i]
+              << "\"";
+  }
+  std::cout << "}\n";
+  if (a.recommend_chunk_aligned_blocks) {
+    std::cout << "  chunk_aligned_blocks = true\n";
+  }
+}
+
+int Run(const Flags& flags) {
+  int status = 0;
+  for (const auto& path : flags.paths) {
+    FileAnalysis a;
+    const Error err = AnalyzeFile(path, &a);
+    if (!err.empty()) {
+      std::cerr << err << "\n";
+      status = 1;
+      continue;
+    }
+    Print(path, a, flags.blocks);
+  }
+  return status;
+}
+
+}  // namespace
+}  // namespace recordio
+}  // namespace grail
+
+int main(int argc, char** argv) {
+  return grail::recordio::Run(grail::recordio::ParseFlags(argc, argv));
+}
@@ -0,0 +1,695 @@
+// rio_bench inspects a recordio file and measures how fast each stage of the
+// read path runs on it.
+//
+// Usage:
+//   rio_bench [--threads=N] [--verify=none|crc|full] [--backend=fd|mmap] path
+//
+// It reports the file format, the header, block and item counts, block and
+// item size histograms, and the throughput of each stage: raw I/O, checksum
+// verification, untransform (e.g., inflate), and item parsing.
+//
+// --threads=N runs the stages after raw I/O on N threads.
+// --verify=none skips the checksum stage of V1 files. V2 chunk checksums are
+//   always verified, with the rest of the chunk framing. --verify=full
+//   additionally reads the file through recordio::NewReader and checks that it
+//   sees the same items: the same count, and the same sum of the items'
+//   crc32s. The sum doesn't depend on the order in which the threads decode
+//   the blocks.
+// --backend=fd reads the file with read(2). --backend=mmap maps it instead.
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "./portable_endian.h"
+#include "./chunk.h"
+#include "./header.h"
+#include "./internal.h"
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+namespace {
+
+using internal::ErrorReporter;
+using internal::Magic;
+
+enum class Format { UNKNOWN, V1_UNPACKED, V1_PACKED, V2 };
+
+struct Flags {
+  std::string path;
+  int threads = 1;
+  std::string verify = "crc";
+  std::string backend = "fd";
+};
+
+// Histogram with power-of-two buckets.
+class Histogram {
+ public:
+  void Add(uint64_t v) {
+    int b = 0;
+    while (b < 63 && (1ULL << b) <= v) b++;
+    if (buckets_.size() <= static_cast<size_t>(b)) buckets_.resize(b + 1);
+    buckets_[b]++;
+  }
+
+  void Merge(const Histogram& h) {
+    if (buckets_.size() < h.buckets_.size()) buckets_.resize(h.buckets_.size());
+    for (size_t i = 0; i < h.buckets_.size(); i++) buckets_[i] += h.buckets_[i];
+  }
+
+  void Print(const std::string& title) const {
+    std::cout << title << ":\n";
+    for (size_t b = 0; b < buckets_.size(); b++) {
+      if (buckets_[b] == 0) continue;
+      const uint64_t lo = (b == 0) ? 0 : (1ULL << (b - 1));
+      const uint64_t hi = (1ULL << b);
+      std::cout << "  [" << lo << ", " << hi << "): " << buckets_[b] << "\n";
+    }
+  }
+
+ private:
+  std::vector<uint64_t> buckets_;
+};
+
+// RawBlock is a block as stored in the file, before any verification.
+struct RawBlock {
+  // The whole block: the V1 block header and payload, or the V2 chunks.
+  internal::ByteSpan data;
+  std::vector<uint8_t> storage;  // Backing store for the fd backend.
+};
+
+// Source reads byte ranges of the file sequentially.
+class Source {
+ public:
+  virtual ~Source() = default;
+  // Read "bytes" bytes. The returned pointer remains valid while "storage"
+  // and the source are alive.
+  virtual const uint8_t* Read(size_t bytes, std::vector<uint8_t>* storage,
+                              size_t storage_off) = 0;
+  virtual Error GetError() = 0;
+};
+
+class FdSource : public Source {
+ public:
+  explicit FdSource(int fd) : fd_(fd) {}
+  ~FdSource() override { close(fd_); }
+
+  const uint8_t* Read(size_t bytes, std::vector<uint8_t>* storage,
+                      size_t storage_off) override {
+    storage->resize(storage_off + bytes);
+    uint8_t* p = storage->data() + storage_off;
+    size_t done = 0;
+    while (done < bytes) {
+      ssize_t n = read(fd_, p + done, bytes - done);
+      if (n < 0) {
+        err_.Set(internal::StrError("read"));
+        return nullptr;
+      }
+      if (n == 0) return nullptr;
+      done += n;
+    }
+    return p;
+  }
+  Error GetError() override { return err_.Err(); }
+
+ private:
+  const int fd_;
+  ErrorReporter err_;
+};
+
+class MmapSource : public Source {
+ public:
+  MmapSource(int fd, size_t size) : size_(size) {
+    if (size_ > 0) {
+      data_ = static_cast<const uint8_t*>(
+          mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0));
+      if (data_ == MAP_FAILED) {
+        err_.Set(internal::StrError("mmap"));
+        data_ = nullptr;
+      } else {
+        madvise(const_cast<uint8_t*>(data_), size_, MADV_SEQUENTIAL);
+      }
+    }
+    close(fd);
+  }
+  ~MmapSource() override {
+    if (data_ != nullptr) munmap(const_cast<uint8_t*>(data_), size_);
+  }
+
+  const uint8_t* Read(size_t bytes, std::vector<uint8_t>* storage,
+                      size_t storage_off) override {
+    if (data_ == nullptr || off_ + bytes > size_) return nullptr;
+    const uint8_t* p = data_ + off_;
+    off_ += bytes;
+    // Touch every page so that the I/O cost is charged to this stage.
+    volatile uint8_t sink = 0;
+    for (size_t i = 0; i < bytes; i += 4096) sink ^= p[i];
+    (void)sink;
+    return p;
+  }
+  Error GetError() override { return err_.Err(); }
+
+ private:
+  const size_t size_;
+  const uint8_t* data_ = nullptr;
+  size_t off_ = 0;
+  ErrorReporter err_;
+};
+
+// Read the next raw block. Returns false on EOF or error. Only the fields
+// needed to find the end of the block are read here; the rest of the framing is
+// checked by Decoder.
+bool ReadRawBlock(Format format, Source* src, RawBlock* b,
+                  ErrorReporter* err) {
+  b->data = internal::ByteSpan(nullptr, 0);
+  if (format == Format::V2) {
+    const uint8_t* p = src->Read(internal::ChunkSize, &b->storage, 0);
+    if (p == nullptr) return false;
+    internal::BinaryParser parser(p + sizeof(Magic) + 12, 8, err);
+    const uint32_t total = parser.ReadLEUint32();
+    const uint32_t index = parser.ReadLEUint32();
+    if (index != 0 || total == 0) {
+      std::ostringstream msg;
+      msg << "Block does not start at a block boundary (chunk " << index
+          << "/" << total << ")";
+      err->Set(msg.str());
+      return false;
+    }
+    // Read one chunk at a time, so that a corrupt chunk count doesn't make the
+    // fd backend allocate more than the file size. Both backends return
+    // consecutive reads contiguously.
+    const bool in_storage = (p == b->storage.data());
+    for (uint32_t i = 1; i < total; i++) {
+      if (src->Read(internal::ChunkSize, &b->storage,
+                    static_cast<size_t>(i) * internal::ChunkSize) == nullptr) {
+        std::ostringstream msg;
+        msg << "Block is truncated after " << i << " chunks, expect " << total;
+        err->Set(msg.str());
+        return false;
+      }
+    }
+    b->data = internal::ByteSpan(in_storage ? b->storage.data() : p,
+                                 static_cast<size_t>(total) *
+                                     internal::ChunkSize);
+    return true;
+  }
+  const uint8_t* h =
+      src->Read(internal::LegacyBlockHeaderSize, &b->storage, 0);
+  if (h == nullptr) return false;
+  internal::BinaryParser parser(h + sizeof(Magic), 8, err);
+  const uint64_t size = parser.ReadLEUint64();
+  if (size > ReaderDefaultMaxReadRecordSize) {
+    std::ostringstream msg;
+    msg << "Unreasonably large block: " << size << " > "
+        << ReaderDefaultMaxReadRecordSize << " bytes";
+    err->Set(msg.str());
+    return false;
+  }
+  const bool in_storage = (h == b->storage.data());
+  if (src->Read(size, &b->storage, internal::LegacyBlockHeaderSize) ==
+      nullptr) {
+    err->Set("Truncated block");
+    return false;
+  }
+  b->data = internal::ByteSpan(in_storage ? b->storage.data() : h,
+                               internal::LegacyBlockHeaderSize + size);
+  return true;
+}
+
+using Clock = std::chrono::steady_clock;
+
+double Since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Per-thread results of the decode stages.
+struct StageStats {
+  double crc_sec = 0;
+  double untransform_sec = 0;
+  double parse_sec = 0;
+  uint64_t blocks = 0;
+  uint64_t items = 0;
+  uint64_t untransformed_bytes = 0;
+  uint64_t item_digest = 0;  // Sum of the items' crc32s, for --verify=full.
+  Histogram item_sizes;
+  Histogram block_sizes;
+};
+
+// Decoder runs the checksum, untransform, and parse stages on raw blocks.
+class Decoder {
+ public:
+  Decoder(Format format, const std::vector<std::string>& transformers,
+          uint64_t fixed_item_size, bool verify_crc, bool digest_items,
+          ErrorReporter* err)
+      : format_(format),
+        fixed_item_size_(fixed_item_size),
+        verify_crc_(verify_crc),
+        digest_items_(digest_items),
+        err_(err) {
+    if (!transformers.empty()) {
+      err_->Set(GetUntransformer(transformers, &untransformer_));
+    }
+  }
+
+  void Decode(const RawBlock& b, StageStats* stats) {
+    auto start = Clock::now();
+    Magic magic;
+    if (format_ == Format::V2) {
+      // The chunk checksums are verified along with the rest of the chunk
+      // framing, as the reader does, so --verify=none doesn't skip them.
+      size_t size;
+      if (!internal::ParseBlock(b.data, &magic, &parts_, &size, err_)) return;
+    } else {
+      memcpy(magic.data(), b.data.data(), sizeof(Magic));
+      const Magic& expected = (format_ == Format::V1_PACKED)
+                                  ? internal::MagicPacked
+                                  : internal::MagicUnpacked;
+      if (magic != expected) {
+        std::ostringstream msg;
+        msg << "Wrong block magic: " << internal::MagicDebugString(magic)
+            << ", expect " << internal::MagicDebugString(expected);
+        err_->Set(msg.str());
+        return;
+      }
+      parts_.assign(1, internal::ByteSpan(
+                           b.data.data() + internal::LegacyBlockHeaderSize,
+                           b.data.size() - internal::LegacyBlockHeaderSize));
+      // The packed payload starts with the crc32 of the item table.
+      if (format_ == Format::V1_PACKED && parts_[0].size() < 4) {
+        std::ostringstream msg;
+        msg << "Packed block is too short: " << parts_[0].size() << " bytes";
+        err_->Set(msg.str());
+        return;
+      }
+      if (verify_crc_) VerifyCrc(b.data);
+      if (!err_->Ok()) return;
+    }
+    stats->crc_sec += Since(start);
+    if (format_ == Format::V2 && magic != internal::MagicPacked) {
+      return;  // header, trailer.
+    }
+    stats->blocks++;
+    stats->block_sizes.Add(b.data.size());
+
+    // The V1 packed item table is not transformed.
+    internal::IoVec raw(&parts_);
+    internal::ByteSpan table;
+    internal::ByteSpan v1_items;
+    if (format_ == Format::V1_PACKED) {
+      const internal::ByteSpan payload = parts_[0];
+      internal::BinaryParser p(payload.data() + 4, payload.size() - 4, err_);
+      const uint8_t* table_start = p.Data();
+      const uint64_t n = p.ReadUVarint();
+      for (uint64_t i = 0; i < n && err_->Ok(); i++) p.ReadUVarint();
+      if (!err_->Ok()) return;
+      table = internal::ByteSpan(table_start, p.Data() - table_start);
+      v1_items = internal::ByteSpan(
+          p.Data(), payload.data() + payload.size() - p.Data());
+      raw = internal::IoVec(&v1_items, 1);
+    }
+
+    start = Clock::now();
+    internal::IoVec iov = raw;
+    if (untransformer_ != nullptr) {
+      err_->Set(untransformer_->Transform(raw, &iov));
+    }
+    if (iov.size() > 1) {
+      flat_ = internal::IoVecFlatten(iov);
+      flat_span_ = internal::ByteSpan(&flat_);
+      iov = internal::IoVec(&flat_span_, 1);
+    }
+    stats->untransform_sec += Since(start);
+    stats->untransformed_bytes += internal::IoVecSize(iov);
+    if (!err_->Ok()) return;
+
+    start = Clock::now();
+    if (format_ == Format::V1_UNPACKED) {
+      stats->items++;
+      stats->item_sizes.Add(internal::IoVecSize(iov));
+    } else {
+      if (format_ == Format::V1_PACKED) {
+        ParseTable(table, stats);
+      } else if (iov.size() > 0) {
+        ParseTable(iov[0], stats);
+      }
+    }
+    stats->parse_sec += Since(start);
+
+    if (!digest_items_ || !err_->Ok()) return;
+    if (format_ == Format::V1_UNPACKED) {
+      const internal::ByteSpan item =
+          iov.size() > 0 ? iov[0] : internal::ByteSpan(nullptr, 0);
+      stats->item_digest += internal::Crc32(item.data(), item.size());
+    } else if (format_ == Format::V1_PACKED) {
+      const internal::ByteSpan items =
+          iov.size() > 0 ? iov[0] : internal::ByteSpan(nullptr, 0);
+      DigestItems(table, items.data(), items.data() + items.size(), stats);
+    } else if (iov.size() > 0) {
+      DigestItems(iov[0], nullptr, iov[0].data() + iov[0].size(), stats);
+    }
+  }
+
+ private:
+  // Verify the checksums of the V1 block stored in "data".
+  void VerifyCrc(internal::ByteSpan data) {
+    const uint8_t* h = data.data();
+    uint32_t expected;
+    memcpy(&expected, h + sizeof(Magic) + 8, sizeof expected);
+    if (le32toh(expected) != internal::Crc32(h + sizeof(Magic), 8)) {
+      err_->Set("Block header checksum mismatch");
+      return;
+    }
+    if (format_ == Format::V1_PACKED) {
+      internal::BinaryParser p(h + internal::LegacyBlockHeaderSize,
+                               data.size() - internal::LegacyBlockHeaderSize,
+                               err_);
+      const uint32_t expected_table = p.ReadLEUint32();
+      const uint8_t* start = p.Data();
+      const uint64_t n = p.ReadUVarint();
+      for (uint64_t i = 0; i < n && err_->Ok(); i++) p.ReadUVarint();
+      if (!err_->Ok()) return;
+      if (expected_table != internal::Crc32(start, p.Data() - start)) {
+        err_->Set("Packed block checksum mismatch");
+      }
+    }
+  }
+
+  // Parse the item count and sizes at the beginning of "data".
+  void ParseTable(internal::ByteSpan data, StageStats* stats) {
+    internal::BinaryParser p(data.data(), data.size(), err_);
+    const uint64_t n = p.ReadUVarint();
+    if (fixed_item_size_ > 0) {
+      stats->items += n;
+      for (uint64_t i = 0; i < n; i++) stats->item_sizes.Add(fixed_item_size_);
+      return;
+    }
+    for (uint64_t i = 0; i < n && err_->Ok(); i++) {
+      stats->item_sizes.Add(p.ReadUVarint());
+    }
+    stats->items += n;
+  }
+
+  // Add the crc32 of every item in [items, limit) to stats->item_digest.
+  // "table" starts with the item count and sizes. If items is null, the items
+  // follow the table.
+  void DigestItems(internal::ByteSpan table, const uint8_t* items,
+                   const uint8_t* limit, StageStats* stats) {
+    internal::BinaryParser p(table.data(), table.size(), err_);
+    const uint64_t n = p.ReadUVarint();
+    sizes_.clear();
+    for (uint64_t i = 0; i < n && err_->Ok(); i++) {
+      sizes_.push_back(fixed_item_size_ > 0 ? fixed_item_size_
+                                            : p.ReadUVarint());
+    }
+    if (!err_->Ok()) return;
+    if (items == nullptr) items = p.Data();
+    for (const uint64_t size : sizes_) {
+      if (size > static_cast<uint64_t>(limit - items)) {
+        err_->Set("Item sizes exceed the block");
+        return;
+      }
+      stats->item_digest += internal::Crc32(items, size);
+      items += size;
+    }
+  }
+
+  const Format format_;
+  const uint64_t fixed_item_size_;
+  const bool verify_crc_;
+  const bool digest_items_;
+  ErrorReporter* const err_;
+  std::unique_ptr<Transformer> untransformer_;
+  std::vector<uint8_t> flat_;
+  internal::ByteSpan flat_span_;
+  std::vector<internal::ByteSpan> parts_;  // The block payloads.
+  std::vector<uint64_t> sizes_;  // For DigestItems.
+};
+
+void Usage() {
+  std::cerr << "Usage: rio_bench [--threads=N] [--verify=none|crc|full] "
+               "[--backend=fd|mmap] path\n";
+  exit(2);
+}
+
+Flags ParseFlags(int argc, char** argv) {
+  Flags f;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    auto value = [&arg](const std::string& prefix, std::string* v) {
+      if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+      *v = arg.substr(prefix.size());
+      return true;
+    };
+    std::string v;
+    if (value("--threads=", &v)) {
+      f.threads = std::max(1, atoi(v.c_str()));
+    } else if (value("--verify=", &v)) {
+      if (v != "none" && v != "crc" && v != "full") Usage();
+      f.verify = v;
+    } else if (value("--backend=", &v)) {
+      if (v != "fd" && v != "mmap") Usage();
+      f.backend = v;
+    } else if (arg.compare(0, 2, "--") == 0 || !f.path.empty()) {
+      Usage();
+    } else {
+      f.path = arg;
+    }
+  }
+  if (f.path.empty()) Usage();
+  return f;
+}
+
+std::unique_ptr<Source> OpenSource(const Flags& flags, uint64_t* file_size,
+                                   ErrorReporter* err) {
+  int fd = open(flags.path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    err->Set(internal::StrError("open " + flags.path));
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    err->Set(internal::StrError("stat " + flags.path));
+    close(fd);
+    return nullptr;
+  }
+  *file_size = st.st_size;
+  if (flags.backend == "mmap") {
+    return std::unique_ptr<Source>(new MmapSource(fd, st.st_size));
+  }
+  return std::unique_ptr<Source>(new FdSource(fd));
+}
+
+void PrintStage(const std::string& name, double sec, uint64_t bytes) {
+  char buf[128];
+  snprintf(buf, sizeof buf, "  %-12s %10.3f s %10.1f MB/s\n", name.c_str(),
+           sec, sec > 0 ? bytes / sec / 1e6 : 0.0);
+  std::cout << buf;
+}
+
+// Read the file through the public API, and compare the item count and
+// digest with those of the raw pipeline.
+void VerifyFull(const Flags& flags, const StageStats& expected,
+                ErrorReporter* err) {
+  const auto start = Clock::now();
+  auto r = NewReader(flags.path);
+  uint64_t n = 0, bytes = 0, digest = 0;
+  while (r->Scan()) {
+    const ByteSpan item = r->Get();
+    n++;
+    bytes += item.size();
+    digest += internal::Crc32(item.data(), item.size());
+  }
+  err->Set(r->GetError());
+  if (n != expected.items) {
+    std::ostringstream msg;
+    msg << "Reader returned " << n << " items, expect " << expected.items;
+    err->Set(msg.str());
+  } else if (digest != expected.item_digest) {
+    err->Set("Reader returned different item contents");
+  }
+  PrintStage("reader", Since(start), bytes);
+}
+
+int Run(const Flags& flags) {
+  ErrorReporter err;
+  uint64_t file_size = 0;
+  auto src = OpenSource(flags, &file_size, &err);
+  if (src == nullptr) {
+    std::cerr << err.Err() << "\n";
+    return 1;
+  }
+
+  // Sniff the format.
+  Format format = Format::UNKNOWN;
+  std::vector<std::string> transformers;
+  std::vector<HeaderEntry> header;
+  uint64_t fixed_item_size = 0;
+  {
+    auto r = NewReader(flags.path);
+    header = r->Header();
+    err.Set(r->GetError());
+    int fd = open(flags.path.c_str(), O_RDONLY);
+    Magic magic = internal::MagicInvalid;
+    if (fd >= 0) {
+      if (read(fd, magic.data(), magic.size()) != ssize_t(magic.size())) {
+        err.Set("Failed to read the magic number");
+      }
+      close(fd);
+    }
+    if (magic == internal::MagicUnpacked) {
+      format = Format::V1_UNPACKED;
+    } else if (magic == internal::MagicPacked) {
+      format = Format::V1_PACKED;
+    } else if (magic == internal::MagicHeader) {
+      format = Format::V2;
+    }
+    if (format == Format::V2) {
+      for (const auto& e : header) {
+        if (e.key == kKeyTransformer) transformers.push_back(e.value.s);
+      }
+      err.Set(internal::GetFixedItemSize(header, &fixed_item_size));
+    } else if (internal::HasSuffix(flags.path, ".grail-rpk-gz")) {
+      transformers.push_back("flate");
+    }
+  }
+  if (format == Format::UNKNOWN) err.Set("Unknown file format");
+  if (!err.Ok()) {
+    std::cerr << flags.path << ": " << err.Err() << "\n";
+    return 1;
+  }
+
+  std::cout << "file: " << flags.path << " (" << file_size << " bytes)\n";
+  std::cout << "format: "
+            << (format == Format::V2
+                    ? "V2 packed"
+                    : format == Format::V1_PACKED ? "V1 packed" : "V1 unpacked")
+            << "\n";
+  std::cout << "transformer:";
+  if (transformers.empty()) std::cout << " none";
+  for (const auto& t : transformers) std::cout << " " << t;
+  std::cout << "\n";
+  if (!header.empty()) {
+    std::cout << "header:\n";
+    for (const auto& e : header) {
+      std::cout << "  " << e.key << " = ";
+      switch (e.value.type) {
+        case HeaderValue::BOOL:
+          std::cout << (e.value.b ? "true" : "false");
+          break;
+        case HeaderValue::INT:
+          std::cout << e.value.i;
+          break;
+        case HeaderValue::UINT:
+          std::cout << e.value.u;
+          break;
+        case HeaderValue::STRING:
+          std::cout << "\"" << e.value.s << "\"";
+          break;
+        default:
+          std::cout << "?";
+      }
+      std::cout << "\n";
+    }
+  }
+
+  // Read raw blocks in batches, and decode each batch on flags.threads
+  // threads.
+  const bool verify_crc = flags.verify != "none";
+  const size_t batch_size = 16 * flags.threads;
+  std::vector<std::unique_ptr<Decoder>> decoders;
+  std::vector<ErrorReporter> errs(flags.threads);
+  std::vector<StageStats> stats(flags.threads);
+  for (int i = 0; i < flags.threads; i++) {
+    decoders.emplace_back(new Decoder(format, transformers, fixed_item_size,
+                                      verify_crc, flags.verify == "full",
+                                      &errs[i]));
+  }
+  std::vector<RawBlock> batch(batch_size);
+  double io_sec = 0, decode_wall_sec = 0;
+  uint64_t raw_bytes = 0;
+  for (bool eof = false; !eof && err.Ok();) {
+    size_t n = 0;
+    auto start = Clock::now();
+    while (n < batch_size) {
+      if (!ReadRawBlock(format, src.get(), &batch[n], &err)) {
+        eof = true;
+        break;
+      }
+      raw_bytes += batch[n].data.size();
+      n++;
+    }
+    io_sec += Since(start);
+
+    start = Clock::now();
+    std::atomic<size_t> next(0);
+    auto work = [&](int t) {
+      for (size_t i = next++; i < n && errs[t].Ok(); i = next++) {
+        decoders[t]->Decode(batch[i], &stats[t]);
+      }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < flags.threads; t++) threads.emplace_back(work, t);
+    work(0);
+    for (auto& t : threads) t.join();
+    decode_wall_sec += Since(start);
+    for (auto& e : errs) err.Set(e.Err());
+  }
+  err.Set(src->GetError());
+
+  StageStats total;
+  for (const auto& s : stats) {
+    total.crc_sec += s.crc_sec / flags.threads;
+    total.untransform_sec += s.untransform_sec / flags.threads;
+    total.parse_sec += s.parse_sec / flags.threads;
+    total.blocks += s.blocks;
+    total.items += s.items;
+    total.untransformed_bytes += s.untransformed_bytes;
+    total.item_digest += s.item_digest;
+    total.item_sizes.Merge(s.item_sizes);
+    total.block_sizes.Merge(s.block_sizes);
+  }
+
+  std::cout << "blocks: " << total.blocks << "\n";
+  std::cout << "items: " << total.items << "\n";
+  std::cout << "untransformed bytes: " << total.untransformed_bytes << "\n";
+  total.block_sizes.Print("block size histogram (bytes in file)");
+  total.item_sizes.Print("item size histogram (bytes)");
+  std::cout << "throughput (" << flags.backend << ", " << flags.threads
+            << " threads):\n";
+  PrintStage("raw-io", io_sec, raw_bytes);
+  if (verify_crc || format == Format::V2) {
+    PrintStage("crc", total.crc_sec, raw_bytes);
+  }
+  PrintStage("untransform", total.untransform_sec, raw_bytes);
+  PrintStage("parse", total.parse_sec, total.untransformed_bytes);
+  PrintStage("decode-wall", decode_wall_sec, raw_bytes);
+  if (flags.verify == "full" && err.Ok()) {
+    VerifyFull(flags, total, &err);
+  }
+  if (!err.Ok()) {
+    std::cerr << flags.path << ": " << err.Err() << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace recordio
+}  // namespace grail
+
+int main(int argc, char** argv) {
+  return grail::recordio::Run(grail::recordio::ParseFlags(argc, argv));
+}
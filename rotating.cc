@@ -0,0 +1,199 @@
+// This file implements NewRotatingWriter.
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "./internal.h"
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Writer that rotates over files. Files are opened and closed by a background
+// thread, so Write() only swaps pointers at a rollover.
+class RotatingWriterImpl : public Writer {
+ public:
+  RotatingWriterImpl(const std::string& pattern, size_t placeholder,
+                     int64_t max_bytes, Clock::duration max_age,
+                     std::function<WriterOpts(const std::string& path)> opts)
+      : prefix_(pattern.substr(0, placeholder)),
+        suffix_(pattern.substr(placeholder + 2)),
+        max_bytes_(max_bytes),
+        max_age_(max_age),
+        opts_(std::move(opts)) {
+    current_ = OpenFile(0);
+    err_.Set(current_->GetError());
+    start_ = Clock::now();
+    next_index_ = 1;
+    worker_ = std::thread([this]() { Run(); });
+  }
+
+  ~RotatingWriterImpl() { Close(); }
+
+  bool Write(ByteSpan item) {
+    if (!Reserve(item.size())) return false;
+    if (!current_->Write(item)) return false;
+    bytes_ += item.size();
+    return true;
+  }
+
+  bool WriteWith(size_t size,
+                 const std::function<bool(uint8_t* buf)>& fill) override {
+    if (!Reserve(size)) return false;
+    if (!current_->WriteWith(size, fill)) return false;
+    bytes_ += size;
+    return true;
+  }
+
+  bool Close() {
+    if (closed_) return Ok();
+    closed_ = true;
+    {
+      std::unique_lock<std::mutex> l(mu_);
+      stop_ = true;
+      cond_.notify_all();
+    }
+    worker_.join();
+    if (!current_->Close()) SetError(current_->GetError());
+    current_.reset();
+    if (next_ != nullptr) {
+      // The successor was never written to. Discard it.
+      next_->Close();
+      next_.reset();
+      remove(Path(next_index_).c_str());
+    }
+    return Ok();
+  }
+
+  Error GetError() {
+    std::unique_lock<std::mutex> l(mu_);
+    if (!err_.Ok()) return err_.Err();
+    return current_ != nullptr ? current_->GetError() : "";
+  }
+
+ private:
+  std::string Path(int index) const {
+    std::ostringstream path;
+    path << prefix_ << index << suffix_;
+    return path.str();
+  }
+
+  std::unique_ptr<Writer> OpenFile(int index) {
+    const std::string path = Path(index);
+    return NewWriter(path, opts_(path));
+  }
+
+  bool Ok() {
+    std::unique_lock<std::mutex> l(mu_);
+    return err_.Ok();
+  }
+
+  void SetError(const Error& err) {
+    std::unique_lock<std::mutex> l(mu_);
+    err_.Set(err);
+  }
+
+  // Switch to the next file if adding "size" bytes to the current file would
+  // exceed the limits.
+  bool Reserve(size_t size) {
+    if (closed_) {
+      SetError("Write after Close");
+      return false;
+    }
+    if (bytes_ == 0) return Ok();
+    const bool full = max_bytes_ > 0 &&
+                      bytes_ + static_cast<int64_t>(size) > max_bytes_;
+    const bool old =
+        max_age_ > Clock::duration::zero() && Clock::now() - start_ >= max_age_;
+    if (!full && !old) return Ok();
+
+    std::unique_lock<std::mutex> l(mu_);
+    closing_.push_back(std::move(current_));
+    cond_.notify_all();
+    // The successor is normally ready long before it is needed.
+    cond_.wait(l, [this]() { return next_ != nullptr; });
+    current_ = std::move(next_);
+    next_index_++;
+    cond_.notify_all();
+    err_.Set(current_->GetError());
+    start_ = Clock::now();
+    bytes_ = 0;
+    return err_.Ok();
+  }
+
+  // Body of the background thread. It keeps a successor file open, and closes
+  // the files that have been rotated out.
+  void Run() {
+    std::unique_lock<std::mutex> l(mu_);
+    for (;;) {
+      if (!stop_ && next_ == nullptr) {
+        const int index = next_index_;
+        l.unlock();
+        std::unique_ptr<Writer> w = OpenFile(index);
+        l.lock();
+        next_ = std::move(w);
+        cond_.notify_all();
+        continue;
+      }
+      if (!closing_.empty()) {
+        std::unique_ptr<Writer> w = std::move(closing_.front());
+        closing_.pop_front();
+        l.unlock();
+        w->Close();
+        const Error err = w->GetError();
+        w.reset();
+        l.lock();
+        err_.Set(err);
+        continue;
+      }
+      if (stop_) return;
+      cond_.wait(l);
+    }
+  }
+
+  const std::string prefix_;  // Part of the pattern before "%d".
+  const std::string suffix_;  // Part of the pattern after "%d".
+  const int64_t max_bytes_;
+  const Clock::duration max_age_;
+  const std::function<WriterOpts(const std::string& path)> opts_;
+
+  // Accessed only by the caller thread.
+  std::unique_ptr<Writer> current_;
+  int64_t bytes_ = 0;        // Bytes written to current_.
+  Clock::time_point start_;  // When current_ became the current file.
+  bool closed_ = false;
+
+  std::mutex mu_;
+  std::condition_variable cond_;
+  // Guarded by mu_.
+  internal::ErrorReporter err_;
+  std::unique_ptr<Writer> next_;  // The pre-opened successor, if ready.
+  int next_index_ = 0;            // File index of the successor.
+  std::deque<std::unique_ptr<Writer>> closing_;  // Files to close.
+  bool stop_ = false;
+
+  std::thread worker_;
+};
+
+}  // namespace
+
+std::unique_ptr<Writer> NewRotatingWriter(
+    const std::string& pattern, int64_t max_bytes, Clock::duration max_age,
+    std::function<WriterOpts(const std::string& path)> opts) {
+  const size_t placeholder = pattern.find("%d");
+  if (placeholder == std::string::npos) {
+    return internal::NewErrorWriter("Rotating writer pattern " + pattern +
+                                    " does not contain %d");
+  }
+  return std::unique_ptr<Writer>(new RotatingWriterImpl(
+      pattern, placeholder, max_bytes, max_age, std::move(opts)));
+}
+
+}  // namespace recordio
+}  // namespace grail
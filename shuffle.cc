@@ -0,0 +1,255 @@
+// This file implements NewShuffleReader.
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "./block.h"
+#include "./chunk.h"
+#include "./header.h"
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+namespace {
+
+using internal::Block;
+using internal::ErrorReporter;
+using internal::Magic;
+
+// Location of a data block.
+struct BlockRef {
+  int file;  // Index into ShuffleReaderImpl::files_.
+  int64_t offset;
+  int64_t size;
+};
+
+// An item in the shuffle buffer.
+struct Entry {
+  std::shared_ptr<const Block> block;
+  int index = 0;
+};
+
+class ShuffleReaderImpl : public ShuffleReader {
+ public:
+  ShuffleReaderImpl(const std::vector<std::string>& paths, size_t buffer_items,
+                    uint64_t seed, int prefetch_threads)
+      : buffer_items_(std::max<size_t>(1, buffer_items)), rng_(seed) {
+    for (const auto& path : paths) {
+      if (!AddFile(path)) {
+        blocks_.clear();
+        return;
+      }
+    }
+    std::shuffle(blocks_.begin(), blocks_.end(), rng_);
+    decoded_.resize(blocks_.size());
+    ready_.resize(blocks_.size());
+
+    int n_threads = prefetch_threads;
+    if (n_threads <= 0) {
+      n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    n_threads = std::min<size_t>(n_threads, blocks_.size());
+    lookahead_ = 2 * n_threads;
+    for (int i = 0; i < n_threads; i++) {
+      threads_.emplace_back([this]() { Prefetch(); });
+    }
+  }
+
+  ~ShuffleReaderImpl() {
+    {
+      std::unique_lock<std::mutex> l(mu_);
+      stop_ = true;
+      cond_.notify_all();
+    }
+    for (auto& t : threads_) t.join();
+    for (const auto& f : files_) close(f.fd);
+  }
+
+  bool Scan() override {
+    cur_.block.reset();
+    while (buffer_.size() < buffer_items_ && next_block_ < blocks_.size()) {
+      std::shared_ptr<const Block> block = WaitBlock(next_block_++);
+      if (block == nullptr) return false;
+      for (int i = 0; i < block->size(); i++) {
+        buffer_.push_back(Entry{block, i});
+      }
+    }
+    if (buffer_.empty()) return false;
+    std::uniform_int_distribution<size_t> pick(0, buffer_.size() - 1);
+    std::swap(buffer_[pick(rng_)], buffer_.back());
+    cur_ = std::move(buffer_.back());
+    buffer_.pop_back();
+    return true;
+  }
+
+  ByteSpan Get() override { return cur_.block->Item(cur_.index); }
+
+  Error GetError() override {
+    std::unique_lock<std::mutex> l(mu_);
+    return err_.Err();
+  }
+
+ private:
+  struct File {
+    std::string path;
+    int fd;
+    std::vector<std::string> transformers;
+    uint64_t fixed_item_size;
+  };
+
+  // Read the header of "path", and add its data blocks to blocks_.
+  bool AddFile(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      err_.Set(internal::StrError("open " + path));
+      return false;
+    }
+    files_.push_back(File{path, fd, {}, 0});
+    File* f = &files_.back();
+
+    auto r = NewRawBlockReaderFromDescriptor(dup(fd));
+    if (!r->Scan() || r->GetMagic() != internal::MagicHeader) {
+      err_.Set(r->GetError());
+      err_.Set(path + ": ShuffleReader supports only V2 files");
+      return false;
+    }
+    std::vector<HeaderEntry> header;
+    ErrorReporter header_err;
+    if (!internal::ParseHeaderBlock(r->Get(), &header, &f->transformers,
+                                    &f->fixed_item_size, &header_err)) {
+      err_.Set(path + ": " + header_err.Err());
+      return false;
+    }
+
+    while (err_.Ok() && r->Scan()) {
+      const Magic block_magic = r->GetMagic();
+      if (block_magic == internal::MagicPacked) {
+        blocks_.push_back(BlockRef{static_cast<int>(files_.size() - 1),
+                                   r->Offset(), r->Size()});
+      } else if (block_magic != internal::MagicTrailer) {
+        std::ostringstream msg;
+        msg << path << ": Bad magic at offset " << r->Offset() << ": "
+            << internal::MagicDebugString(block_magic);
+        err_.Set(msg.str());
+      }
+    }
+    err_.Set(r->GetError());
+    return err_.Ok();
+  }
+
+  // Wait until block i is decoded and return it. Returns null on error.
+  std::shared_ptr<const Block> WaitBlock(size_t i) {
+    std::unique_lock<std::mutex> l(mu_);
+    cond_.wait(l, [this, i]() { return ready_[i] || !err_.Ok(); });
+    if (!err_.Ok()) return nullptr;
+    consumed_ = i + 1;
+    cond_.notify_all();
+    return std::move(decoded_[i]);
+  }
+
+  // Body of a prefetch thread. It reads and decodes the blocks in the shuffled
+  // order, up to lookahead_ blocks ahead of the consumer.
+  void Prefetch() {
+    std::unique_ptr<Transformer> tr;
+    int tr_file = -1;  // The file for which "tr" was created.
+    std::vector<uint8_t> buf;
+    std::vector<ByteSpan> payloads;
+    ErrorReporter err;
+    for (;;) {
+      size_t i;
+      {
+        std::unique_lock<std::mutex> l(mu_);
+        cond_.wait(l, [this]() {
+          return stop_ || next_fetch_ >= blocks_.size() ||
+                 next_fetch_ < consumed_ + lookahead_;
+        });
+        if (stop_ || next_fetch_ >= blocks_.size() || !err_.Ok()) return;
+        i = next_fetch_++;
+      }
+      const BlockRef& ref = blocks_[i];
+      const File& f = files_[ref.file];
+      std::shared_ptr<Block> block(new Block);
+      if (Pread(f, ref, &buf, &err)) {
+        if (tr_file != ref.file) {
+          err.Set(GetUntransformer(f.transformers, &tr));
+          tr_file = ref.file;
+        }
+        Magic magic;
+        size_t size;
+        if (err.Ok() && internal::ParseBlock(ByteSpan(&buf), &magic, &payloads,
+                                             &size, &err)) {
+          block->Parse(IoVec(&payloads), tr.get(), f.fixed_item_size, &err);
+        }
+      }
+      std::unique_lock<std::mutex> l(mu_);
+      if (!err.Ok()) {
+        err_.Set(f.path + ": " + err.Err());
+        cond_.notify_all();
+        return;
+      }
+      decoded_[i] = std::move(block);
+      ready_[i] = true;
+      cond_.notify_all();
+    }
+  }
+
+  static bool Pread(const File& f, const BlockRef& ref,
+                    std::vector<uint8_t>* buf, ErrorReporter* err) {
+    buf->resize(ref.size);
+    size_t done = 0;
+    while (done < buf->size()) {
+      const ssize_t n = pread(f.fd, buf->data() + done, buf->size() - done,
+                              ref.offset + done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        err->Set(n == 0 ? "Unexpected EOF" : internal::StrError("pread"));
+        return false;
+      }
+      done += n;
+    }
+    return true;
+  }
+
+  const size_t buffer_items_;
+  std::mt19937_64 rng_;
+  std::vector<File> files_;
+  std::vector<BlockRef> blocks_;  // Data blocks, in the order of visiting.
+
+  // Accessed only by the caller thread.
+  std::vector<Entry> buffer_;  // The shuffle buffer.
+  Entry cur_;                  // The current record.
+  size_t next_block_ = 0;      // The next block to move into buffer_.
+
+  std::mutex mu_;
+  std::condition_variable cond_;
+  // Guarded by mu_.
+  ErrorReporter err_;
+  std::vector<std::shared_ptr<const Block>> decoded_;  // Indexed as blocks_.
+  std::vector<bool> ready_;  // ready_[i] is true if decoded_[i] is set.
+  size_t next_fetch_ = 0;    // The next block to be read by a prefetcher.
+  size_t consumed_ = 0;      // Blocks [0, consumed_) have been consumed.
+  size_t lookahead_ = 0;
+  bool stop_ = false;
+
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace
+
+std::unique_ptr<ShuffleReader> NewShuffleReader(
+    const std::vector<std::string>& paths, size_t buffer_items, uint64_t seed,
+    int prefetch_threads) {
+  return std::unique_ptr<ShuffleReader>(
+      new ShuffleReaderImpl(paths, buffer_items, seed, prefetch_threads));
+}
+
+}  // namespace recordio
+}  // namespace grail
@@ -0,0 +1,284 @@
+// This file implements NewTeeWriter.
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <streambuf>
+#include <thread>
+
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+namespace {
+
+// Encoded bytes are handed to the sinks in pieces of about this size.
+constexpr size_t PieceBytes = 1 << 20;
+
+// An entry in a sink's queue: either a piece of the encoded stream, or, if
+// data is null, a request to index the block at index_offset.
+struct Piece {
+  std::shared_ptr<const std::vector<uint8_t>> data;
+  uint64_t index_offset = 0;
+};
+
+// Streambuf that copies everything written to it to every sink. Each sink has
+// a queue of pieces, drained by its own thread. The pieces are shared by the
+// sinks, so the data is not copied per sink.
+class TeeOutputBuf : public std::streambuf {
+ public:
+  TeeOutputBuf(std::vector<TeeSink> sinks, int64_t max_buffered_bytes)
+      : max_buffered_bytes_(max_buffered_bytes), sinks_(sinks.size()) {
+    for (size_t i = 0; i < sinks.size(); i++) {
+      Sink* s = &sinks_[i];
+      s->out = sinks[i].out;
+      s->indexer = std::move(sinks[i].indexer);
+      if (s->indexer != nullptr) has_indexer_ = true;
+    }
+    for (auto& s : sinks_) {
+      Sink* sp = &s;
+      s.thread = std::thread([this, sp]() { Run(sp); });
+    }
+  }
+
+  ~TeeOutputBuf() { Close(); }
+
+  // Queue a request to index the block that starts at "offset". It is sent
+  // to the sinks after the bytes written so far.
+  void IndexBlock(uint64_t offset) {
+    if (!has_indexer_) return;
+    Publish();
+    Piece p;
+    p.index_offset = offset;
+    Push(p, 0);
+  }
+
+  // Flush the pending bytes to the sinks, and wait for the sink threads to
+  // finish. Returns the first error seen by any sink.
+  Error Close() {
+    if (closed_) return Err();
+    closed_ = true;
+    Publish();
+    {
+      std::unique_lock<std::mutex> l(mu_);
+      stop_ = true;
+      cond_.notify_all();
+    }
+    for (auto& s : sinks_) s.thread.join();
+    std::unique_lock<std::mutex> l(mu_);
+    for (size_t i = 0; i < sinks_.size(); i++) {
+      Sink* s = &sinks_[i];
+      if (!s->failed) {
+        s->out->flush();
+        if (!s->out->good()) SetSinkError(i, "Failed to flush");
+      }
+    }
+    return err_.Err();
+  }
+
+  Error Err() {
+    std::unique_lock<std::mutex> l(mu_);
+    return err_.Err();
+  }
+
+ protected:
+  std::streamsize xsputn(const char* data, std::streamsize size) override {
+    if (closed_ || !Ok()) return 0;
+    if (cur_ == nullptr) cur_.reset(new std::vector<uint8_t>);
+    cur_->insert(cur_->end(), data, data + size);
+    pos_ += size;
+    if (cur_->size() >= PieceBytes && !Publish()) return 0;
+    return size;
+  }
+
+  int_type overflow(int_type ch) override {
+    if (traits_type::eq_int_type(ch, traits_type::eof())) return 0;
+    const char c = traits_type::to_char_type(ch);
+    return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+  }
+
+  int sync() override { return Publish() ? 0 : -1; }
+
+  // Supports only tellp(), which the writers use to compute block offsets.
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override {
+    if (off != 0 || dir != std::ios_base::cur ||
+        (which & std::ios_base::out) == 0) {
+      return pos_type(off_type(-1));
+    }
+    return pos_type(pos_);
+  }
+
+ private:
+  struct Sink {
+    std::ostream* out = nullptr;
+    std::unique_ptr<WriterIndexer> indexer;
+    std::thread thread;
+    // Guarded by TeeOutputBuf::mu_.
+    std::deque<Piece> queue;
+    int64_t queued_bytes = 0;  // Bytes in queue, including the one in flight.
+    bool failed = false;
+  };
+
+  bool Ok() {
+    std::unique_lock<std::mutex> l(mu_);
+    return err_.Ok();
+  }
+
+  // Hand the bytes written since the last call to the sinks.
+  bool Publish() {
+    if (cur_ == nullptr || cur_->empty()) return Ok();
+    Piece p;
+    p.data = std::move(cur_);
+    cur_.reset();
+    return Push(p, p.data->size());
+  }
+
+  // Append "p" to the queue of every sink. Blocks while a sink has more than
+  // max_buffered_bytes_ queued.
+  bool Push(const Piece& p, int64_t bytes) {
+    std::unique_lock<std::mutex> l(mu_);
+    cond_.wait(l, [this, bytes]() {
+      if (!err_.Ok()) return true;
+      for (const auto& s : sinks_) {
+        if (s.queued_bytes > 0 &&
+            s.queued_bytes + bytes > max_buffered_bytes_) {
+          return false;
+        }
+      }
+      return true;
+    });
+    if (!err_.Ok()) return false;
+    for (auto& s : sinks_) {
+      s.queue.push_back(p);
+      s.queued_bytes += bytes;
+    }
+    cond_.notify_all();
+    return true;
+  }
+
+  // REQUIRES: mu_ is held.
+  void SetSinkError(size_t i, const std::string& err) {
+    std::ostringstream msg;
+    msg << "tee sink " << i << ": " << err;
+    err_.Set(msg.str());
+    sinks_[i].failed = true;
+  }
+
+  // Body of the thread of sink "s". It writes the queued pieces to s->out, and
+  // calls s->indexer for the index requests.
+  void Run(Sink* s) {
+    const size_t index = s - sinks_.data();
+    std::unique_lock<std::mutex> l(mu_);
+    for (;;) {
+      cond_.wait(l, [this, s]() { return stop_ || !s->queue.empty(); });
+      if (s->queue.empty()) return;
+      const Piece p = s->queue.front();
+      const bool failed = s->failed;
+      l.unlock();
+      Error err;
+      if (failed) {
+        // Drain the queue so that the writer doesn't block.
+      } else if (p.data != nullptr) {
+        s->out->write(reinterpret_cast<const char*>(p.data->data()),
+                      p.data->size());
+        if (!s->out->good()) {
+          err = std::string("Failed to write: ") + std::strerror(errno);
+        }
+      } else {
+        err = s->indexer->IndexBlock(p.index_offset);
+        if (!err.empty()) err = "Indexer error: " + err;
+      }
+      l.lock();
+      if (!err.empty()) SetSinkError(index, err);
+      s->queue.pop_front();
+      if (p.data != nullptr) s->queued_bytes -= p.data->size();
+      cond_.notify_all();
+    }
+  }
+
+  const int64_t max_buffered_bytes_;
+  std::vector<Sink> sinks_;
+  bool has_indexer_ = false;  // Some sink has an indexer.
+
+  // Accessed only by the writer thread.
+  std::shared_ptr<std::vector<uint8_t>> cur_;  // Bytes not yet published.
+  int64_t pos_ = 0;  // Bytes written to the stream.
+  bool closed_ = false;
+
+  std::mutex mu_;
+  std::condition_variable cond_;
+  // Guarded by mu_.
+  internal::ErrorReporter err_;
+  bool stop_ = false;
+};
+
+// Indexer of the underlying writer. It forwards the block offsets to the
+// sinks, and to the indexer of the caller's WriterOpts.
+class TeeIndexer : public WriterIndexer {
+ public:
+  TeeIndexer(TeeOutputBuf* buf, std::unique_ptr<WriterIndexer> indexer)
+      : buf_(buf), indexer_(std::move(indexer)) {}
+
+  Error IndexBlock(uint64_t start_offset) override {
+    buf_->IndexBlock(start_offset);
+    return indexer_ != nullptr ? indexer_->IndexBlock(start_offset) : "";
+  }
+
+ private:
+  TeeOutputBuf* const buf_;
+  const std::unique_ptr<WriterIndexer> indexer_;
+};
+
+class TeeWriterImpl : public Writer {
+ public:
+  TeeWriterImpl(std::vector<TeeSink> sinks, WriterOpts opts,
+                int64_t max_buffered_bytes)
+      : buf_(std::move(sinks), max_buffered_bytes), out_(&buf_) {
+    opts.indexer.reset(new TeeIndexer(&buf_, std::move(opts.indexer)));
+    w_ = NewWriter(&out_, std::move(opts));
+  }
+
+  ~TeeWriterImpl() { Close(); }
+
+  bool Write(ByteSpan item) { return w_->Write(item); }
+
+  bool WriteWith(size_t size,
+                 const std::function<bool(uint8_t* buf)>& fill) override {
+    return w_->WriteWith(size, fill);
+  }
+
+  bool Close() {
+    if (closed_) return GetError().empty();
+    closed_ = true;
+    const bool ok = w_->Close();
+    const Error err = buf_.Close();
+    return ok && err.empty();
+  }
+
+  // A sink error is more specific than the write error it causes in w_.
+  Error GetError() {
+    const Error err = buf_.Err();
+    return !err.empty() ? err : w_->GetError();
+  }
+
+ private:
+  TeeOutputBuf buf_;
+  std::ostream out_;
+  std::unique_ptr<Writer> w_;  // Writes to out_.
+  bool closed_ = false;
+};
+
+}  // namespace
+
+std::unique_ptr<Writer> NewTeeWriter(std::vector<TeeSink> sinks,
+                                     WriterOpts opts,
+                                     int64_t max_buffered_bytes) {
+  return std::unique_ptr<Writer>(
+      new TeeWriterImpl(std::move(sinks), std::move(opts), max_buffered_bytes));
+}
+
+}  // namespace recordio
+}  // namespace grail
@@ -0,0 +1,132 @@
+#ifndef LIB_RECORDIO_TYPED_H_
+#define LIB_RECORDIO_TYPED_H_
+
+// Readers and writers of recordio files whose records are serialized protocol
+// buffers.
+//
+// Example:
+//   recordio::TypedReader<MyProto> r(recordio::NewReader("test.grail-rio"));
+//   while (r.Scan()) {
+//     const MyProto& msg = r.Get();
+//     .. use msg ..
+//   }
+//   CHECK_EQ(r.GetError(), "");
+#include <google/protobuf/arena.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "./recordio.h"
+
+namespace grail {
+namespace recordio {
+
+// TypedReader parses each record read by a Reader into a Msg. Messages are
+// allocated in a protobuf arena that is reused across records, so reading
+// does not allocate memory in the steady state.
+//
+// This class is thread compatible.
+template <typename Msg>
+class TypedReader {
+ public:
+  explicit TypedReader(std::unique_ptr<Reader> r) : r_(std::move(r)) {
+    ResetArena(kInitialArenaBytes);
+  }
+
+  // Read and parse the next record. Returns false on EOF or error. Check
+  // GetError() to distinguish the two.
+  bool Scan() {
+    msg_ = nullptr;
+    if (!err_.empty() || !r_->Scan()) return false;
+    const size_t allocated = arena_->SpaceAllocated();
+    if (allocated > arena_block_.size()) {
+      // The previous message overflowed the initial block. Grow it so that
+      // later messages of the same size are served from the reused block.
+      ResetArena(allocated * 2);
+    } else {
+      arena_->Reset();
+    }
+    const ByteSpan data = r_->Get();
+    msg_ = google::protobuf::Arena::CreateMessage<Msg>(arena_.get());
+    if (!msg_->ParseFromArray(data.data(), static_cast<int>(data.size()))) {
+      err_ = "Failed to parse " + msg_->GetTypeName();
+      msg_ = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  // Get the current message. It is owned by the reader, and is invalidated on
+  // the next call to Scan or the destructor.
+  //
+  // REQUIRES: The last call to Scan() returned true.
+  const Msg& Get() const { return *msg_; }
+  Msg* Mutable() { return msg_; }
+
+  // Get any error seen by the reader. It returns "" if there is no error.
+  Error GetError() {
+    const Error err = r_->GetError();
+    return err.empty() ? err_ : err;
+  }
+
+  // The underlying reader. Use it to access the header, trailer, or to seek.
+  Reader* reader() { return r_.get(); }
+
+ private:
+  static constexpr size_t kInitialArenaBytes = 64 << 10;
+
+  void ResetArena(size_t bytes) {
+    arena_.reset();
+    arena_block_.resize(bytes);
+    google::protobuf::ArenaOptions opts;
+    opts.initial_block = arena_block_.data();
+    opts.initial_block_size = arena_block_.size();
+    arena_.reset(new google::protobuf::Arena(opts));
+  }
+
+  const std::unique_ptr<Reader> r_;
+  std::vector<char> arena_block_;  // Initial block of arena_, reused.
+  std::unique_ptr<google::protobuf::Arena> arena_;
+  Msg* msg_ = nullptr;
+  Error err_;
+  TypedReader(const TypedReader&) = delete;
+};
+
+// TypedWriter serializes messages directly into the block buffer of a Writer,
+// without an intermediate string.
+//
+// This class is not thread safe.
+template <typename Msg>
+class TypedWriter {
+ public:
+  explicit TypedWriter(std::unique_ptr<Writer> w) : w_(std::move(w)) {}
+
+  // Write a new record. Returns true if successful. Check GetError() on
+  // failure.
+  bool Write(const Msg& msg) {
+    const size_t size = msg.ByteSizeLong();
+    return w_->WriteWith(size, [&msg, size](uint8_t* buf) {
+      return msg.SerializeWithCachedSizesToArray(buf) == buf + size;
+    });
+  }
+
+  // Close the underlying writer. See Writer::Close.
+  bool Close() { return w_->Close(); }
+
+  // Get any error seen by the writer. It returns "" if there is no error.
+  Error GetError() { return w_->GetError(); }
+
+  // The underlying writer.
+  Writer* writer() { return w_.get(); }
+
+ private:
+  const std::unique_ptr<Writer> w_;
+  TypedWriter(const TypedWriter&) = delete;
+};
+
+}  // namespace recordio
+}  // namespace grail
+
+#endif  // LIB_RECORDIO_TYPED_H_
@@ -0,0 +1,107 @@
+#include "./typed.h"
+
+#include <google/protobuf/wrappers.pb.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include "./recordio.h"
+
+namespace grail {
+
+using google::protobuf::StringValue;
+
+std::string TestValue(int n) { return std::string(n % 100, 'a' + n % 26); }
+
+void WriteMessages(const std::string& filename, recordio::WriterOpts opts,
+                   int n) {
+  std::ofstream out(filename);
+  recordio::TypedWriter<StringValue> w(
+      recordio::NewWriter(&out, std::move(opts)));
+  for (int i = 0; i < n; i++) {
+    StringValue msg;
+    msg.set_value(TestValue(i));
+    ASSERT_TRUE(w.Write(msg)) << w.GetError();
+  }
+  ASSERT_TRUE(w.Close()) << w.GetError();
+}
+
+void CheckMessages(const std::string& filename, int n) {
+  recordio::TypedReader<StringValue> r(recordio::NewReader(filename));
+  int i = 0;
+  while (r.Scan()) {
+    ASSERT_EQ(TestValue(i), r.Get().value());
+    ASSERT_NE(nullptr, r.Get().GetArena());
+    i++;
+  }
+  EXPECT_EQ("", r.GetError());
+  EXPECT_EQ(n, i);
+}
+
+TEST(TypedRecordio, Packed) {
+  std::string filename = "/tmp/typed_test.grail-rpk";
+  recordio::WriterOpts opts = recordio::DefaultWriterOpts(filename);
+  opts.max_packed_items = 30;
+  WriteMessages(filename, std::move(opts), 1000);
+  CheckMessages(filename, 1000);
+  remove(filename.c_str());
+}
+
+TEST(TypedRecordio, V2) {
+  std::string filename = "/tmp/typed_test.grail-rio";
+  recordio::WriterOpts opts;
+  opts.v2 = true;
+  opts.transformers.push_back("flate");
+  WriteMessages(filename, std::move(opts), 1000);
+  CheckMessages(filename, 1000);
+  remove(filename.c_str());
+}
+
+TEST(TypedRecordio, LargeMessages) {
+  std::string filename = "/tmp/typed_test.grail-rio";
+  const std::string large(1 << 20, 'x');
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    std::ofstream out(filename);
+    recordio::TypedWriter<StringValue> w(
+        recordio::NewWriter(&out, std::move(opts)));
+    for (int i = 0; i < 3; i++) {
+      StringValue msg;
+      msg.set_value(large);
+      ASSERT_TRUE(w.Write(msg));
+    }
+    ASSERT_TRUE(w.Close());
+  }
+  recordio::TypedReader<StringValue> r(recordio::NewReader(filename));
+  int n = 0;
+  while (r.Scan()) {
+    EXPECT_EQ(large, r.Get().value());
+    n++;
+  }
+  EXPECT_EQ("", r.GetError());
+  EXPECT_EQ(3, n);
+  remove(filename.c_str());
+}
+
+TEST(TypedRecordio, ParseError) {
+  std::string filename = "/tmp/typed_test.grail-rio";
+  {
+    recordio::WriterOpts opts;
+    opts.v2 = true;
+    std::ofstream out(filename);
+    auto w = recordio::NewWriter(&out, std::move(opts));
+    const uint8_t junk[] = {0xff, 0xff, 0xff};
+    ASSERT_TRUE(w->Write(recordio::ByteSpan(junk, sizeof junk)));
+    ASSERT_TRUE(w->Close());
+  }
+  recordio::TypedReader<StringValue> r(recordio::NewReader(filename));
+  EXPECT_FALSE(r.Scan());
+  EXPECT_THAT(r.GetError(), ::testing::HasSubstr("Failed to parse"));
+  remove(filename.c_str());
+}
+
+}  // namespace grail
@@ -1,12 +1,15 @@
 #include <array>
+#include <cmath>
 #include <cstring>
-#include <fstream>
 #include <limits>
+#include <ostream>
 #include <sstream>
 
-#include <iostream>
-
 #include "./portable_endian.h"
+#include "./chunk.h"
+#include "./file.h"
+#include "./header.h"
+#include "./index.h"
 #include "./internal.h"
 #include "./recordio.h"
 
@@ -14,17 +17,40 @@ namespace grail {
 namespace recordio {
 
 Writer::~Writer() {}
+
+bool Writer::WriteWith(size_t size,
+                       const std::function<bool(uint8_t* buf)>& fill) {
+  std::vector<uint8_t> buf(size);
+  if (!fill(buf.data())) {
+    return false;
+  }
+  return Write(ByteSpan(&buf));
+}
 WriterIndexer::~WriterIndexer() {}
 
 namespace {
 
+// If "buf" allocates huge pages, and a block of max_packed_bytes fills at
+// least one, allocate the whole block up front. Growing the buffer would copy
+// it at every doubling.
+void ReserveHugePages(int64_t max_packed_bytes,
+                      internal::HugePageBuffer* buf) {
+  if (buf->get_allocator().huge_pages() &&
+      max_packed_bytes >= static_cast<int64_t>(internal::HugePageSize)) {
+    buf->reserve(max_packed_bytes);
+  }
+}
+
+// FileCloser owns the file created by NewWriter(path).
 class FileCloser {
  public:
-  bool Close() {
-    out.close();
-    return out.good();
+  FileCloser() : out(&buf) {}
+  Error Close() {
+    out.flush();
+    return buf.Close();
   }
-  std::ofstream out;
+  internal::FileOutputBuf buf;
+  std::ostream out;
 };
 
 // class BaseWriter implements a raw writer w/o any transformation.
@@ -39,26 +65,31 @@ class BaseWriter {
         cleanup_(std::move(cleanup)),
         indexer_(std::move(indexer)) {}
 
-  // Write accepts two spans and writes them both, contiguously, into a single
-  // record. It accepts two just to avoid an extra data copy in the packed
-  // writer.
-  bool Write(ByteSpan one, ByteSpan two) {
+  // Write "header" followed by the spans of "data", contiguously, into a
+  // single record. The pieces are written in place, so neither the packed
+  // writer's item table nor a transformer's output spans need to be
+  // concatenated first.
+  bool Write(ByteSpan header, IoVec data) {
     uint64_t block_start = static_cast<uint64_t>(out_->tellp() - initial_pos_);
 
-    if (!WriteHeader(one.size() + two.size())) return false;
+    if (!WriteHeader(header.size() + IoVecSize(data))) return false;
 
-    out_->write(reinterpret_cast<const char*>(one.data()), one.size());
+    out_->write(reinterpret_cast<const char*>(header.data()), header.size());
     if (!out_->good()) {
       SetError(std::string("Failed to write data part 1: ") +
                std::strerror(errno));
       return false;
     }
 
-    if (two.size() > 0) {
-      out_->write(reinterpret_cast<const char*>(two.data()), two.size());
+    for (size_t i = 0; i < data.size(); i++) {
+      if (data[i].size() == 0) continue;
+      out_->write(reinterpret_cast<const char*>(data[i].data()),
+                  data[i].size());
       if (!out_->good()) {
-        SetError(std::string("Failed to write data part 2: ") +
-                 std::strerror(errno));
+        std::ostringstream msg;
+        msg << "Failed to write data part " << i + 2 << ": "
+            << std::strerror(errno);
+        SetError(msg.str());
         return false;
       }
     }
@@ -75,10 +106,12 @@ class BaseWriter {
   }
 
   bool Close() {
-    if (cleanup_ != nullptr && !cleanup_->Close()) {
-      SetError(std::string("Failed to close output file: ") +
-               std::strerror(errno));
-      return false;
+    if (cleanup_ != nullptr) {
+      const Error err = cleanup_->Close();
+      if (!err.empty()) {
+        SetError("Failed to close output file: " + err);
+        return false;
+      }
     }
     return true;
   }
@@ -151,21 +184,15 @@ class UnpackedWriterImpl : public Writer {
         transformer_(std::move(transformer)) {}
 
   bool Write(ByteSpan in) {
+    IoVec out(&in, 1);
     if (transformer_ != nullptr) {
-      IoVec iov(&in, 1);
-      IoVec out;
-      Error err = transformer_->Transform(iov, &out);
+      Error err = transformer_->Transform(IoVec(&in, 1), &out);
       if (!err.empty()) {
         r_.SetError(err);
         return false;
       }
-      if (out.size() != 1) {
-        std::cerr << "TODO: Transformer returned multiple iovec\n";
-        abort();
-      }
-      in = out[0];
     }
-    return r_.Write(in, ByteSpan{nullptr, 0});
+    return r_.Write(ByteSpan{nullptr, 0}, out);
   }
 
   bool Close() { return r_.Close(); }
@@ -181,12 +208,12 @@ class PackedHeaderBuilder {
  public:
   PackedHeaderBuilder() : items_count_(0) {}
 
-  bool AddItemSize(uint32_t size) {
+  bool AddItemSize(uint64_t size) {
     if (items_count_ == std::numeric_limits<uint32_t>::max()) {
       return false;
     }
     items_count_++;
-    AppendUVarint(&sizes_, size);
+    internal::AppendUVarint(&sizes_, size);
     return true;
   }
 
@@ -200,7 +227,7 @@ class PackedHeaderBuilder {
     buf->insert(buf->end(), sizeof(uint32_t), static_cast<uint8_t>(0));
 
     auto varints_offset = buf->size();
-    AppendUVarint(buf, items_count_);
+    internal::AppendUVarint(buf, items_count_);
     buf->insert(buf->end(), sizes_.cbegin(), sizes_.cend());
     uint32_t checksum = internal::Crc32(buf->data() + varints_offset,
                                         buf->size() - varints_offset);
@@ -213,14 +240,6 @@ class PackedHeaderBuilder {
   }
 
  private:
-  void AppendUVarint(std::vector<uint8_t>* buf, uint64_t v) {
-    while (v >= 0x80) {
-      buf->push_back(static_cast<uint8_t>(v) | 0x80);
-      v >>= 7;
-    }
-    buf->push_back(static_cast<uint8_t>(v));
-  }
-
   void WriteLEUint32At(std::vector<uint8_t>* buf, size_t offset, uint32_t v) {
     uint32_t le = htole64(v);
     std::copy(reinterpret_cast<const uint8_t*>(&le),
@@ -238,27 +257,20 @@ class PackedWriterImpl : public Writer {
                             std::unique_ptr<Transformer> transformer,
                             std::unique_ptr<WriterIndexer> indexer,
                             std::unique_ptr<FileCloser> cleanup,
-                            const uint32_t max_packed_items,
-                            const uint32_t max_packed_bytes)
+                            const int64_t max_packed_items,
+                            const int64_t max_packed_bytes, bool huge_pages)
       : r_(out, internal::MagicPacked, std::move(cleanup), std::move(indexer)),
         transformer_(std::move(transformer)),
         max_packed_items_(max_packed_items),
-        max_packed_bytes_(max_packed_bytes) {}
+        max_packed_bytes_(max_packed_bytes),
+        buffered_items_(internal::HugePageAllocator<uint8_t>(huge_pages)) {
+    ReserveHugePages(max_packed_bytes_, &buffered_items_);
+  }
 
   bool Write(ByteSpan item) {
-    if (static_cast<int>(item.size()) > max_packed_bytes_) {
-      r_.SetError("Item size exceeds block size");
+    if (!Reserve(item.size())) {
       return false;
     }
-
-    if ((header_builder_.items_count() + 1) > max_packed_items_ ||
-        static_cast<int>(buffered_items_.size() + item.size()) >
-            max_packed_bytes_) {
-      if (!Flush()) {
-        return false;
-      }
-    }
-
     if (!header_builder_.AddItemSize(item.size())) {
       r_.SetError("Could not add new item");
       return false;
@@ -268,6 +280,25 @@ class PackedWriterImpl : public Writer {
     return true;
   }
 
+  bool WriteWith(size_t size,
+                 const std::function<bool(uint8_t* buf)>& fill) override {
+    if (!Reserve(size)) {
+      return false;
+    }
+    const size_t off = buffered_items_.size();
+    buffered_items_.resize(off + size);
+    if (!fill(buffered_items_.data() + off)) {
+      buffered_items_.resize(off);
+      r_.SetError("Failed to fill item");
+      return false;
+    }
+    if (!header_builder_.AddItemSize(size)) {
+      r_.SetError("Could not add new item");
+      return false;
+    }
+    return true;
+  }
+
   bool Close() {
     if (!Flush()) {
       return false;
@@ -278,24 +309,37 @@ class PackedWriterImpl : public Writer {
   Error GetError() { return r_.GetError(); }
 
  private:
+  // Check that an item of "size" bytes fits in a block, and flush the current
+  // block if the item doesn't fit in it.
+  bool Reserve(size_t size) {
+    if (static_cast<int64_t>(size) > max_packed_bytes_) {
+      r_.SetError("Item size exceeds block size");
+      return false;
+    }
+
+    if ((header_builder_.items_count() + 1) > max_packed_items_ ||
+        static_cast<int64_t>(buffered_items_.size() + size) >
+            max_packed_bytes_) {
+      if (!Flush()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
   bool Flush() {
     std::vector<uint8_t> header;
     header_builder_.AppendHeader(&header);
 
-    ByteSpan transformed = {buffered_items_.data(), buffered_items_.size()};
+    const ByteSpan items = {buffered_items_.data(), buffered_items_.size()};
+    IoVec transformed(&items, 1);
     if (transformer_ != nullptr) {
-      IoVec iov(&transformed, 1);
-      IoVec out;
-      internal::Error err = transformer_->Transform(iov, &out);
+      internal::Error err =
+          transformer_->Transform(IoVec(&items, 1), &transformed);
       if (!err.empty()) {
         r_.SetError(err);
         return false;
       }
-      if (out.size() != 1) {
-        std::cerr << "TODO: Transformer returned multiple iovec\n";
-        abort();
-      }
-      transformed = out[0];
     }
     if (!r_.Write(ByteSpan{header.data(), header.size()}, transformed)) {
       return false;
@@ -312,11 +356,332 @@ class PackedWriterImpl : public Writer {
   const int64_t max_packed_bytes_;
 
   PackedHeaderBuilder header_builder_;
-  std::vector<uint8_t> buffered_items_;
+  internal::HugePageBuffer buffered_items_;
+};
+
+// Implementation of a V2 writer. Every block is packed, and the item table and
+// the items are transformed together and split into chunks.
+class V2WriterImpl : public Writer {
+ public:
+  explicit V2WriterImpl(std::ostream* out, WriterOpts opts,
+                        std::unique_ptr<FileCloser> cleanup)
+      : out_(out),
+        initial_pos_(out->tellp()),
+        cw_(out, &err_),
+        cleanup_(std::move(cleanup)),
+        indexer_(std::move(opts.indexer)),
+        max_packed_items_(opts.max_packed_items),
+        max_packed_bytes_(opts.max_packed_bytes),
+        fixed_item_size_(opts.fixed_item_size),
+        key_extractor_(std::move(opts.key_extractor)),
+        sorted_(opts.sorted),
+        bloom_bits_per_key_(opts.bloom_bits_per_key),
+        chunk_aligned_blocks_(opts.chunk_aligned_blocks),
+        n_items_(0),
+        buffered_items_(internal::HugePageAllocator<uint8_t>(opts.huge_pages)) {
+    ReserveHugePages(max_packed_bytes_, &buffered_items_);
+    if (opts.transformer != nullptr) {
+      err_.Set("V2 writer requires transformers to be set by name");
+      return;
+    }
+    if ((sorted_ || bloom_bits_per_key_ > 0) && !key_extractor_) {
+      err_.Set("Sorted writer and Bloom filters require key_extractor");
+      return;
+    }
+    err_.Set(GetTransformer(opts.transformers, &transformer_));
+    if (!err_.Ok()) return;
+
+    std::vector<HeaderEntry> header = std::move(opts.header);
+    for (const auto& name : opts.transformers) {
+      header.push_back(
+          HeaderEntry{kKeyTransformer,
+                      HeaderValue{HeaderValue::STRING, false, 0, 0, name}});
+    }
+    if (fixed_item_size_ > 0) {
+      header.push_back(HeaderEntry{
+          kKeyFixedItemSize,
+          HeaderValue{HeaderValue::UINT, false, 0, fixed_item_size_, ""}});
+    }
+    if (key_extractor_) {
+      header.push_back(
+          HeaderEntry{kKeyTrailer, HeaderValue{HeaderValue::BOOL, true, 0, 0,
+                                               ""}});
+      header.push_back(
+          HeaderEntry{kKeyBlockIndex, HeaderValue{HeaderValue::BOOL, true, 0,
+                                                  0, ""}});
+    }
+    if (sorted_) {
+      header.push_back(HeaderEntry{
+          kKeySorted, HeaderValue{HeaderValue::BOOL, true, 0, 0, ""}});
+    }
+    WriteHeader(header);
+  }
+
+  bool Write(ByteSpan item) {
+    if (!Reserve(item.size())) {
+      return false;
+    }
+    buffered_items_.insert(buffered_items_.end(), item.begin(), item.end());
+    return AddItemSize(item.size());
+  }
+
+  bool WriteWith(size_t size,
+                 const std::function<bool(uint8_t* buf)>& fill) override {
+    if (!Reserve(size)) {
+      return false;
+    }
+    const size_t off = buffered_items_.size();
+    buffered_items_.resize(off + size);
+    if (!fill(buffered_items_.data() + off)) {
+      buffered_items_.resize(off);
+      err_.Set("Failed to fill item");
+      return false;
+    }
+    return AddItemSize(size);
+  }
+
+  bool Close() {
+    if (!Flush()) {
+      return false;
+    }
+    if (key_extractor_ && !WriteTrailer()) {
+      return false;
+    }
+    if (cleanup_ != nullptr) {
+      const Error err = cleanup_->Close();
+      if (!err.empty()) {
+        err_.Set("Failed to close output file: " + err);
+        return false;
+      }
+    }
+    return err_.Ok();
+  }
+
+  Error GetError() { return err_.Err(); }
+
+ private:
+  // Write the block index as the trailer. Unlike the header, the trailer is
+  // transformed.
+  bool WriteTrailer() {
+    std::vector<uint8_t> encoded;
+    internal::EncodeBlockIndex(index_, &encoded);
+    table_.clear();
+    internal::AppendUVarint(&table_, 1);
+    internal::AppendUVarint(&table_, encoded.size());
+    const ByteSpan spans[2] = {ByteSpan(&table_), ByteSpan(&encoded)};
+    IoVec block;
+    err_.Set(transformer_->Transform(IoVec(spans, 2), &block));
+    if (!err_.Ok()) return false;
+    return cw_.Write(internal::MagicTrailer, block);
+  }
+
+  // Write the header block. The header block is never transformed.
+  void WriteHeader(const std::vector<HeaderEntry>& header) {
+    std::vector<uint8_t> encoded;
+    internal::EncodeHeader(header, &encoded);
+    std::vector<uint8_t> block;
+    internal::AppendUVarint(&block, 1);
+    internal::AppendUVarint(&block, encoded.size());
+    block.insert(block.end(), encoded.begin(), encoded.end());
+    ByteSpan span(&block);
+    cw_.Write(internal::MagicHeader, IoVec(&span, 1));
+  }
+
+  // Check that an item of "size" bytes can be added, and flush the current
+  // block if the item doesn't fit in it.
+  bool Reserve(size_t size) {
+    if (!err_.Ok()) return false;
+    if (fixed_item_size_ > 0 && size != fixed_item_size_) {
+      std::ostringstream msg;
+      msg << "Item size " << size << " differs from fixed item size "
+          << fixed_item_size_;
+      err_.Set(msg.str());
+      return false;
+    }
+    if (static_cast<int64_t>(size) > max_packed_bytes_) {
+      err_.Set("Item size exceeds block size");
+      return false;
+    }
+    if ((n_items_ + 1) > max_packed_items_ ||
+        static_cast<int64_t>(buffered_items_.size() + size) >
+            max_packed_bytes_ ||
+        (chunk_aligned_blocks_ && PastChunkTarget(size))) {
+      return Flush();
+    }
+    return true;
+  }
+
+  // Returns true if adding an item of "size" bytes would make the estimated
+  // transformed size of the block exceed the target. The target is the
+  // largest whole number of chunks that a block can fill before it hits
+  // max_packed_bytes_ or max_packed_items_, less 1/32 of a chunk for
+  // estimation errors. Blocks smaller than one chunk are left to the limits.
+  bool PastChunkTarget(size_t size) const {
+    if (n_items_ == 0) return false;
+    const double table_bytes = 10 + sizes_.size();  // Count and sizes.
+    const double raw = table_bytes + buffered_items_.size();
+    const double per_item = raw / n_items_;
+    const double max_raw =
+        std::min<double>(max_packed_bytes_ + table_bytes,
+                         per_item * max_packed_items_);
+    const double payload = internal::MaxChunkPayloadSize;
+    const double target_chunks = std::floor(max_raw * ratio_ / payload);
+    if (target_chunks < 1) return false;
+    const double target = (target_chunks - 1.0 / 32) * payload;
+    return (raw + size + 10) * ratio_ > target;
+  }
+
+  // Account for the item of "size" bytes at the end of buffered_items_. On
+  // error, the item is removed.
+  bool AddItemSize(size_t size) {
+    if (key_extractor_) {
+      const size_t off = buffered_items_.size() - size;
+      std::string key =
+          key_extractor_(ByteSpan(buffered_items_.data() + off, size));
+      if (sorted_ && has_prev_key_ && key < prev_key_) {
+        buffered_items_.resize(off);
+        err_.Set("Items are not sorted by key");
+        return false;
+      }
+      if (n_items_ == 0 || key < min_key_) min_key_ = key;
+      if (n_items_ == 0 || key > max_key_) max_key_ = key;
+      if (bloom_bits_per_key_ > 0) block_keys_.push_back(key);
+      if (sorted_) {
+        prev_key_ = std::move(key);
+        has_prev_key_ = true;
+      }
+    }
+    n_items_++;
+    if (fixed_item_size_ == 0) {
+      internal::AppendUVarint(&sizes_, size);
+    }
+    return true;
+  }
+
+  bool Flush() {
+    if (!err_.Ok()) return false;
+    if (n_items_ == 0) return true;
+
+    table_.clear();
+    internal::AppendUVarint(&table_, n_items_);
+    table_.insert(table_.end(), sizes_.begin(), sizes_.end());
+    const ByteSpan spans[2] = {
+        ByteSpan(&table_),
+        ByteSpan(buffered_items_.data(), buffered_items_.size())};
+    IoVec block;
+    err_.Set(transformer_->Transform(IoVec(spans, 2), &block));
+    if (!err_.Ok()) return false;
+    if (chunk_aligned_blocks_) {
+      // Track the transformed/raw size ratio, weighting recent blocks more.
+      const double ratio = static_cast<double>(IoVecSize(block)) /
+                           (table_.size() + buffered_items_.size());
+      ratio_ = n_blocks_ == 0 ? ratio : (ratio_ + ratio) / 2;
+      n_blocks_++;
+    }
+
+    const uint64_t block_start =
+        static_cast<uint64_t>(out_->tellp() - initial_pos_);
+    if (!cw_.Write(internal::MagicPacked, block)) return false;
+    if (indexer_ != nullptr) {
+      std::string error = indexer_->IndexBlock(block_start);
+      if (!error.empty()) {
+        err_.Set(std::string("Indexer error: ") + error);
+        return false;
+      }
+    }
+    if (key_extractor_) {
+      index_.blocks.push_back(internal::BlockKeyStats{
+          static_cast<int64_t>(block_start), static_cast<uint64_t>(n_items_),
+          std::move(min_key_), std::move(max_key_)});
+      if (bloom_bits_per_key_ > 0) {
+        index_.bloom_filters.push_back(
+            internal::NewBloomFilter(block_keys_, bloom_bits_per_key_));
+        block_keys_.clear();
+      }
+    }
+    n_items_ = 0;
+    sizes_.clear();
+    buffered_items_.clear();
+    return true;
+  }
+
+  internal::ErrorReporter err_;
+  std::ostream* const out_;
+  const std::streampos initial_pos_;
+  internal::ChunkWriter cw_;
+  const std::unique_ptr<FileCloser> cleanup_;
+  const std::unique_ptr<WriterIndexer> indexer_;
+  std::unique_ptr<Transformer> transformer_;
+
+  const int64_t max_packed_items_;
+  const int64_t max_packed_bytes_;
+  const uint64_t fixed_item_size_;
+  const std::function<std::string(ByteSpan item)> key_extractor_;
+  const bool sorted_;
+  const int bloom_bits_per_key_;
+  const bool chunk_aligned_blocks_;
+
+  int64_t n_items_;
+  std::vector<uint8_t> sizes_;  // uvarint item sizes, unless fixed_item_size_.
+  std::vector<uint8_t> table_;  // item count followed by sizes_.
+  internal::HugePageBuffer buffered_items_;
+
+  // Key range of the items in buffered_items_. Only with key_extractor_.
+  std::string min_key_;
+  std::string max_key_;
+  internal::BlockIndex index_;  // Stats of the blocks written so far.
+  std::string prev_key_;        // Key of the last item. Only if sorted_.
+  bool has_prev_key_ = false;
+  // Keys in buffered_items_. Only if bloom_bits_per_key_ > 0.
+  std::vector<std::string> block_keys_;
+
+  // Estimated transformed/raw size ratio. Only if chunk_aligned_blocks_.
+  double ratio_ = 1;
+  int64_t n_blocks_ = 0;  // Blocks written so far.
 };
 
+// Writer that fails every operation with a fixed error.
+class ErrorWriterImpl : public Writer {
+ public:
+  explicit ErrorWriterImpl(Error err) : err_(std::move(err)) {}
+  bool Write(ByteSpan) { return false; }
+  bool Close() { return false; }
+  Error GetError() { return err_; }
+
+ private:
+  const Error err_;
+};
+
+std::unique_ptr<Writer> NewWriterWithCloser(
+    std::ostream* out, WriterOpts opts, std::unique_ptr<FileCloser> cleanup) {
+  if (opts.v2) {
+    return std::unique_ptr<Writer>(
+        new V2WriterImpl(out, std::move(opts), std::move(cleanup)));
+  }
+  if (opts.key_extractor || opts.sorted || opts.bloom_bits_per_key > 0) {
+    return std::unique_ptr<Writer>(
+        new ErrorWriterImpl("key_extractor requires the V2 format"));
+  }
+  if (opts.packed) {
+    return std::unique_ptr<Writer>(new PackedWriterImpl(
+        out, std::move(opts.transformer), std::move(opts.indexer),
+        std::move(cleanup), opts.max_packed_items, opts.max_packed_bytes,
+        opts.huge_pages));
+  } else {
+    return std::unique_ptr<Writer>(
+        new UnpackedWriterImpl(out, std::move(opts.transformer),
+                               std::move(opts.indexer), std::move(cleanup)));
+  }
+}
+
 }  // namespace
 
+namespace internal {
+std::unique_ptr<Writer> NewErrorWriter(Error err) {
+  return std::unique_ptr<Writer>(new ErrorWriterImpl(std::move(err)));
+}
+}  // namespace internal
+
 WriterOpts DefaultWriterOpts(const std::string& path) {
   WriterOpts r;
   if (internal::HasSuffix(path, ".grail-rio")) {
@@ -336,30 +701,22 @@ WriterOpts DefaultWriterOpts(const std::string& path) {
 }
 
 std::unique_ptr<Writer> NewWriter(std::ostream* out, WriterOpts opts) {
-  if (opts.packed) {
-    return std::unique_ptr<Writer>(new PackedWriterImpl(
-        out, std::move(opts.transformer), std::move(opts.indexer), nullptr,
-        opts.max_packed_items, opts.max_packed_bytes));
-  } else {
-    return std::unique_ptr<Writer>(new UnpackedWriterImpl(
-        out, std::move(opts.transformer), std::move(opts.indexer), nullptr));
-  }
+  return NewWriterWithCloser(out, std::move(opts), nullptr);
 }
 
-std::unique_ptr<Writer> NewWriter(const std::string& path) {
-  auto opts = DefaultWriterOpts(path);
-
+std::unique_ptr<Writer> NewWriter(const std::string& path, WriterOpts opts) {
   std::unique_ptr<FileCloser> c(new FileCloser);
-  c->out.open(path.c_str());
-  if (opts.packed) {
-    return std::unique_ptr<Writer>(new PackedWriterImpl(
-        &c->out, std::move(opts.transformer), std::move(opts.indexer),
-        std::move(c), opts.max_packed_items, opts.max_packed_bytes));
-  } else {
-    return std::unique_ptr<Writer>(
-        new UnpackedWriterImpl(&c->out, std::move(opts.transformer),
-                               std::move(opts.indexer), std::move(c)));
+  const Error err = c->buf.Open(path, opts.direct_io, opts.expected_size);
+  if (!err.empty()) {
+    return internal::NewErrorWriter(err);
   }
+  // Take the stream address before "c" is moved into the writer.
+  std::ostream* out = &c->out;
+  return NewWriterWithCloser(out, std::move(opts), std::move(c));
+}
+
+std::unique_ptr<Writer> NewWriter(const std::string& path) {
+  return NewWriter(path, DefaultWriterOpts(path));
 }
 
 }  // namespace recordio